@@ -30,53 +30,39 @@ void Gene::add_exon(Interval it)
         }
 }
 
-int Gene::distance_to_end(Interval it)
+int Gene::distance_to_end(Interval it) const
 {
+    // first exon ending at or after the read start, flattened exons are sorted and disjoint
+    auto iter = std::lower_bound(exon_vec.begin(), exon_vec.end(), it.st,
+        [] (const Interval &exon, int pos) { return exon.en < pos; }
+    );
+    if (iter == exon_vec.end())
+    {
+        return 0;
+    }
+    size_t i = iter - exon_vec.begin();
+
     int distance = 0;
-    int tmp_en = 0;
-    auto iter = std::lower_bound(exon_vec.begin(), exon_vec.end(), it);
     if (snd == 1)
     {
-        distance += iter->en - ((iter->st)>it.st?(iter->st):it.st);
-        tmp_en = iter->en;
-        for (auto i = iter+1; i != exon_vec.end(); ++i)
-        {
-            if (tmp_en < i->st)
-            {
-                distance += i->en - i->st;
-                tmp_en = i->en;
-            }
-
-        }
-
+        distance = iter->en - std::max(iter->st, it.st) + exon_len_sum.back() - exon_len_sum[i + 1];
     }
     else if (snd == -1)
     {
-        for (auto i = exon_vec.begin(); i != iter; ++i)
-        {
-            if (tmp_en < i->st)
-            {
-                distance += i->en - i->st;
-                tmp_en = i->en;
-            }
-        }
-        if (tmp_en < iter->st)
-        {
-            distance += ((iter->en)<it.en?(iter->en):it.en) - iter->st;
-        }
+        distance = exon_len_sum[i] + std::min(iter->en, it.en) - iter->st;
     }
 
     return distance;
 }
 
 
-bool Gene::in_exon(const Interval &it)
+bool Gene::in_exon(const Interval &it) const
 {
     auto search_result = std::find(exon_vec.begin(), exon_vec.end(), it);
     return search_result != exon_vec.end();
 }
 
-bool Gene::in_exon(const Interval &it, const bool check_strand)
+bool Gene::in_exon(const Interval &it, const bool check_strand) const
 {
     if (check_strand && (it.snd*snd == -1))
     {
@@ -89,6 +75,14 @@ bool Gene::in_exon(const Interval &it, const bool check_strand)
     }
 }
 
+bool Gene::within_exon(const Interval &it) const
+{
+    auto iter = std::lower_bound(exon_vec.begin(), exon_vec.end(), it.st,
+        [] (const Interval &exon, int pos) { return exon.en < pos; }
+    );
+    return iter != exon_vec.end() && iter->st <= it.st && it.en <= iter->en;
+}
+
 void Gene::sort_exon()
 {
     std::sort(exon_vec.begin(), exon_vec.end(),
@@ -119,6 +113,12 @@ void Gene::flatten_exon() {
     }
 
     exon_vec = merged_exons;
+
+    exon_len_sum.assign(1, 0);
+    for (const auto &exon : exon_vec)
+    {
+        exon_len_sum.push_back(exon_len_sum.back() + exon.en - exon.st);
+    }
 }
 
 std::ostream& operator<< (std::ostream& out, const Gene& obj)
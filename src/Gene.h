@@ -21,19 +21,27 @@ public:
 
     void set_ID(std::string id);
     
-    int distance_to_end(Interval it);
+    // exon length from the read to the 3' end of the gene, the exons must be flattened
+    int distance_to_end(Interval it) const;
 
     void add_exon(Interval it);
 
-    bool in_exon(const Interval &it);
-    bool in_exon(const Interval &it, const bool check_strand);
+    bool in_exon(const Interval &it) const;
+    bool in_exon(const Interval &it, const bool check_strand) const;
+    // whether `it` lies entirely inside a single exon, the exons must be flattened
+    bool within_exon(const Interval &it) const;
 
     // sort exons by starting position
     void sort_exon();
     // flattens exons so that overlapping exons are merged
+    // also builds the cumulative exon lengths used by `distance_to_end`
     void flatten_exon();
 
     friend std::ostream& operator<< (std::ostream& out, const Gene& obj);
+
+private:
+    // total length of the first i exons at index i, one more entry than `exon_vec`
+    std::vector<int> exon_len_sum;
 };
 
 #endif
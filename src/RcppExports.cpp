@@ -67,30 +67,37 @@ BEGIN_RCPP
 END_RCPP
 }
 // rcpp_sc_exon_mapping_df_anno
-void rcpp_sc_exon_mapping_df_anno(Rcpp::CharacterVector inbam, Rcpp::CharacterVector outbam, Rcpp::DataFrame anno, Rcpp::CharacterVector am, Rcpp::CharacterVector ge, Rcpp::CharacterVector bc, Rcpp::CharacterVector mb, Rcpp::NumericVector bc_len, Rcpp::CharacterVector bc_vector, Rcpp::NumericVector UMI_len, Rcpp::NumericVector stnd, Rcpp::NumericVector fix_chr, Rcpp::NumericVector nthreads);
-RcppExport SEXP _scPipe_rcpp_sc_exon_mapping_df_anno(SEXP inbamSEXP, SEXP outbamSEXP, SEXP annoSEXP, SEXP amSEXP, SEXP geSEXP, SEXP bcSEXP, SEXP mbSEXP, SEXP bc_lenSEXP, SEXP bc_vectorSEXP, SEXP UMI_lenSEXP, SEXP stndSEXP, SEXP fix_chrSEXP, SEXP nthreadsSEXP) {
+void rcpp_sc_exon_mapping_df_anno(Rcpp::CharacterVector inbam, Rcpp::CharacterVector outbam, Rcpp::RObject anno, Rcpp::CharacterVector am, Rcpp::CharacterVector ge, Rcpp::CharacterVector bc, Rcpp::CharacterVector mb, Rcpp::CharacterVector vs, Rcpp::NumericVector bc_len, Rcpp::CharacterVector bc_vector, Rcpp::NumericVector UMI_len, Rcpp::NumericVector stnd, Rcpp::NumericVector fix_chr, Rcpp::CharacterVector lookup_chr, Rcpp::List feature_sets, Rcpp::LogicalVector slim_bam, Rcpp::LogicalVector drop_names, Rcpp::NumericVector compress_level, Rcpp::LogicalVector ordered_merge, Rcpp::NumericVector nthreads);
+RcppExport SEXP _scPipe_rcpp_sc_exon_mapping_df_anno(SEXP inbamSEXP, SEXP outbamSEXP, SEXP annoSEXP, SEXP amSEXP, SEXP geSEXP, SEXP bcSEXP, SEXP mbSEXP, SEXP vsSEXP, SEXP bc_lenSEXP, SEXP bc_vectorSEXP, SEXP UMI_lenSEXP, SEXP stndSEXP, SEXP fix_chrSEXP, SEXP lookup_chrSEXP, SEXP feature_setsSEXP, SEXP slim_bamSEXP, SEXP drop_namesSEXP, SEXP compress_levelSEXP, SEXP ordered_mergeSEXP, SEXP nthreadsSEXP) {
 BEGIN_RCPP
     Rcpp::RNGScope rcpp_rngScope_gen;
     Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type inbam(inbamSEXP);
     Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type outbam(outbamSEXP);
-    Rcpp::traits::input_parameter< Rcpp::DataFrame >::type anno(annoSEXP);
+    Rcpp::traits::input_parameter< Rcpp::RObject >::type anno(annoSEXP);
     Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type am(amSEXP);
     Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type ge(geSEXP);
     Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type bc(bcSEXP);
     Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type mb(mbSEXP);
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type vs(vsSEXP);
     Rcpp::traits::input_parameter< Rcpp::NumericVector >::type bc_len(bc_lenSEXP);
     Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type bc_vector(bc_vectorSEXP);
     Rcpp::traits::input_parameter< Rcpp::NumericVector >::type UMI_len(UMI_lenSEXP);
     Rcpp::traits::input_parameter< Rcpp::NumericVector >::type stnd(stndSEXP);
     Rcpp::traits::input_parameter< Rcpp::NumericVector >::type fix_chr(fix_chrSEXP);
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type lookup_chr(lookup_chrSEXP);
+    Rcpp::traits::input_parameter< Rcpp::List >::type feature_sets(feature_setsSEXP);
+    Rcpp::traits::input_parameter< Rcpp::LogicalVector >::type slim_bam(slim_bamSEXP);
+    Rcpp::traits::input_parameter< Rcpp::LogicalVector >::type drop_names(drop_namesSEXP);
+    Rcpp::traits::input_parameter< Rcpp::NumericVector >::type compress_level(compress_levelSEXP);
+    Rcpp::traits::input_parameter< Rcpp::LogicalVector >::type ordered_merge(ordered_mergeSEXP);
     Rcpp::traits::input_parameter< Rcpp::NumericVector >::type nthreads(nthreadsSEXP);
-    rcpp_sc_exon_mapping_df_anno(inbam, outbam, anno, am, ge, bc, mb, bc_len, bc_vector, UMI_len, stnd, fix_chr, nthreads);
+    rcpp_sc_exon_mapping_df_anno(inbam, outbam, anno, am, ge, bc, mb, vs, bc_len, bc_vector, UMI_len, stnd, fix_chr, lookup_chr, feature_sets, slim_bam, drop_names, compress_level, ordered_merge, nthreads);
     return R_NilValue;
 END_RCPP
 }
 // rcpp_sc_demultiplex
-void rcpp_sc_demultiplex(Rcpp::CharacterVector inbam, Rcpp::CharacterVector outdir, Rcpp::CharacterVector bc_anno, Rcpp::NumericVector max_mis, Rcpp::CharacterVector am, Rcpp::CharacterVector ge, Rcpp::CharacterVector bc, Rcpp::CharacterVector mb, Rcpp::CharacterVector mito, Rcpp::LogicalVector has_UMI, Rcpp::NumericVector nthreads);
-RcppExport SEXP _scPipe_rcpp_sc_demultiplex(SEXP inbamSEXP, SEXP outdirSEXP, SEXP bc_annoSEXP, SEXP max_misSEXP, SEXP amSEXP, SEXP geSEXP, SEXP bcSEXP, SEXP mbSEXP, SEXP mitoSEXP, SEXP has_UMISEXP, SEXP nthreadsSEXP) {
+void rcpp_sc_demultiplex(Rcpp::CharacterVector inbam, Rcpp::CharacterVector outdir, Rcpp::CharacterVector bc_anno, Rcpp::NumericVector max_mis, Rcpp::CharacterVector am, Rcpp::CharacterVector ge, Rcpp::CharacterVector bc, Rcpp::CharacterVector mb, Rcpp::CharacterVector vs, Rcpp::CharacterVector feature_tags, Rcpp::CharacterVector mito, Rcpp::LogicalVector has_UMI, Rcpp::LogicalVector binary_counts, Rcpp::NumericVector nthreads);
+RcppExport SEXP _scPipe_rcpp_sc_demultiplex(SEXP inbamSEXP, SEXP outdirSEXP, SEXP bc_annoSEXP, SEXP max_misSEXP, SEXP amSEXP, SEXP geSEXP, SEXP bcSEXP, SEXP mbSEXP, SEXP vsSEXP, SEXP feature_tagsSEXP, SEXP mitoSEXP, SEXP has_UMISEXP, SEXP binary_countsSEXP, SEXP nthreadsSEXP) {
 BEGIN_RCPP
     Rcpp::RNGScope rcpp_rngScope_gen;
     Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type inbam(inbamSEXP);
@@ -101,16 +108,19 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type ge(geSEXP);
     Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type bc(bcSEXP);
     Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type mb(mbSEXP);
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type vs(vsSEXP);
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type feature_tags(feature_tagsSEXP);
     Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type mito(mitoSEXP);
     Rcpp::traits::input_parameter< Rcpp::LogicalVector >::type has_UMI(has_UMISEXP);
+    Rcpp::traits::input_parameter< Rcpp::LogicalVector >::type binary_counts(binary_countsSEXP);
     Rcpp::traits::input_parameter< Rcpp::NumericVector >::type nthreads(nthreadsSEXP);
-    rcpp_sc_demultiplex(inbam, outdir, bc_anno, max_mis, am, ge, bc, mb, mito, has_UMI, nthreads);
+    rcpp_sc_demultiplex(inbam, outdir, bc_anno, max_mis, am, ge, bc, mb, vs, feature_tags, mito, has_UMI, binary_counts, nthreads);
     return R_NilValue;
 END_RCPP
 }
 // rcpp_sc_clean_bam
-void rcpp_sc_clean_bam(Rcpp::CharacterVector inbam, Rcpp::CharacterVector outbam, Rcpp::CharacterVector bc_anno, Rcpp::NumericVector max_mis, Rcpp::CharacterVector am, Rcpp::CharacterVector ge, Rcpp::CharacterVector bc, Rcpp::CharacterVector mb, Rcpp::CharacterVector mito, Rcpp::NumericVector nthreads);
-RcppExport SEXP _scPipe_rcpp_sc_clean_bam(SEXP inbamSEXP, SEXP outbamSEXP, SEXP bc_annoSEXP, SEXP max_misSEXP, SEXP amSEXP, SEXP geSEXP, SEXP bcSEXP, SEXP mbSEXP, SEXP mitoSEXP, SEXP nthreadsSEXP) {
+void rcpp_sc_clean_bam(Rcpp::CharacterVector inbam, Rcpp::CharacterVector outbam, Rcpp::CharacterVector bc_anno, Rcpp::NumericVector max_mis, Rcpp::CharacterVector am, Rcpp::CharacterVector ge, Rcpp::CharacterVector bc, Rcpp::CharacterVector mb, Rcpp::CharacterVector mito, Rcpp::CharacterVector output_format, Rcpp::LogicalVector cell_index, Rcpp::NumericVector nthreads);
+RcppExport SEXP _scPipe_rcpp_sc_clean_bam(SEXP inbamSEXP, SEXP outbamSEXP, SEXP bc_annoSEXP, SEXP max_misSEXP, SEXP amSEXP, SEXP geSEXP, SEXP bcSEXP, SEXP mbSEXP, SEXP mitoSEXP, SEXP output_formatSEXP, SEXP cell_indexSEXP, SEXP nthreadsSEXP) {
 BEGIN_RCPP
     Rcpp::RNGScope rcpp_rngScope_gen;
     Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type inbam(inbamSEXP);
@@ -122,8 +132,35 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type bc(bcSEXP);
     Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type mb(mbSEXP);
     Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type mito(mitoSEXP);
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type output_format(output_formatSEXP);
+    Rcpp::traits::input_parameter< Rcpp::LogicalVector >::type cell_index(cell_indexSEXP);
     Rcpp::traits::input_parameter< Rcpp::NumericVector >::type nthreads(nthreadsSEXP);
-    rcpp_sc_clean_bam(inbam, outbam, bc_anno, max_mis, am, ge, bc, mb, mito, nthreads);
+    rcpp_sc_clean_bam(inbam, outbam, bc_anno, max_mis, am, ge, bc, mb, mito, output_format, cell_index, nthreads);
+    return R_NilValue;
+END_RCPP
+}
+// rcpp_sc_fetch_cell_reads
+int rcpp_sc_fetch_cell_reads(Rcpp::CharacterVector inbam, Rcpp::CharacterVector index, Rcpp::CharacterVector cell_id, Rcpp::CharacterVector outbam);
+RcppExport SEXP _scPipe_rcpp_sc_fetch_cell_reads(SEXP inbamSEXP, SEXP indexSEXP, SEXP cell_idSEXP, SEXP outbamSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type inbam(inbamSEXP);
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type index(indexSEXP);
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type cell_id(cell_idSEXP);
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type outbam(outbamSEXP);
+    rcpp_result_gen = Rcpp::wrap(rcpp_sc_fetch_cell_reads(inbam, index, cell_id, outbam));
+    return rcpp_result_gen;
+END_RCPP
+}
+// rcpp_sc_write_whitelist
+void rcpp_sc_write_whitelist(Rcpp::CharacterVector bc_anno, Rcpp::CharacterVector out_fn);
+RcppExport SEXP _scPipe_rcpp_sc_write_whitelist(SEXP bc_annoSEXP, SEXP out_fnSEXP) {
+BEGIN_RCPP
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type bc_anno(bc_annoSEXP);
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type out_fn(out_fnSEXP);
+    rcpp_sc_write_whitelist(bc_anno, out_fn);
     return R_NilValue;
 END_RCPP
 }
@@ -140,6 +177,62 @@ BEGIN_RCPP
     return R_NilValue;
 END_RCPP
 }
+// rcpp_sc_velocity_counting
+void rcpp_sc_velocity_counting(Rcpp::CharacterVector outdir, Rcpp::CharacterVector bc_anno, Rcpp::NumericVector UMI_cor, Rcpp::NumericVector gene_fl);
+RcppExport SEXP _scPipe_rcpp_sc_velocity_counting(SEXP outdirSEXP, SEXP bc_annoSEXP, SEXP UMI_corSEXP, SEXP gene_flSEXP) {
+BEGIN_RCPP
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type outdir(outdirSEXP);
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type bc_anno(bc_annoSEXP);
+    Rcpp::traits::input_parameter< Rcpp::NumericVector >::type UMI_cor(UMI_corSEXP);
+    Rcpp::traits::input_parameter< Rcpp::NumericVector >::type gene_fl(gene_flSEXP);
+    rcpp_sc_velocity_counting(outdir, bc_anno, UMI_cor, gene_fl);
+    return R_NilValue;
+END_RCPP
+}
+// rcpp_sc_feature_counting
+void rcpp_sc_feature_counting(Rcpp::CharacterVector outdir, Rcpp::CharacterVector bc_anno, Rcpp::CharacterVector feature_sets, Rcpp::NumericVector UMI_cor, Rcpp::NumericVector gene_fl);
+RcppExport SEXP _scPipe_rcpp_sc_feature_counting(SEXP outdirSEXP, SEXP bc_annoSEXP, SEXP feature_setsSEXP, SEXP UMI_corSEXP, SEXP gene_flSEXP) {
+BEGIN_RCPP
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type outdir(outdirSEXP);
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type bc_anno(bc_annoSEXP);
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type feature_sets(feature_setsSEXP);
+    Rcpp::traits::input_parameter< Rcpp::NumericVector >::type UMI_cor(UMI_corSEXP);
+    Rcpp::traits::input_parameter< Rcpp::NumericVector >::type gene_fl(gene_flSEXP);
+    rcpp_sc_feature_counting(outdir, bc_anno, feature_sets, UMI_cor, gene_fl);
+    return R_NilValue;
+END_RCPP
+}
+// rcpp_sc_count_aligned_bam
+void rcpp_sc_count_aligned_bam(Rcpp::CharacterVector inbam, Rcpp::CharacterVector outbam, Rcpp::RObject anno, Rcpp::CharacterVector outdir, Rcpp::CharacterVector bc_anno, Rcpp::CharacterVector am, Rcpp::CharacterVector ge, Rcpp::CharacterVector bc, Rcpp::CharacterVector mb, Rcpp::NumericVector bc_len, Rcpp::CharacterVector bc_vector, Rcpp::NumericVector UMI_len, Rcpp::NumericVector stnd, Rcpp::NumericVector fix_chr, Rcpp::NumericVector max_mis, Rcpp::CharacterVector mito, Rcpp::LogicalVector has_UMI, Rcpp::NumericVector UMI_cor, Rcpp::NumericVector gene_fl, Rcpp::NumericVector nthreads);
+RcppExport SEXP _scPipe_rcpp_sc_count_aligned_bam(SEXP inbamSEXP, SEXP outbamSEXP, SEXP annoSEXP, SEXP outdirSEXP, SEXP bc_annoSEXP, SEXP amSEXP, SEXP geSEXP, SEXP bcSEXP, SEXP mbSEXP, SEXP bc_lenSEXP, SEXP bc_vectorSEXP, SEXP UMI_lenSEXP, SEXP stndSEXP, SEXP fix_chrSEXP, SEXP max_misSEXP, SEXP mitoSEXP, SEXP has_UMISEXP, SEXP UMI_corSEXP, SEXP gene_flSEXP, SEXP nthreadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type inbam(inbamSEXP);
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type outbam(outbamSEXP);
+    Rcpp::traits::input_parameter< Rcpp::RObject >::type anno(annoSEXP);
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type outdir(outdirSEXP);
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type bc_anno(bc_annoSEXP);
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type am(amSEXP);
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type ge(geSEXP);
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type bc(bcSEXP);
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type mb(mbSEXP);
+    Rcpp::traits::input_parameter< Rcpp::NumericVector >::type bc_len(bc_lenSEXP);
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type bc_vector(bc_vectorSEXP);
+    Rcpp::traits::input_parameter< Rcpp::NumericVector >::type UMI_len(UMI_lenSEXP);
+    Rcpp::traits::input_parameter< Rcpp::NumericVector >::type stnd(stndSEXP);
+    Rcpp::traits::input_parameter< Rcpp::NumericVector >::type fix_chr(fix_chrSEXP);
+    Rcpp::traits::input_parameter< Rcpp::NumericVector >::type max_mis(max_misSEXP);
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type mito(mitoSEXP);
+    Rcpp::traits::input_parameter< Rcpp::LogicalVector >::type has_UMI(has_UMISEXP);
+    Rcpp::traits::input_parameter< Rcpp::NumericVector >::type UMI_cor(UMI_corSEXP);
+    Rcpp::traits::input_parameter< Rcpp::NumericVector >::type gene_fl(gene_flSEXP);
+    Rcpp::traits::input_parameter< Rcpp::NumericVector >::type nthreads(nthreadsSEXP);
+    rcpp_sc_count_aligned_bam(inbam, outbam, anno, outdir, bc_anno, am, ge, bc, mb, bc_len, bc_vector, UMI_len, stnd, fix_chr, max_mis, mito, has_UMI, UMI_cor, gene_fl, nthreads);
+    return R_NilValue;
+END_RCPP
+}
 // rcpp_sc_detect_bc
 void rcpp_sc_detect_bc(Rcpp::CharacterVector infq, Rcpp::CharacterVector outcsv, Rcpp::CharacterVector prefix, Rcpp::NumericVector bc_len, Rcpp::NumericVector max_reads, Rcpp::NumericVector number_of_cells, Rcpp::NumericVector min_count, Rcpp::NumericVector max_mismatch, Rcpp::CharacterVector white_list);
 RcppExport SEXP _scPipe_rcpp_sc_detect_bc(SEXP infqSEXP, SEXP outcsvSEXP, SEXP prefixSEXP, SEXP bc_lenSEXP, SEXP max_readsSEXP, SEXP number_of_cellsSEXP, SEXP min_countSEXP, SEXP max_mismatchSEXP, SEXP white_listSEXP) {
@@ -253,10 +346,15 @@ static const R_CallMethodDef CallEntries[] = {
     {"_scPipe_check_barcode_reads", (DL_FUNC) &_scPipe_check_barcode_reads, 6},
     {"_scPipe_rcpp_sc_trim_barcode_paired", (DL_FUNC) &_scPipe_rcpp_sc_trim_barcode_paired, 14},
     {"_scPipe_rcpp_sc_exon_mapping", (DL_FUNC) &_scPipe_rcpp_sc_exon_mapping, 13},
-    {"_scPipe_rcpp_sc_exon_mapping_df_anno", (DL_FUNC) &_scPipe_rcpp_sc_exon_mapping_df_anno, 13},
-    {"_scPipe_rcpp_sc_demultiplex", (DL_FUNC) &_scPipe_rcpp_sc_demultiplex, 11},
-    {"_scPipe_rcpp_sc_clean_bam", (DL_FUNC) &_scPipe_rcpp_sc_clean_bam, 10},
+    {"_scPipe_rcpp_sc_exon_mapping_df_anno", (DL_FUNC) &_scPipe_rcpp_sc_exon_mapping_df_anno, 20},
+    {"_scPipe_rcpp_sc_demultiplex", (DL_FUNC) &_scPipe_rcpp_sc_demultiplex, 14},
+    {"_scPipe_rcpp_sc_clean_bam", (DL_FUNC) &_scPipe_rcpp_sc_clean_bam, 12},
+    {"_scPipe_rcpp_sc_fetch_cell_reads", (DL_FUNC) &_scPipe_rcpp_sc_fetch_cell_reads, 4},
+    {"_scPipe_rcpp_sc_write_whitelist", (DL_FUNC) &_scPipe_rcpp_sc_write_whitelist, 2},
     {"_scPipe_rcpp_sc_gene_counting", (DL_FUNC) &_scPipe_rcpp_sc_gene_counting, 4},
+    {"_scPipe_rcpp_sc_velocity_counting", (DL_FUNC) &_scPipe_rcpp_sc_velocity_counting, 4},
+    {"_scPipe_rcpp_sc_feature_counting", (DL_FUNC) &_scPipe_rcpp_sc_feature_counting, 5},
+    {"_scPipe_rcpp_sc_count_aligned_bam", (DL_FUNC) &_scPipe_rcpp_sc_count_aligned_bam, 20},
     {"_scPipe_rcpp_sc_detect_bc", (DL_FUNC) &_scPipe_rcpp_sc_detect_bc, 9},
     {"_scPipe_rcpp_sc_atac_trim_barcode", (DL_FUNC) &_scPipe_rcpp_sc_atac_trim_barcode, 16},
     {"_scPipe_rcpp_sc_atac_trim_barcode_paired", (DL_FUNC) &_scPipe_rcpp_sc_atac_trim_barcode_paired, 15},
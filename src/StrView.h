@@ -0,0 +1,160 @@
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifndef STRVIEW_H
+#define STRVIEW_H
+
+// non-owning view of a character range, used to tokenise large text buffers
+// without allocating a std::string for every field.
+// the underlying buffer must outlive the view.
+struct StrView
+{
+    const char *ptr;
+    size_t len;
+
+    StrView() : ptr(nullptr), len(0) {}
+    StrView(const char *p, size_t l) : ptr(p), len(l) {}
+    StrView(const std::string &s) : ptr(s.data()), len(s.size()) {}
+
+    bool empty() const { return len == 0; }
+    size_t size() const { return len; }
+    char operator[](size_t i) const { return ptr[i]; }
+    const char *begin() const { return ptr; }
+    const char *end() const { return ptr + len; }
+
+    std::string str() const { return std::string(ptr, len); }
+
+    StrView substr(size_t pos, size_t n = std::string::npos) const
+    {
+        if (pos > len) pos = len;
+        if (n > len - pos) n = len - pos;
+        return StrView(ptr + pos, n);
+    }
+
+    size_t find(char c, size_t from = 0) const
+    {
+        for (size_t i = from; i < len; i++)
+        {
+            if (ptr[i] == c) return i;
+        }
+        return std::string::npos;
+    }
+
+    size_t find(const char *s, size_t from = 0) const
+    {
+        size_t n = std::strlen(s);
+        if (n > len) return std::string::npos;
+        for (size_t i = from; i + n <= len; i++)
+        {
+            if (std::memcmp(ptr + i, s, n) == 0) return i;
+        }
+        return std::string::npos;
+    }
+
+    size_t rfind(char c) const
+    {
+        for (size_t i = len; i > 0; i--)
+        {
+            if (ptr[i - 1] == c) return i - 1;
+        }
+        return std::string::npos;
+    }
+
+    bool starts_with(const char *s) const
+    {
+        size_t n = std::strlen(s);
+        return n <= len && std::memcmp(ptr, s, n) == 0;
+    }
+
+    bool operator==(const char *s) const
+    {
+        size_t n = std::strlen(s);
+        return n == len && std::memcmp(ptr, s, n) == 0;
+    }
+    bool operator!=(const char *s) const { return !(*this == s); }
+
+    bool operator==(const StrView &o) const
+    {
+        return len == o.len && std::memcmp(ptr, o.ptr, len) == 0;
+    }
+    bool operator!=(const StrView &o) const { return !(*this == o); }
+
+    // remove leading and trailing spaces, tabs and carriage returns
+    StrView trim() const
+    {
+        size_t st = 0;
+        size_t en = len;
+        while (st < en && (ptr[st] == ' ' || ptr[st] == '\t' || ptr[st] == '\r')) st++;
+        while (en > st && (ptr[en - 1] == ' ' || ptr[en - 1] == '\t' || ptr[en - 1] == '\r')) en--;
+        return StrView(ptr + st, en - st);
+    }
+
+    // parse a leading (optionally signed) decimal integer, like atoi
+    long to_long() const
+    {
+        size_t i = 0;
+        bool neg = false;
+        if (i < len && (ptr[i] == '-' || ptr[i] == '+'))
+        {
+            neg = ptr[i] == '-';
+            i++;
+        }
+        long val = 0;
+        for (; i < len && ptr[i] >= '0' && ptr[i] <= '9'; i++)
+        {
+            val = val * 10 + (ptr[i] - '0');
+        }
+        return neg ? -val : val;
+    }
+};
+
+// split a view by given delimiter into `fields`, reusing its storage
+inline void split_view(const StrView &s, char delim, std::vector<StrView> &fields)
+{
+    fields.clear();
+    size_t st = 0;
+    for (size_t i = 0; i < s.len; i++)
+    {
+        if (s.ptr[i] == delim)
+        {
+            fields.push_back(StrView(s.ptr + st, i - st));
+            st = i + 1;
+        }
+    }
+    fields.push_back(StrView(s.ptr + st, s.len - st));
+}
+
+// split a buffer into at most `n` pieces whose boundaries fall right after a newline
+inline std::vector<StrView> line_aligned_chunks(const StrView &buf, int n)
+{
+    std::vector<StrView> chunks;
+    if (n < 1) n = 1;
+    size_t st = 0;
+    for (int i = 1; i <= n && st < buf.len; i++)
+    {
+        size_t en = (i == n) ? buf.len : buf.len / n * i;
+        if (en <= st) en = st + 1;
+        while (en < buf.len && buf.ptr[en - 1] != '\n') en++;
+        chunks.push_back(StrView(buf.ptr + st, en - st));
+        st = en;
+    }
+    return chunks;
+}
+
+// iterate over the lines of a buffer, stripping '\n' and '\r'
+// usage: StrView line; size_t off = 0; while (next_line(buf, off, line)) {...}
+inline bool next_line(const StrView &buf, size_t &offset, StrView &line)
+{
+    if (offset >= buf.len) return false;
+    const char *st = buf.ptr + offset;
+    const char *nl = static_cast<const char *>(std::memchr(st, '\n', buf.len - offset));
+    size_t l = nl ? (size_t)(nl - st) : buf.len - offset;
+    offset += nl ? l + 1 : l;
+    if (l > 0 && st[l - 1] == '\r') l--;
+    line = StrView(st, l);
+    return true;
+}
+
+#endif
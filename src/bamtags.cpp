@@ -0,0 +1,93 @@
+// bamtags.cpp
+#include "bamtags.h"
+
+void AuxTagBuilder::add_header(const char tag[2], char type)
+{
+    data.push_back(tag[0]);
+    data.push_back(tag[1]);
+    data.push_back(type);
+}
+
+void AuxTagBuilder::add_str(const char tag[2], const char *str, size_t len)
+{
+    add_header(tag, 'Z');
+    data.insert(data.end(), str, str + len);
+    data.push_back('\0');
+}
+
+void AuxTagBuilder::add_int(const char tag[2], int32_t value)
+{
+    // same layout as `bam_aux_append(b, tag, 'i', sizeof(uint32_t), &value)`
+    add_header(tag, 'i');
+    const uint8_t *p = (const uint8_t*)&value;
+    data.insert(data.end(), p, p + sizeof(int32_t));
+}
+
+void AuxTagBuilder::add_char(const char tag[2], char value)
+{
+    add_header(tag, 'A');
+    data.push_back(value);
+}
+
+void AuxTagBuilder::update_str(const char tag[2], const char *str, size_t len)
+{
+    updates.push_back(tag[0]);
+    updates.push_back(tag[1]);
+    updates.insert(updates.end(), str, str + len);
+    updates.push_back('\0');
+}
+
+int AuxTagBuilder::write(bam1_t *b)
+{
+    size_t i = 0;
+    while (i < updates.size())
+    {
+        const char *tag = (const char*)&updates[i];
+        const char *str = tag + 2;
+        size_t len = strlen(str);
+        i += len + 3;
+
+        uint8_t *s = bam_aux_get(b, tag);
+        if (s && *s == 'Z' && strlen((char*)s + 1) == len)
+        {
+            memcpy(s + 1, str, len);
+            continue;
+        }
+        if (s)
+        {
+            bam_aux_del(b, s); // moves the following tags down, never reallocates
+        }
+        add_str(tag, str, len);
+    }
+
+    size_t need = b->l_data + data.size();
+    if (need > b->m_data)
+    {
+        size_t m = b->m_data > 0 ? b->m_data : 64;
+        while (m < need)
+        {
+            m *= 2;
+        }
+        uint8_t *new_data = (uint8_t*)realloc(b->data, m);
+        if (!new_data)
+        {
+            clear();
+            return -1;
+        }
+        b->data = new_data;
+        b->m_data = m;
+    }
+    if (!data.empty())
+    {
+        memcpy(b->data + b->l_data, data.data(), data.size());
+        b->l_data += data.size();
+    }
+    clear();
+    return 0;
+}
+
+void AuxTagBuilder::clear()
+{
+    data.clear();
+    updates.clear();
+}
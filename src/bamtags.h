@@ -0,0 +1,42 @@
+// bamtags.h
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "config_hts.h"
+
+#ifndef BAMTAGS_H
+#define BAMTAGS_H
+
+// collects the aux tags of a read and writes them with at most one reallocation of
+// the record data, where every `bam_aux_append` may reallocate it.
+// keep one builder per thread and loop, its buffer is reused between reads
+class AuxTagBuilder
+{
+public:
+    // queue a string tag from the first `len` characters of `str`, no copy to a
+    // NUL terminated buffer is needed
+    void add_str(const char tag[2], const char *str, size_t len);
+    void add_str(const char tag[2], const std::string &str) { add_str(tag, str.data(), str.size()); }
+    void add_int(const char tag[2], int32_t value);
+    void add_char(const char tag[2], char value);
+    // queue a string tag that replaces the tag of the same name already in the read,
+    // the old value is overwritten in place if it has the same length
+    void update_str(const char tag[2], const char *str, size_t len);
+    void update_str(const char tag[2], const std::string &str) { update_str(tag, str.data(), str.size()); }
+
+    // write the queued tags to the end of the read and clear the builder.
+    // return 0 on success, -1 if the record data cannot be grown
+    int write(bam1_t *b);
+    void clear();
+    bool empty() const { return data.empty() && updates.empty(); }
+
+private:
+    std::vector<uint8_t> data; // encoded tags: name, type and value
+    std::vector<uint8_t> updates; // tag name followed by the NUL terminated new value
+
+    void add_header(const char tag[2], char type);
+};
+
+#endif
@@ -0,0 +1,172 @@
+// cellbam.cpp
+#include "cellbam.h"
+#include <cstdio>
+#include <cstring>
+#include <future>
+#include <stdexcept>
+
+using std::string;
+using std::vector;
+
+namespace {
+// a record is its core and data length, followed by the data. both parts are padded
+// to 8 bytes so the data of a record read back in place is aligned as htslib expects
+struct RecordHead
+{
+    bam1_core_t core;
+    uint32_t l_data;
+};
+
+constexpr size_t align8(size_t n)
+{
+    return (n + 7) & ~(size_t)7;
+}
+
+const size_t HEAD_SIZE = align8(sizeof(RecordHead));
+
+// call `write` for the records serialized in `data`, they are not copied
+void emit(int cell, const char *data, size_t size, const std::function<void(int, const bam1_t*)> &write)
+{
+    bam1_t rec;
+    memset(&rec, 0, sizeof(rec));
+    size_t off = 0;
+    while (off < size)
+    {
+        RecordHead head;
+        memcpy(&head, data + off, sizeof(head));
+        rec.core = head.core;
+        rec.l_data = head.l_data;
+        rec.m_data = head.l_data;
+        rec.data = (uint8_t*)(data + off + HEAD_SIZE);
+        write(cell, &rec);
+        off += HEAD_SIZE + align8(head.l_data);
+    }
+}
+}
+
+CellBamSorter::CellBamSorter(const string &tmp_fn, size_t n_cells, size_t memory_budget) :
+    tmp_fn(tmp_fn), memory_budget(memory_budget), buffers(n_cells), extents(n_cells)
+{
+}
+
+CellBamSorter::~CellBamSorter()
+{
+    if (out.is_open() || file_size > 0)
+    {
+        out.close();
+        std::remove(tmp_fn.c_str());
+    }
+}
+
+void CellBamSorter::add(int cell, const bam1_t *b)
+{
+    RecordHead head;
+    memset(&head, 0, sizeof(head));
+    head.core = b->core;
+    head.l_data = b->l_data;
+
+    vector<char> &buf = buffers[cell];
+    size_t off = buf.size();
+    size_t size = HEAD_SIZE + align8(b->l_data);
+    buf.resize(off + size);
+    memcpy(&buf[off], &head, sizeof(head));
+    memcpy(&buf[off + HEAD_SIZE], b->data, b->l_data);
+    buffered += size;
+    if (buffered > memory_budget)
+    {
+        spill();
+    }
+}
+
+void CellBamSorter::spill()
+{
+    if (!out.is_open())
+    {
+        out.open(tmp_fn, std::ios::binary | std::ios::trunc);
+        if (!out)
+        {
+            Rcpp::stop("cannot open the temporary file: " + tmp_fn + "\n");
+        }
+    }
+    for (size_t i = 0; i < buffers.size(); i++)
+    {
+        if (buffers[i].empty())
+        {
+            continue;
+        }
+        out.write(buffers[i].data(), buffers[i].size());
+        if (!out)
+        {
+            Rcpp::stop("fail to write the temporary file: " + tmp_fn + "\n");
+        }
+        extents[i].push_back(std::make_pair(file_size, (uint64_t)buffers[i].size()));
+        file_size += buffers[i].size();
+        vector<char>().swap(buffers[i]);
+    }
+    buffered = 0;
+}
+
+void CellBamSorter::for_each(const std::function<void(int, const bam1_t*)> &write, bool prefetch)
+{
+    std::ifstream in;
+    if (out.is_open())
+    {
+        out.close();
+        if (!out)
+        {
+            Rcpp::stop("fail to write the temporary file: " + tmp_fn + "\n");
+        }
+        in.open(tmp_fn, std::ios::binary);
+    }
+    // runs on the prefetch thread, which cannot talk to R, so errors are
+    // thrown as std::runtime_error and turned into `stop` by this thread
+    auto read_extent = [&](std::pair<uint64_t, uint64_t> ext)
+    {
+        vector<char> data(ext.second);
+        in.seekg(ext.first);
+        in.read(data.data(), ext.second);
+        if (!in)
+        {
+            throw std::runtime_error("fail to read the temporary file: " + tmp_fn + "\n");
+        }
+        return data;
+    };
+
+    // the extents in the order they are written out
+    vector<std::pair<uint64_t, uint64_t>> order;
+    for (const auto &cell_extents : extents)
+    {
+        order.insert(order.end(), cell_extents.begin(), cell_extents.end());
+    }
+    size_t k = 0;
+    std::future<vector<char>> ahead;
+    if (prefetch && !order.empty())
+    {
+        ahead = std::async(std::launch::async, read_extent, order[0]);
+    }
+
+    for (size_t cell = 0; cell < buffers.size(); cell++)
+    {
+        for (size_t j = 0; j < extents[cell].size(); j++, k++)
+        {
+            vector<char> data;
+            try
+            {
+                data = prefetch ? ahead.get() : read_extent(order[k]);
+            }
+            catch (const std::runtime_error &e)
+            {
+                Rcpp::stop(e.what());
+            }
+            if (prefetch && k + 1 < order.size())
+            {
+                ahead = std::async(std::launch::async, read_extent, order[k + 1]);
+            }
+            emit(cell, data.data(), data.size(), write);
+        }
+        // the most recent records of the cell were never spilled
+        emit(cell, buffers[cell].data(), buffers[cell].size(), write);
+        vector<char>().swap(buffers[cell]);
+    }
+    buffered = 0;
+}
@@ -0,0 +1,51 @@
+// cellbam.h
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <vector>
+#include <Rcpp.h>
+#include "config_hts.h"
+
+#ifndef CELLBAM_H
+#define CELLBAM_H
+
+// groups the bam records of `clean_bam_barcode` by cell: a bucket sort keyed by the
+// index of the corrected cell, with one bucket per cell. the records of each cell are
+// buffered, and once all buffers together hold more than `memory_budget` bytes every
+// buffer is appended to a temporary file as one extent of its cell. `for_each` reads
+// the cells back one extent at a time, so neither pass holds more than the budget.
+// the records of a cell keep the order they were added in
+class CellBamSorter
+{
+public:
+    // the temporary file `tmp_fn` is only created if the records do not fit in the budget
+    CellBamSorter(const std::string &tmp_fn, size_t n_cells, size_t memory_budget = 512 << 20);
+    ~CellBamSorter();
+
+    CellBamSorter(const CellBamSorter&) = delete;
+    CellBamSorter &operator=(const CellBamSorter&) = delete;
+
+    // add a record to a cell, given by the index `Barcode::cell_id` takes
+    void add(int cell, const bam1_t *b);
+
+    // call `write(cell, b)` for every record, cell by cell in index order, and release
+    // the records. with `prefetch` the next extent is read from the temporary file on
+    // another thread while the records of the current one are written
+    void for_each(const std::function<void(int, const bam1_t*)> &write, bool prefetch = false);
+
+private:
+    std::string tmp_fn;
+    std::ofstream out;
+    size_t memory_budget;
+    size_t buffered = 0;
+    uint64_t file_size = 0;
+    // per cell serialized records, 8 byte aligned
+    std::vector<std::vector<char>> buffers;
+    // per cell (offset, size) of the extents in the temporary file
+    std::vector<std::vector<std::pair<uint64_t, uint64_t>>> extents;
+
+    void spill();
+};
+
+#endif
@@ -1,118 +1,843 @@
 // demultiplexing
 #include "cellbarcode.h"
+#include <cstring>
 
 using std::string;
 using std::unordered_map;
 using namespace Rcpp;
 
+namespace {
+bool is_barcode(const char *beg, const char *end)
+{
+    for (const char *c = beg; c < end; c++)
+    {
+        if (!strchr("ACGTN", *c))
+        {
+            return false;
+        }
+    }
+    return beg < end;
+}
+
+// cell ids stored once in `Barcode::cellid_list`, the set holds their indices
+struct CellIdHash
+{
+    const std::vector<string> *ids;
+    size_t operator()(size_t i) const { return std::hash<string>()((*ids)[i]); }
+};
+
+struct CellIdEqual
+{
+    const std::vector<string> *ids;
+    bool operator()(size_t a, size_t b) const { return (*ids)[a] == (*ids)[b]; }
+};
+
+// 2-bit code of A, C, G and T, 4 for N (packed as A) and 8 for anything else
+struct BaseCodes
+{
+    unsigned char codes[256];
+    BaseCodes()
+    {
+        memset(codes, 8, sizeof(codes));
+        codes['A'] = 0;
+        codes['C'] = 1;
+        codes['G'] = 2;
+        codes['T'] = 3;
+        codes['N'] = 4;
+    }
+};
+
+// built on first use, so that barcodes can be packed during static initialisation
+const unsigned char *base_codes()
+{
+    static const BaseCodes table;
+    return table.codes;
+}
+
+// the low bit of every base of a packed barcode
+const uint64_t BASE_BITS = 0x5555555555555555ULL;
+
+int popcount64(uint64_t x)
+{
+#if defined(__GNUC__)
+    return __builtin_popcountll(x);
+#else
+    int n = 0;
+    for (; x; x &= x - 1)
+    {
+        n++;
+    }
+    return n;
+#endif
+}
+
+// number of bases of a packed barcode
+size_t barcode_length(uint64_t key)
+{
+    size_t len = 0;
+    for (; key > 1; key >>= 2)
+    {
+        len++;
+    }
+    return len;
+}
+
+// packed barcodes of the same length have their leading 1 at the same bit
+bool same_length(uint64_t a, uint64_t b)
+{
+    return (a ^ b) < (a & b);
+}
+
+// mismatches between a barcode and a sequence of the same length, both packed, the
+// bases flagged in `n_mask` always mismatch
+int packed_mismatches(uint64_t bc, uint64_t key, uint64_t n_mask)
+{
+    uint64_t diff = bc ^ key;
+    return popcount64((diff | diff >> 1 | n_mask) & BASE_BITS);
+}
+}
+
+bool pack_barcode(const char *seq, size_t len, uint64_t &key, uint64_t *n_mask)
+{
+    if (len > 31)
+    {
+        return false;
+    }
+    key = 1;
+    uint64_t mask = 0;
+    unsigned char bad = 0;
+    const unsigned char *codes = base_codes();
+    for (size_t i = 0; i < len; i++)
+    {
+        // a table rather than a switch, the bases of barcodes are too random to predict
+        unsigned char code = codes[(unsigned char)seq[i]];
+        bad |= code;
+        key = (key << 2) | (code & 3);
+        mask = (mask << 2) | (code >> 2 & 3);
+    }
+    // 4 is an N, 8 any other character
+    if ((bad & 8) || (mask && !n_mask))
+    {
+        return false;
+    }
+    if (n_mask)
+    {
+        *n_mask = mask * 3;
+    }
+    return true;
+}
+
+string unpack_barcode(uint64_t key)
+{
+    string seq(barcode_length(key), 'A');
+    for (size_t i = seq.size(); i-- > 0; key >>= 2)
+    {
+        seq[i] = "ACGT"[key & 3];
+    }
+    return seq;
+}
+
+void BarcodeMap::clear()
+{
+    slots.clear();
+    n_keys = 0;
+    shift = 64;
+}
+
+size_t BarcodeMap::slot(uint64_t key) const
+{
+    return (key * 0x9E3779B97F4A7C15ULL) >> shift;
+}
+
+void BarcodeMap::reserve(size_t n)
+{
+    // at most half full keeps the probes short
+    size_t n_slots = 16;
+    int new_shift = 60;
+    while (n_slots < 2 * n)
+    {
+        n_slots *= 2;
+        new_shift--;
+    }
+    if (n_slots <= slots.size())
+    {
+        return;
+    }
+    std::vector<Slot> old_slots(n_slots, Slot{0, 0});
+    old_slots.swap(slots);
+    shift = new_shift;
+    for (const Slot &old : old_slots)
+    {
+        if (old.key)
+        {
+            size_t j = slot(old.key);
+            while (slots[j].key)
+            {
+                j = (j + 1) & (slots.size() - 1);
+            }
+            slots[j] = old;
+        }
+    }
+}
+
+std::pair<uint32_t*, bool> BarcodeMap::emplace(uint64_t key, uint32_t cell)
+{
+    if (2 * (n_keys + 1) > slots.size())
+    {
+        reserve(2 * (n_keys + 1));
+    }
+    size_t j = slot(key);
+    for (; slots[j].key; j = (j + 1) & (slots.size() - 1))
+    {
+        if (slots[j].key == key)
+        {
+            return std::make_pair(&slots[j].cell, false);
+        }
+    }
+    slots[j] = Slot{key, cell};
+    n_keys++;
+    return std::make_pair(&slots[j].cell, true);
+}
+
+long BarcodeMap::find(uint64_t key) const
+{
+    if (slots.empty() || !key)
+    {
+        return -1;
+    }
+    for (size_t j = slot(key); slots[j].key; j = (j + 1) & (slots.size() - 1))
+    {
+        if (slots[j].key == key)
+        {
+            return slots[j].cell;
+        }
+    }
+    return -1;
+}
+
+bool BarcodeMap::operator==(const BarcodeMap &other) const
+{
+    if (n_keys != other.n_keys)
+    {
+        return false;
+    }
+    for (const Slot &s : slots)
+    {
+        if (s.key && other.find(s.key) != s.cell)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
 // read annotation from files, the file should have two columns
 // first column is cell id and second column is barcode.
 // protocols with two barcodes are merged as one.
 void Barcode::read_anno(string fn)
 {
     check_file_exists(fn);
-    std::ifstream infile(fn);
-    string line;
-    std::getline(infile, line); // skip header
+    {
+        char magic[sizeof(BARCODE_WHITELIST_MAGIC)] = {};
+        std::ifstream(fn, std::ios::binary).read(magic, sizeof(magic));
+        if (memcmp(magic, BARCODE_WHITELIST_MAGIC, sizeof(magic)) == 0)
+        {
+            read_whitelist(fn);
+            return;
+        }
+    }
 
-    char sep;
-    if (line.find(",") != string::npos)
+    string text = read_text_file(fn);
+    const char *p = text.data();
+    const char *end = p + text.size();
+    auto line_end = [&](const char *beg)
+    {
+        const char *eol = (const char*)memchr(beg, '\n', end - beg);
+        return eol ? eol : end;
+    };
+
+    const char *eol = line_end(p);
+    const char *first_end = eol > p && eol[-1] == '\r' ? eol - 1 : eol;
+    char sep = 0;
+    if (memchr(p, ',', first_end - p))
     {
         sep = ',';
     }
-    else if (line.find("\t") != string::npos)
+    else if (memchr(p, '\t', first_end - p))
     {
         sep = '\t';
     }
-    else
+    else if (!is_barcode(p, first_end))
     {
         Rcpp::stop("the annotation file should be comma or tab separated");
     }
+    if (sep)
+    {
+        p = eol < end ? eol + 1 : end; // skip header
+    }
+
+    size_t n_lines = std::count(p, end, '\n') + 1;
+    // each barcode of a list is its own cell, so the cells need no ids of their own
+    bool own_list = !sep && barcode_dict.empty();
+    own_cells = own_cells || own_list;
+    if (!own_list)
+    {
+        name_own_cells();
+    }
+    detach_whitelist();
+    barcode_dict.reserve(barcode_dict.size() + n_lines);
+    barcode_list.reserve(barcode_list.size() + n_lines);
+    std::unordered_set<size_t, CellIdHash, CellIdEqual> cells(own_list ? 0 : n_lines, CellIdHash{&cellid_list}, CellIdEqual{&cellid_list});
+    for (size_t i = 0; i < cellid_list.size(); i++)
+    {
+        cells.insert(i);
+    }
 
-    while(std::getline(infile, line))
+    while (p < end)
     {
-        std::stringstream linestream(line);
-        if (line.size() < 3){
+        eol = line_end(p);
+        const char *line_last = eol > p && eol[-1] == '\r' ? eol - 1 : eol;
+        const char *next = eol < end ? eol + 1 : end;
+        if (line_last - p < 3)
+        {
+            p = next;
+            continue;
+        }
+        const char *id_end = line_last;
+        const char *bc_beg = p;
+        const char *bc_end = line_last;
+        if (sep)
+        {
+            const char *s = (const char*)memchr(p, sep, line_last - p);
+            id_end = s ? s : line_last;
+            bc_beg = s ? s + 1 : line_last;
+            const char *s2 = (const char*)memchr(bc_beg, sep, line_last - bc_beg);
+            bc_end = s2 ? s2 : line_last;
+        }
+        uint64_t key;
+        if (!pack_barcode(bc_beg, bc_end - bc_beg, key))
+        {
+            Rcpp::stop("barcodes should have at most 31 bases of A, C, G and T: " + string(bc_beg, bc_end) + "\n");
+        }
+
+        if (own_list)
+        {
+            barcode_list.push_back(key);
+            p = next;
             continue;
         }
-        string cell_id;
-        string barcode;
 
-        std::getline(linestream, cell_id, sep);
-        std::getline(linestream, barcode, sep);
+        cellid_list.emplace_back(p, id_end);
+        auto cell = cells.insert(cellid_list.size() - 1);
+        if (!cell.second)
+        {
+            cellid_list.pop_back();
+        }
+        add_packed(key, *cell.first);
+        p = next;
+    }
+
+    if (own_list)
+    {
+        // filled after parsing, the lookups of the keys then overlap rather than wait on
+        // the parsing. a repeated barcode is dropped
+        size_t n = 0;
+        for (uint64_t key : barcode_list)
+        {
+            if (barcode_dict.emplace(key, n).second)
+            {
+                barcode_list[n++] = key;
+            }
+        }
+        barcode_list.resize(n);
+    }
+}
+
+void Barcode::add_packed(uint64_t key, uint32_t cell)
+{
+    auto entry = barcode_dict.emplace(key, cell);
+    if (entry.second)
+    {
+        barcode_list.push_back(key);
+    }
+    else
+    {
+        *entry.first = cell;
+    }
+}
+
+void Barcode::name_own_cells()
+{
+    if (!own_cells)
+    {
+        return;
+    }
+    cellid_list = cell_ids();
+    own_cells = false;
+}
+
+void Barcode::detach_whitelist()
+{
+    if (!whitelist)
+    {
+        return;
+    }
+    std::vector<uint64_t> keys(n_barcodes());
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        keys[i] = barcode(i);
+    }
+    whitelist.reset();
+    barcode_list.insert(barcode_list.begin(), keys.begin(), keys.end());
+}
+
+size_t Barcode::n_barcodes() const
+{
+    return whitelist ? whitelist_size : barcode_list.size();
+}
+
+uint64_t Barcode::barcode(size_t i) const
+{
+    if (!whitelist)
+    {
+        return barcode_list[i];
+    }
+    uint64_t key;
+    memcpy(&key, whitelist->data() + whitelist_off + i * sizeof(uint64_t), sizeof(key));
+    return key;
+}
+
+string Barcode::cell_id(size_t cell) const
+{
+    return own_cells ? unpack_barcode(barcode(cell)) : cellid_list[cell];
+}
+
+std::vector<string> Barcode::cell_ids() const
+{
+    if (!own_cells)
+    {
+        return cellid_list;
+    }
+    std::vector<string> ids(n_barcodes());
+    for (size_t i = 0; i < ids.size(); i++)
+    {
+        ids[i] = unpack_barcode(barcode(i));
+    }
+    return ids;
+}
+
+void Barcode::write_whitelist(const string &fn) const
+{
+    size_t n = n_barcodes();
+    std::vector<uint64_t> keys(n);
+    std::vector<uint32_t> cells(own_cells ? 0 : n);
+    uint32_t bc_len = n ? barcode_length(barcode(0)) : 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        keys[i] = barcode(i);
+        if (!same_length(keys[i], keys[0]))
+        {
+            bc_len = 0;
+        }
+        if (!own_cells)
+        {
+            cells[i] = barcode_dict.find(keys[i]);
+        }
+    }
+
+    std::ofstream out(fn, std::ios::binary | std::ios::trunc);
+    auto write = [&](const void *data, size_t size)
+    {
+        out.write((const char*)data, size);
+    };
+    uint64_t n_barcodes = n;
+    uint64_t n_cells = own_cells ? 0 : cellid_list.size();
+    write(BARCODE_WHITELIST_MAGIC, sizeof(BARCODE_WHITELIST_MAGIC));
+    write(&BARCODE_WHITELIST_VERSION, sizeof(BARCODE_WHITELIST_VERSION));
+    write(&bc_len, sizeof(bc_len));
+    write(&n_barcodes, sizeof(n_barcodes));
+    write(&n_cells, sizeof(n_cells));
+    write(keys.data(), keys.size() * sizeof(uint64_t));
+    if (!own_cells)
+    {
+        write(cells.data(), cells.size() * sizeof(uint32_t));
+        for (const string &cell_id : cellid_list)
+        {
+            uint32_t len = cell_id.size();
+            write(&len, sizeof(len));
+            write(cell_id.data(), len);
+        }
+    }
+    out.close();
+    if (!out)
+    {
+        Rcpp::stop("fail to write the barcode whitelist: " + fn + "\n");
+    }
+}
+
+void Barcode::read_whitelist(const string &fn)
+{
+    if (!barcode_dict.empty())
+    {
+        Rcpp::stop("a binary whitelist cannot be added to other barcodes: " + fn + "\n");
+    }
+    std::shared_ptr<FileView> file = std::make_shared<FileView>(fn);
+    const char *data = file->data();
+    size_t off = 0;
+    auto read = [&](void *dst, size_t size)
+    {
+        if (off + size > file->size())
+        {
+            Rcpp::stop("corrupt barcode whitelist: " + fn + "\n");
+        }
+        memcpy(dst, data + off, size);
+        off += size;
+    };
 
-        barcode_dict[barcode] = cell_id;
+    char magic[sizeof(BARCODE_WHITELIST_MAGIC)];
+    uint32_t version, bc_len;
+    uint64_t n_barcodes, n_cells;
+    read(magic, sizeof(magic));
+    read(&version, sizeof(version));
+    read(&bc_len, sizeof(bc_len));
+    read(&n_barcodes, sizeof(n_barcodes));
+    read(&n_cells, sizeof(n_cells));
+    if (version != BARCODE_WHITELIST_VERSION)
+    {
+        Rcpp::stop("barcode whitelist written by another version: " + fn + "\n");
+    }
+    size_t table_size = n_barcodes * (sizeof(uint64_t) + (n_cells ? sizeof(uint32_t) : 0));
+    if (n_barcodes > file->size() || off + table_size > file->size())
+    {
+        Rcpp::stop("corrupt barcode whitelist: " + fn + "\n");
+    }
+    size_t packed_off = off;
+    size_t cells_off = off + n_barcodes * sizeof(uint64_t);
+    off += table_size;
+    std::vector<string> ids;
+    for (uint64_t i = 0; i < n_cells; i++)
+    {
+        uint32_t len;
+        read(&len, sizeof(len));
+        if (off + len > file->size())
+        {
+            Rcpp::stop("corrupt barcode whitelist: " + fn + "\n");
+        }
+        ids.emplace_back(data + off, len);
+        off += len;
+    }
 
-        if (std::find(cellid_list.begin(), cellid_list.end(), cell_id) == cellid_list.end())
+    // the barcodes are read from the file in place, only the lookup table is built
+    whitelist = file;
+    whitelist_off = packed_off;
+    whitelist_size = n_barcodes;
+    own_cells = n_cells == 0;
+    cellid_list.swap(ids);
+    barcode_dict.reserve(n_barcodes);
+    for (uint64_t i = 0; i < n_barcodes; i++)
+    {
+        uint32_t cell = i;
+        if (n_cells)
         {
-            cellid_list.push_back(cell_id);
+            memcpy(&cell, data + cells_off + i * sizeof(uint32_t), sizeof(cell));
+        }
+        // written without duplicates
+        if (barcode(i) <= 1 || cell >= (n_cells ? n_cells : n_barcodes) || !barcode_dict.emplace(barcode(i), cell).second)
+        {
+            barcode_dict.clear();
+            whitelist.reset();
+            Rcpp::stop("corrupt barcode whitelist: " + fn + "\n");
         }
-        
-        barcode_list.push_back(barcode);
     }
 }
 
-unordered_map<string, string> Barcode::get_count_file_path(string out_dir)
+unordered_map<string, string> Barcode::get_count_file_path(string out_dir) const
 {
     string csv_fmt = ".csv";
     unordered_map<string, string> out_fn_dict;
-    for(const auto& n : cellid_list) 
+    for (size_t i = 0; i < n_cells(); i++)
     {
+        string n = cell_id(i);
         out_fn_dict[n] = join_path(out_dir, n+csv_fmt);
     }
     return out_fn_dict;
 }
 
+uint64_t Barcode::segment_bits(uint64_t key, size_t s) const
+{
+    size_t seg_len = index.seg_start[s + 1] - index.seg_start[s];
+    return (key >> (2 * (index.bc_len - index.seg_start[s + 1]))) & ((1ULL << (2 * seg_len)) - 1);
+}
+
+void Barcode::build_index(int max_mismatch)
+{
+    index = SegmentIndex();
+    index.max_mismatch = max_mismatch;
+    size_t n = n_barcodes();
+    if (n == 0 || max_mismatch < 1)
+    {
+        return;
+    }
+    uint64_t first = barcode(0);
+    for (size_t i = 0; i < n; i++)
+    {
+        if (!same_length(barcode(i), first))
+        {
+            return; // mixed lengths are left to the full scan
+        }
+    }
+    size_t bc_len = barcode_length(first);
+    size_t n_seg = max_mismatch + 1;
+    if (n_seg > bc_len)
+    {
+        return;
+    }
+
+    index.bc_len = bc_len;
+    for (size_t i = 0; i <= n_seg; i++)
+    {
+        index.seg_start.push_back(i * bc_len / n_seg);
+    }
+    index.segments.resize(n_seg);
+    for (size_t s = 0; s < n_seg; s++)
+    {
+        auto &seg = index.segments[s];
+        seg.reserve(n);
+        for (size_t i = 0; i < n; i++)
+        {
+            seg.push_back(std::make_pair(segment_bits(barcode(i), s), (uint32_t)i));
+        }
+        std::sort(seg.begin(), seg.end());
+    }
+}
+
 string Barcode::get_closest_match(const string &bc_seq, int max_mismatch)
 {
-    if (barcode_dict.find(bc_seq) != barcode_dict.end())
+    uint64_t key, n_mask;
+    if (!pack_barcode(bc_seq.data(), bc_seq.size(), key, &n_mask))
     {
-        return bc_seq;
+        return string(); // no barcode is that long
     }
-    int sml1st = std::numeric_limits<int>::max();
-    int sml2ed = std::numeric_limits<int>::max();
-    std::vector<int> hamming_dists(barcode_list.size());
-    string closest_match;
+    uint64_t match = closest_barcode(key, n_mask, max_mismatch);
+    return match ? unpack_barcode(match) : string();
+}
 
-    for (int i = 0; i < (int)barcode_list.size(); i++)
+uint64_t Barcode::closest_barcode(uint64_t key, uint64_t n_mask, int max_mismatch)
+{
+    if (!n_mask && barcode_dict.find(key) >= 0)
+    {
+        return key;
+    }
+    if (max_mismatch < 1)
+    {
+        return 0; // every barcode is in `barcode_dict`
+    }
+    if (index.max_mismatch != max_mismatch)
     {
-        hamming_dists[i] = hamming_distance(barcode_list[i], bc_seq);
+        build_index(max_mismatch);
+    }
+    if (index.bc_len == 0 || barcode_length(key) != index.bc_len)
+    {
+        return closest_barcode_scan(key, n_mask, max_mismatch);
     }
 
-    for (int i = 0; i < (int)hamming_dists.size(); i++)
+    int best_dist = max_mismatch + 1;
+    int n_best = 0;
+    uint64_t best = 0;
+    size_t n_seg = index.segments.size();
+    for (size_t s = 0; s < n_seg; s++)
     {
-        string const &bc = barcode_list[i];
-        int dist = hamming_dists[i];
-        if (dist <= max_mismatch)
+        // a segment with an N matches no barcode exactly
+        if (segment_bits(n_mask, s) != 0)
+        {
+            continue;
+        }
+        uint64_t seg_key = segment_bits(key, s);
+        const auto &seg = index.segments[s];
+        auto it = std::lower_bound(seg.begin(), seg.end(), std::make_pair(seg_key, (uint32_t)0));
+        for (; it != seg.end() && it->first == seg_key; ++it)
         {
-            if (dist < sml1st)
+            uint64_t bc = barcode(it->second);
+            // a barcode sharing an earlier segment has been compared already
+            bool seen = false;
+            for (size_t t = 0; t < s && !seen; t++)
+            {
+                seen = segment_bits(n_mask, t) == 0 && segment_bits(bc, t) == segment_bits(key, t);
+            }
+            if (seen)
+            {
+                continue;
+            }
+            int dist = packed_mismatches(bc, key, n_mask);
+            if (dist > max_mismatch)
             {
-                sml1st = dist;
-                closest_match = bc;
+                continue;
             }
-            else if (sml1st <= dist && dist < sml2ed)
+            if (dist < best_dist)
             {
-                sml2ed = dist;
+                best_dist = dist;
+                best = bc;
+                n_best = 1;
             }
+            else if (dist == best_dist)
+            {
+                n_best++;
+            }
+        }
+    }
+
+    return n_best == 1 ? best : 0;
+}
+
+uint64_t Barcode::closest_barcode_scan(uint64_t key, uint64_t n_mask, int max_mismatch) const
+{
+    int best_dist = max_mismatch + 1;
+    int n_best = 0;
+    uint64_t best = 0;
+    for (size_t i = 0; i < n_barcodes(); i++)
+    {
+        uint64_t bc = barcode(i);
+        if (!same_length(bc, key))
+        {
+            continue;
         }
+        int dist = packed_mismatches(bc, key, n_mask);
+        if (dist < best_dist)
+        {
+            best_dist = dist;
+            best = bc;
+            n_best = 1;
+        }
+        else if (dist == best_dist)
+        {
+            n_best++;
+        }
+    }
+    return n_best == 1 ? best : 0;
+}
+
+BarcodeCache::BarcodeCache(Barcode &bar, int max_mismatch) :
+    bar(bar), mismatch(max_mismatch), shards(new Shard[n_shards])
+{
+    // the lookups only read the index afterwards
+    bar.build_index(max_mismatch);
+}
+
+const BarcodeCache::Match *BarcodeCache::add_match(Shard &shard, uint64_t key)
+{
+    if (!key)
+    {
+        return NULL;
     }
+    string seq = unpack_barcode(key);
+    Match match;
+    match.cell = bar.find_cell(key);
+    match.len = seq.size();
+    memcpy(match.seq, seq.data(), seq.size());
+    shard.matches.push_back(match);
+    return &shard.matches.back();
+}
+
+const BarcodeCache::Match *BarcodeCache::find(const char *seq, size_t len)
+{
+    uint64_t key;
+    uint64_t n_mask;
+    bool valid = pack_barcode(seq, len, key, &n_mask);
+    // barcodes with an N are cached by string, as the packed key does not tell N from A
+    bool packed = valid && !n_mask;
+    uint64_t shard_key = packed ? key : std::hash<string>()(string(seq, len));
 
-    if (sml1st < sml2ed)
+    // the high bits of a multiplicative hash pick the shard
+    Shard &shard = shards[(shard_key * 0x9E3779B97F4A7C15ULL) >> 58];
     {
-        return closest_match;
+        std::lock_guard<std::mutex> lock(shard.mtx);
+        if (packed)
+        {
+            auto it = shard.packed.find(key);
+            if (it != shard.packed.end())
+            {
+                shard.hits++;
+                return it->second;
+            }
+        }
+        else
+        {
+            auto it = shard.unpacked.find(string(seq, len));
+            if (it != shard.unpacked.end())
+            {
+                shard.hits++;
+                return it->second;
+            }
+        }
+        shard.misses++;
+    }
+    // threads missing the same barcode at once both correct it, with the same result
+    uint64_t match_key = valid ? bar.closest_barcode(key, n_mask, mismatch) : 0;
+    std::lock_guard<std::mutex> lock(shard.mtx);
+    const Match *match = add_match(shard, match_key);
+    if (packed)
+    {
+        shard.packed.emplace(key, match);
     }
     else
     {
-        return string();
+        shard.unpacked.emplace(string(seq, len), match);
     }
+    return match;
+}
 
+unsigned long long BarcodeCache::hits() const
+{
+    unsigned long long n = 0;
+    for (size_t i = 0; i < n_shards; i++)
+    {
+        std::lock_guard<std::mutex> lock(shards[i].mtx);
+        n += shards[i].hits;
+    }
+    return n;
+}
+
+unsigned long long BarcodeCache::misses() const
+{
+    unsigned long long n = 0;
+    for (size_t i = 0; i < n_shards; i++)
+    {
+        std::lock_guard<std::mutex> lock(shards[i].mtx);
+        n += shards[i].misses;
+    }
+    return n;
+}
+
+size_t BarcodeCache::size() const
+{
+    size_t n = 0;
+    for (size_t i = 0; i < n_shards; i++)
+    {
+        std::lock_guard<std::mutex> lock(shards[i].mtx);
+        n += shards[i].packed.size() + shards[i].unpacked.size();
+    }
+    return n;
+}
+
+void BarcodeCache::report() const
+{
+    unsigned long long n_hits = hits();
+    unsigned long long lookups = n_hits + misses();
+    if (lookups == 0)
+    {
+        return;
+    }
+    Rcout << "barcode cache hits: " << n_hits << " of " << lookups
+          << " (" << std::fixed << std::setprecision(2) << 100. * n_hits / lookups << "%), "
+          << size() << " distinct barcodes" << "\n";
 }
 
 std::ostream& operator<< (std::ostream& out, const Barcode& obj)
 {
-    for( const auto& n : obj.barcode_dict ) 
+    for (size_t i = 0; i < obj.n_barcodes(); i++)
     {
-        out << "Barcode:[" << n.first << "] Cell Id:[" << n.second << "]\n";
+        uint64_t key = obj.barcode(i);
+        out << "Barcode:[" << unpack_barcode(key) << "] Cell Id:[" << obj.cell_id(obj.find_cell(key)) << "]\n";
     }
     return out;
 }
@@ -4,31 +4,197 @@
 #include <sstream>
 #include <fstream>
 #include <unordered_map>
+#include <unordered_set>
 #include <algorithm>
 #include <limits>
 #include <memory>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
 #include <Rcpp.h>
 #include "utils.h"
 
 #ifndef CELLBARCODE_H
 #define CELLBARCODE_H
+
+// binary barcode whitelist written by `Barcode::write_whitelist`, read by `Barcode::read_anno`
+// without parsing, its barcodes are used in place. layout, in native byte order:
+//   header: magic "SCPBCWL1", uint32 version, uint32 barcode length (0 if the lengths
+//           differ), uint64 number of barcodes, uint64 number of cells (0 if every barcode
+//           is its own cell)
+//   barcodes: uint64 per barcode, packed by `pack_barcode`
+//   cells: uint32 cell index per barcode, then per cell its id
+//   strings are stored as uint32 length followed by the characters
+const char BARCODE_WHITELIST_MAGIC[8] = {'S', 'C', 'P', 'B', 'C', 'W', 'L', '1'};
+const uint32_t BARCODE_WHITELIST_VERSION = 2;
+
+// pack a barcode of up to 31 bases at 2 bits per base after a leading 1, so barcodes of
+// different length never share a key. with `n_mask` an N is packed as A and its two bits
+// are set in the mask, otherwise N fails like any other base than A, C, G or T
+bool pack_barcode(const char *seq, size_t len, uint64_t &key, uint64_t *n_mask = NULL);
+std::string unpack_barcode(uint64_t key);
+
+// hash map of packed barcodes to cell indices. the entries sit in one flat array probed
+// linearly, so filling it with millions of barcodes allocates once rather than once per
+// barcode and an insert touches one cache line. packed barcodes are never 0, which marks
+// an empty slot
+class BarcodeMap
+{
+public:
+    size_t size() const { return n_keys; }
+    bool empty() const { return n_keys == 0; }
+    void clear();
+    // make room for `n` barcodes without growing
+    void reserve(size_t n);
+    // add `cell` for `key` unless it is present, return its cell and whether it was added
+    std::pair<uint32_t*, bool> emplace(uint64_t key, uint32_t cell);
+    // cell of `key`, -1 if it is absent
+    long find(uint64_t key) const;
+    bool operator==(const BarcodeMap &other) const;
+
+private:
+    struct Slot
+    {
+        uint64_t key;
+        uint32_t cell;
+    };
+    std::vector<Slot> slots;
+    size_t n_keys = 0;
+    int shift = 64; // the slot of a key is the top bits of its hash
+
+    size_t slot(uint64_t key) const;
+};
+
 // a class that stores cellular barcode annotation and
 // find close barcode for a given sequence
 class Barcode
 {
 public:
-    std::unordered_map<std::string, std::string> barcode_dict;
-    std::vector<std::string> cellid_list;
-    std::vector<std::string> barcode_list;
+    // packed barcode -> index of its cell
+    BarcodeMap barcode_dict;
 
-    // if annotation is given
+    // if annotation is given: a comma or tab separated file of cell id and barcode with a
+    // header line, a list of barcodes without header where each barcode is its own cell
+    // (such as the 10x whitelists), either one plain or gzip compressed, or a binary
+    // whitelist written by `write_whitelist`. barcodes have at most 31 bases of A, C, G, T
     void read_anno(std::string fn);
 
-    std::unordered_map<std::string, std::string> get_count_file_path(std::string out_dir);
+    // write the annotation as binary whitelist
+    void write_whitelist(const std::string &fn) const;
+
+    // distinct barcodes in annotation order, packed by `pack_barcode`
+    size_t n_barcodes() const;
+    uint64_t barcode(size_t i) const;
+    size_t n_cells() const { return own_cells ? n_barcodes() : cellid_list.size(); }
+    // id of a cell, the barcode itself if every barcode is its own cell
+    std::string cell_id(size_t cell) const;
+    std::vector<std::string> cell_ids() const;
+    // index of the cell of a packed barcode, -1 if it is not annotated
+    int find_cell(uint64_t key) const { return barcode_dict.find(key); }
 
+    std::unordered_map<std::string, std::string> get_count_file_path(std::string out_dir) const;
+
+    // return the barcode with the unique smallest hamming distance to `bc_seq` if it is
+    // at most `max_mismatch`, or an empty string if there is none or a tie
     std::string get_closest_match(const std::string &bc_seq, int max_mismatch);
+    // the same for a sequence packed with its N mask by `pack_barcode`, return the packed
+    // barcode or 0. an N counts as mismatch
+    uint64_t closest_barcode(uint64_t key, uint64_t n_mask, int max_mismatch);
+
+    // build the index used by `closest_barcode` for `max_mismatch`. it is built on first
+    // use otherwise, so call it before `closest_barcode` runs on several threads
+    void build_index(int max_mismatch);
 
     friend std::ostream& operator<< (std::ostream& out, const Barcode& obj);
+
+private:
+    // barcodes of text annotations, those of a binary whitelist stay in `whitelist`
+    std::vector<uint64_t> barcode_list;
+    std::shared_ptr<FileView> whitelist;
+    size_t whitelist_off = 0;
+    size_t whitelist_size = 0;
+    // every barcode is its own cell, `cellid_list` is then empty and cell i is barcode i
+    bool own_cells = false;
+    std::vector<std::string> cellid_list;
+
+    // pigeonhole index of the barcodes: a barcode within `max_mismatch` of a sequence of
+    // the same length matches it exactly in at least one of `max_mismatch + 1` segments,
+    // so only the barcodes sharing a segment with the sequence need to be compared
+    struct SegmentIndex
+    {
+        int max_mismatch = -1; // -1 if not built
+        size_t bc_len = 0; // 0 if the barcodes differ in length
+        std::vector<size_t> seg_start; // segment i is bases [seg_start[i], seg_start[i+1])
+        // (bits of the segment, index of the barcode) per segment, sorted
+        std::vector<std::vector<std::pair<uint64_t, uint32_t>>> segments;
+    };
+    SegmentIndex index;
+
+    // compare the sequence to every barcode, used when the index does not apply
+    uint64_t closest_barcode_scan(uint64_t key, uint64_t n_mask, int max_mismatch) const;
+    uint64_t segment_bits(uint64_t key, size_t s) const;
+
+    // store the cell ids of an own-cell list so that cells with other ids can be added
+    void name_own_cells();
+    // a barcode added again moves to the new cell
+    void add_packed(uint64_t key, uint32_t cell);
+    // copy the barcodes of a binary whitelist so that more can be added
+    void detach_whitelist();
+    void read_whitelist(const std::string &fn);
+};
+
+// memoised `closest_barcode` of every distinct raw barcode seen, a cell with many reads
+// is then corrected once rather than once per read. raw barcodes of up to 31 A, C, G or T
+// are cached by their packed key, other barcodes are kept as strings.
+// lookups are safe from several threads: the entries are split between shards that are
+// locked separately, and the barcode is corrected outside the lock. nothing is evicted
+class BarcodeCache
+{
+public:
+    // a corrected barcode with the index of its cell in `Barcode`
+    struct Match
+    {
+        int cell;
+        uint32_t len;
+        char seq[32];
+        std::string barcode() const { return std::string(seq, len); }
+    };
+
+    // `bar` must outlive the cache and not change while it is used
+    BarcodeCache(Barcode &bar, int max_mismatch);
+
+    // return the corrected barcode of a raw barcode, NULL if there is no match
+    const Match *find(const char *seq, size_t len);
+    const Match *find(const std::string &seq) { return find(seq.data(), seq.size()); }
+
+    int max_mismatch() const { return mismatch; }
+    unsigned long long hits() const;
+    unsigned long long misses() const;
+    // distinct raw barcodes cached
+    size_t size() const;
+    // print the hit rate
+    void report() const;
+
+private:
+    static const size_t n_shards = 64;
+    struct Shard
+    {
+        mutable std::mutex mtx;
+        std::unordered_map<uint64_t, const Match*> packed;
+        std::unordered_map<std::string, const Match*> unpacked;
+        std::deque<Match> matches; // stable storage of the shard's matches
+        unsigned long long hits = 0;
+        unsigned long long misses = 0;
+    };
+
+    Barcode &bar;
+    int mismatch;
+    std::unique_ptr<Shard[]> shards;
+
+    // store the match of the packed barcode `key` in `shard` (NULL if 0), the shard must
+    // be locked
+    const Match *add_match(Shard &shard, uint64_t key);
 };
 
 #endif
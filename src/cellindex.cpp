@@ -0,0 +1,231 @@
+// cellindex.cpp
+#include "cellindex.h"
+#include <cstring>
+#include <fstream>
+
+using std::string;
+using std::unordered_map;
+using std::vector;
+
+namespace {
+uint64_t file_size(const string &fn)
+{
+    std::ifstream in(fn, std::ios::binary | std::ios::ate);
+    return in ? (uint64_t)in.tellg() : 0;
+}
+}
+
+CellIndex::CellIndex(const vector<string> &cell_ids) :
+    cell_ids(cell_ids), ranges(cell_ids.size())
+{
+    for (size_t i = 0; i < cell_ids.size(); i++)
+    {
+        cell_idx[cell_ids[i]] = i;
+    }
+}
+
+CellIndex::CellIndex(const string &fn)
+{
+    check_file_exists(fn);
+    std::ifstream in(fn, std::ios::binary);
+    auto read = [&](void *data, size_t size)
+    {
+        in.read((char*)data, size);
+        if (!in)
+        {
+            Rcpp::stop("corrupt cell index file: " + fn + "\n");
+        }
+    };
+
+    char magic[sizeof(CELL_INDEX_MAGIC)];
+    uint32_t version;
+    read(magic, sizeof(magic));
+    read(&version, sizeof(version));
+    if (memcmp(magic, CELL_INDEX_MAGIC, sizeof(magic)) != 0 || version != CELL_INDEX_VERSION)
+    {
+        Rcpp::stop("not a cell index file or written by another version: " + fn + "\n");
+    }
+    read(&indexed_size, sizeof(indexed_size));
+
+    uint32_t n_cells;
+    read(&n_cells, sizeof(n_cells));
+    cell_ids.resize(n_cells);
+    ranges.resize(n_cells);
+    for (uint32_t i = 0; i < n_cells; i++)
+    {
+        uint32_t len;
+        read(&len, sizeof(len));
+        cell_ids[i].resize(len);
+        read(&cell_ids[i][0], len);
+        cell_idx[cell_ids[i]] = i;
+        uint32_t n_ranges;
+        read(&n_ranges, sizeof(n_ranges));
+        ranges[i].resize(n_ranges);
+        for (auto &range : ranges[i])
+        {
+            read(&range.first, sizeof(range.first));
+            read(&range.second, sizeof(range.second));
+        }
+    }
+}
+
+void CellIndex::add(int cell, uint64_t begin, uint64_t end)
+{
+    vector<VirtualRange> &cell_ranges = ranges[cell];
+    if (!cell_ranges.empty() && cell_ranges.back().second == begin)
+    {
+        cell_ranges.back().second = end;
+    }
+    else
+    {
+        cell_ranges.push_back(VirtualRange(begin, end));
+    }
+}
+
+void CellIndex::write(const string &fn, uint64_t bam_size) const
+{
+    std::ofstream out(fn, std::ios::binary | std::ios::trunc);
+    auto write = [&](const void *data, size_t size)
+    {
+        out.write((const char*)data, size);
+    };
+
+    write(CELL_INDEX_MAGIC, sizeof(CELL_INDEX_MAGIC));
+    write(&CELL_INDEX_VERSION, sizeof(CELL_INDEX_VERSION));
+    write(&bam_size, sizeof(bam_size));
+    uint32_t n_cells = cell_ids.size();
+    write(&n_cells, sizeof(n_cells));
+    for (size_t i = 0; i < cell_ids.size(); i++)
+    {
+        uint32_t len = cell_ids[i].size();
+        write(&len, sizeof(len));
+        write(cell_ids[i].data(), len);
+        uint32_t n_ranges = ranges[i].size();
+        write(&n_ranges, sizeof(n_ranges));
+        for (const auto &range : ranges[i])
+        {
+            write(&range.first, sizeof(range.first));
+            write(&range.second, sizeof(range.second));
+        }
+    }
+    out.close();
+    if (!out)
+    {
+        Rcpp::stop("fail to write the cell index file: " + fn + "\n");
+    }
+}
+
+const vector<VirtualRange> *CellIndex::find(const string &cell_id) const
+{
+    auto it = cell_idx.find(cell_id);
+    return it == cell_idx.end() ? NULL : &ranges[it->second];
+}
+
+void index_cell_bam(const string &bam_fn, const string &cbi_fn, const Barcode &bar, const string &c_tag, HtsPool &pool)
+{
+    check_file_exists(bam_fn);
+    BGZF *fp = bgzf_open(bam_fn.c_str(), "r");
+    bam_hdr_t *header = bam_hdr_read(fp);
+    pool.attach(fp, 64);
+    bam1_t *b = bam_init1();
+
+    CellIndex index(bar.cell_ids());
+    size_t _interrupt_ind = 0;
+    uint64_t begin = bgzf_tell(fp);
+    while (bam_read1(fp, b) >= 0)
+    {
+        if (++_interrupt_ind % 1024 == 0) Rcpp::checkUserInterrupt();
+        uint64_t end = bgzf_tell(fp);
+        uint8_t *c_data = bam_aux_get(b, c_tag.c_str());
+        if (c_data)
+        {
+            const char *bc = (char*)(c_data + 1); // +1 to skip `Z`
+            uint64_t key;
+            int cell = pack_barcode(bc, strlen(bc), key) ? bar.find_cell(key) : -1;
+            if (cell >= 0)
+            {
+                index.add(cell, begin, end);
+            }
+        }
+        begin = end;
+    }
+
+    bam_destroy1(b);
+    bam_hdr_destroy(header);
+    pool.close(fp);
+    index.write(cbi_fn, file_size(bam_fn));
+}
+
+int fetch_cell_reads(const string &bam_fn, const string &cbi_fn, const string &cell_id, const string &out_bam)
+{
+    check_file_exists(bam_fn);
+    CellIndex index(cbi_fn);
+    if (index.bam_size() != file_size(bam_fn))
+    {
+        Rcpp::stop("the cell index does not match the bam file, the bam file has changed since: " + cbi_fn + "\n");
+    }
+    const vector<VirtualRange> *ranges = index.find(cell_id);
+    if (!ranges)
+    {
+        Rcpp::stop("cell not in the index: " + cell_id + "\n");
+    }
+
+    BGZF *fp = bgzf_open(bam_fn.c_str(), "r");
+    bam_hdr_t *header = fp ? bam_hdr_read(fp) : NULL;
+    if (!header)
+    {
+        if (fp) bgzf_close(fp);
+        Rcpp::stop("fail to read the bam header: " + bam_fn + "\n");
+    }
+    samFile *of = sam_open(out_bam.c_str(), "wb");
+    bam1_t *b = bam_init1();
+    // release everything before stopping, `Rcpp::stop` does not return
+    auto fail = [&](const string &msg)
+    {
+        bam_destroy1(b);
+        bam_hdr_destroy(header);
+        if (of) sam_close(of);
+        bgzf_close(fp);
+        Rcpp::stop(msg);
+    };
+    if (!of)
+    {
+        fail("cannot open output bam file: " + out_bam + "\n");
+    }
+    if (sam_hdr_write(of, header) < 0)
+    {
+        fail("fail to write the bam header: " + out_bam + "\n");
+    }
+
+    int n_reads = 0;
+    for (const auto &range : *ranges)
+    {
+        if (bgzf_seek(fp, range.first, SEEK_SET) < 0)
+        {
+            fail("fail to seek in the bam file: " + bam_fn + "\n");
+        }
+        int re = 0;
+        while ((uint64_t)bgzf_tell(fp) < range.second && (re = bam_read1(fp, b)) >= 0)
+        {
+            if (sam_write1(of, header, b) < 0)
+            {
+                fail("fail to write the bam file: " + out_bam + "\n");
+            }
+            n_reads++;
+        }
+        if (re < -1)
+        {
+            fail("fail to read the bam file: " + bam_fn + "\n");
+        }
+    }
+
+    bam_destroy1(b);
+    bam_hdr_destroy(header);
+    if (sam_close(of) < 0)
+    {
+        bgzf_close(fp);
+        Rcpp::stop("fail to write the bam file: " + out_bam + "\n");
+    }
+    bgzf_close(fp);
+    return n_reads;
+}
@@ -0,0 +1,59 @@
+// cellindex.h
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <Rcpp.h>
+#include "config_hts.h"
+#include "htspool.h"
+#include "cellbarcode.h"
+
+#ifndef CELLINDEX_H
+#define CELLINDEX_H
+
+// sidecar index of a bam file from cell id to the BGZF virtual offset ranges holding
+// the reads of the cell, written as [bam].cbi. the ranges do not depend on the sort
+// order of the bam, consecutive reads of a cell share one range.
+//
+// layout, in native byte order:
+//   header: magic "SCPCELLI", uint32 version, uint64 size of the indexed bam file
+//   uint32 number of cells, then per cell its id, uint32 number of ranges and per
+//   range the uint64 virtual offsets of its first read and past its last read
+//   strings are stored as uint32 length followed by the characters
+const char CELL_INDEX_MAGIC[8] = {'S', 'C', 'P', 'C', 'E', 'L', 'L', 'I'};
+const uint32_t CELL_INDEX_VERSION = 1;
+
+typedef std::pair<uint64_t, uint64_t> VirtualRange;
+
+class CellIndex
+{
+public:
+    // an empty index of the cells in `cell_ids`
+    explicit CellIndex(const std::vector<std::string> &cell_ids);
+    // read an index written by `write`
+    explicit CellIndex(const std::string &fn);
+
+    // add the read of a cell, given by its index in `cell_ids`, found at [begin, end)
+    void add(int cell, uint64_t begin, uint64_t end);
+    void write(const std::string &fn, uint64_t bam_size) const;
+
+    // ranges of a cell in file order, NULL if the cell is not in the index
+    const std::vector<VirtualRange> *find(const std::string &cell_id) const;
+    uint64_t bam_size() const { return indexed_size; }
+
+private:
+    std::vector<std::string> cell_ids;
+    std::vector<std::vector<VirtualRange>> ranges;
+    std::unordered_map<std::string, size_t> cell_idx;
+    uint64_t indexed_size = 0;
+};
+
+// index the reads of `bam_fn` by the cell of their corrected barcode in tag `c_tag`,
+// reads with a barcode of no cell in `bar` are skipped. `pool` decompresses the bam
+void index_cell_bam(const std::string &bam_fn, const std::string &cbi_fn, const Barcode &bar, const std::string &c_tag, HtsPool &pool);
+
+// write the reads of one cell to `out_bam` using the index `cbi_fn` of `bam_fn`,
+// return the number of reads
+int fetch_cell_reads(const std::string &bam_fn, const std::string &cbi_fn, const std::string &cell_id, const std::string &out_bam);
+
+#endif
@@ -0,0 +1,307 @@
+// cellreads.cpp
+#include "cellreads.h"
+#include <cstdio>
+#include <cstring>
+
+using std::string;
+using std::unordered_map;
+using std::vector;
+
+namespace {
+const size_t HEADER_SIZE = sizeof(CELL_READS_MAGIC) + 2 * sizeof(uint32_t) + 2 * sizeof(uint64_t);
+}
+
+bool pack_umi(const char *umi, CellRead &rd)
+{
+    rd.umi = 0;
+    rd.umi_n = 0;
+    size_t len = strlen(umi);
+    if (len > MAX_PACKED_UMI)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++)
+    {
+        uint64_t code;
+        switch (umi[i])
+        {
+            case 'A': code = 0; break;
+            case 'C': code = 1; break;
+            case 'G': code = 2; break;
+            case 'T': code = 3; break;
+            default: code = 0; rd.umi_n |= 1u << i;
+        }
+        rd.umi |= code << (2 * i);
+    }
+    rd.umi_len = len;
+    return true;
+}
+
+string unpack_umi(const CellRead &rd)
+{
+    static const char bases[4] = {'A', 'C', 'G', 'T'};
+    string umi(rd.umi_len, 'N');
+    for (size_t i = 0; i < rd.umi_len; i++)
+    {
+        if (!(rd.umi_n & (1u << i)))
+        {
+            umi[i] = bases[(rd.umi >> (2 * i)) & 3];
+        }
+    }
+    return umi;
+}
+
+CellReadWriter::CellReadWriter(const string &fn, const vector<string> &cell_ids, size_t memory_budget, size_t cell_buffer) :
+    fn(fn), out(fn, std::ios::binary | std::ios::trunc), memory_budget(memory_budget), cell_buffer(cell_buffer),
+    cell_ids(cell_ids), buffers(cell_ids.size()), extents(cell_ids.size())
+{
+    if (!out)
+    {
+        Rcpp::stop("cannot open the cell read file: " + fn + "\n");
+    }
+    // the index offset and number of records are filled in by `close`
+    char header[HEADER_SIZE] = {};
+    memcpy(header, CELL_READS_MAGIC, sizeof(CELL_READS_MAGIC));
+    uint32_t version = CELL_READS_VERSION;
+    uint32_t record_size = sizeof(CellRead);
+    memcpy(header + sizeof(CELL_READS_MAGIC), &version, sizeof(version));
+    memcpy(header + sizeof(CELL_READS_MAGIC) + sizeof(version), &record_size, sizeof(record_size));
+    write(header, HEADER_SIZE);
+}
+
+CellReadWriter::~CellReadWriter()
+{
+    // a file left without index after an error is incomplete
+    if (out.is_open())
+    {
+        out.close();
+        std::remove(fn.c_str());
+    }
+}
+
+void CellReadWriter::add(int cell, const char *gene_id, const char *umi, int pos)
+{
+    CellRead rd;
+    if (!pack_umi(umi, rd))
+    {
+        Rcpp::stop("UMI longer than " + std::to_string(MAX_PACKED_UMI) + " bases, write csv count files instead: " + umi + "\n");
+    }
+    auto gene_it = gene_idx.find(gene_id);
+    if (gene_it == gene_idx.end())
+    {
+        gene_it = gene_idx.insert(std::make_pair(string(gene_id), (uint32_t)gene_ids.size())).first;
+        gene_ids.push_back(gene_id);
+    }
+    rd.gene = gene_it->second;
+    rd.pos = pos;
+
+    vector<CellRead> &buf = buffers[cell];
+    buf.push_back(rd);
+    buffered += sizeof(CellRead);
+    if (buf.size() >= cell_buffer)
+    {
+        flush(cell, false);
+    }
+    if (buffered > memory_budget)
+    {
+        for (size_t i = 0; i < buffers.size(); i++)
+        {
+            flush(i, true);
+        }
+    }
+}
+
+void CellReadWriter::flush(size_t cell, bool release)
+{
+    vector<CellRead> &buf = buffers[cell];
+    if (buf.empty())
+    {
+        return;
+    }
+    write(buf.data(), buf.size() * sizeof(CellRead));
+    extents[cell].push_back(std::make_pair(n_records, (uint32_t)buf.size()));
+    n_records += buf.size();
+    buffered -= buf.size() * sizeof(CellRead);
+    if (release)
+    {
+        vector<CellRead>().swap(buf);
+    }
+    else
+    {
+        buf.clear(); // the cell is likely to fill its buffer again
+    }
+}
+
+void CellReadWriter::write(const void *data, size_t size)
+{
+    out.write((const char*)data, size);
+    if (!out)
+    {
+        Rcpp::stop("fail to write the cell read file: " + fn + "\n");
+    }
+}
+
+void CellReadWriter::close()
+{
+    for (size_t i = 0; i < buffers.size(); i++)
+    {
+        flush(i, true);
+    }
+
+    uint64_t index_offset = HEADER_SIZE + n_records * sizeof(CellRead);
+    auto write_str = [&](const string &s)
+    {
+        uint32_t len = s.size();
+        write(&len, sizeof(len));
+        write(s.data(), s.size());
+    };
+    uint32_t n_genes = gene_ids.size();
+    write(&n_genes, sizeof(n_genes));
+    for (const string &gene_id : gene_ids)
+    {
+        write_str(gene_id);
+    }
+    uint32_t n_cells = cell_ids.size();
+    write(&n_cells, sizeof(n_cells));
+    for (size_t i = 0; i < cell_ids.size(); i++)
+    {
+        write_str(cell_ids[i]);
+        uint32_t n_extents = extents[i].size();
+        write(&n_extents, sizeof(n_extents));
+        for (const auto &ext : extents[i])
+        {
+            write(&ext.first, sizeof(ext.first));
+            write(&ext.second, sizeof(ext.second));
+        }
+    }
+
+    out.seekp(sizeof(CELL_READS_MAGIC) + 2 * sizeof(uint32_t));
+    write(&index_offset, sizeof(index_offset));
+    write(&n_records, sizeof(n_records));
+    out.close();
+    if (!out)
+    {
+        Rcpp::stop("fail to write the cell read file: " + fn + "\n");
+    }
+}
+
+// without a mapping the extents are read on demand rather than loading the whole file
+CellReadReader::CellReadReader(const string &fn) : fn(fn), view(fn, false)
+{
+    check_file_exists(fn);
+    if (view.is_mapped())
+    {
+        mapped = view.data();
+        file_size = view.size();
+    }
+    else
+    {
+        in.open(fn, std::ios::binary);
+        in.seekg(0, std::ios::end);
+        file_size = in.tellg();
+    }
+
+    char magic[sizeof(CELL_READS_MAGIC)];
+    uint32_t version, record_size;
+    uint64_t index_offset, n_records;
+    uint64_t off = 0;
+    read(off, magic, sizeof(magic)); off += sizeof(magic);
+    read(off, &version, sizeof(version)); off += sizeof(version);
+    read(off, &record_size, sizeof(record_size)); off += sizeof(record_size);
+    read(off, &index_offset, sizeof(index_offset)); off += sizeof(index_offset);
+    read(off, &n_records, sizeof(n_records));
+    if (memcmp(magic, CELL_READS_MAGIC, sizeof(magic)) != 0 || version != CELL_READS_VERSION ||
+        record_size != sizeof(CellRead) || index_offset != HEADER_SIZE + n_records * sizeof(CellRead))
+    {
+        Rcpp::stop("not a cell read file or written by another version: " + fn + "\n");
+    }
+
+    off = index_offset;
+    auto read_str = [&]()
+    {
+        uint32_t len;
+        read(off, &len, sizeof(len)); off += sizeof(len);
+        string s(len, '\0');
+        read(off, &s[0], len); off += len;
+        return s;
+    };
+    uint32_t n_genes;
+    read(off, &n_genes, sizeof(n_genes)); off += sizeof(n_genes);
+    for (uint32_t i = 0; i < n_genes; i++)
+    {
+        gene_ids.push_back(read_str());
+    }
+    uint32_t n_cells;
+    read(off, &n_cells, sizeof(n_cells)); off += sizeof(n_cells);
+    for (uint32_t i = 0; i < n_cells; i++)
+    {
+        auto &cell = cell_extents[read_str()];
+        uint32_t n_extents;
+        read(off, &n_extents, sizeof(n_extents)); off += sizeof(n_extents);
+        for (uint32_t j = 0; j < n_extents; j++)
+        {
+            std::pair<uint64_t, uint32_t> ext;
+            read(off, &ext.first, sizeof(ext.first)); off += sizeof(ext.first);
+            read(off, &ext.second, sizeof(ext.second)); off += sizeof(ext.second);
+            if (ext.first + ext.second > n_records)
+            {
+                Rcpp::stop("corrupt cell read file: " + fn + "\n");
+            }
+            cell.push_back(ext);
+        }
+    }
+}
+
+void CellReadReader::read(uint64_t offset, void *data, size_t size)
+{
+    if (offset + size > file_size)
+    {
+        Rcpp::stop("corrupt cell read file: " + fn + "\n");
+    }
+    if (mapped)
+    {
+        memcpy(data, mapped + offset, size);
+        return;
+    }
+    in.seekg(offset);
+    in.read((char*)data, size);
+    if (!in)
+    {
+        Rcpp::stop("fail to read the cell read file: " + fn + "\n");
+    }
+}
+
+unordered_map<string, vector<umi_pos_pair>> CellReadReader::read_cell(const string &cell_id)
+{
+    unordered_map<string, vector<umi_pos_pair>> gene_read;
+    auto it = cell_extents.find(cell_id);
+    if (it == cell_extents.end())
+    {
+        return gene_read;
+    }
+    vector<CellRead> records;
+    for (const auto &ext : it->second)
+    {
+        uint64_t offset = HEADER_SIZE + ext.first * sizeof(CellRead);
+        const CellRead *rd;
+        if (mapped)
+        {
+            rd = (const CellRead*)(mapped + offset);
+        }
+        else
+        {
+            records.resize(ext.second);
+            read(offset, records.data(), ext.second * sizeof(CellRead));
+            rd = records.data();
+        }
+        for (uint32_t i = 0; i < ext.second; i++)
+        {
+            if (rd[i].gene >= gene_ids.size())
+            {
+                Rcpp::stop("corrupt cell read file: " + fn + "\n");
+            }
+            gene_read[gene_ids[rd[i].gene]].push_back(umi_pos_pair(unpack_umi(rd[i]), rd[i].pos));
+        }
+    }
+    return gene_read;
+}
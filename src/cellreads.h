@@ -0,0 +1,102 @@
+// cellreads.h
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <Rcpp.h>
+#include "utils.h"
+
+#ifndef CELLREADS_H
+#define CELLREADS_H
+
+// binary container of the (gene, UMI, position) reads of every cell, written by
+// `barcode_demultiplex` in place of one csv file per cell.
+//
+// layout, in native byte order:
+//   header: magic "SCPCELLR", uint32 version, uint32 record size,
+//           uint64 index offset, uint64 number of records
+//   records: fixed width `CellRead`, in extents of consecutive reads of one cell
+//   index: uint32 number of genes, then per gene its id
+//          uint32 number of cells, then per cell its id, uint32 number of extents
+//          and per extent uint64 first record and uint32 number of records
+//   strings are stored as uint32 length followed by the characters
+const char CELL_READS_MAGIC[8] = {'S', 'C', 'P', 'C', 'E', 'L', 'L', 'R'};
+const uint32_t CELL_READS_VERSION = 1;
+const size_t MAX_PACKED_UMI = 32;
+
+struct CellRead
+{
+    uint64_t umi; // 2 bits per base, base i in bits 2i and 2i+1
+    uint32_t umi_n; // bit i is set if base i is N
+    uint32_t gene; // index in the gene table
+    int32_t pos;
+    uint32_t umi_len;
+};
+
+// pack a UMI of at most `MAX_PACKED_UMI` bases, bases other than A, C, G or T are stored as N.
+// return false if the UMI is too long
+bool pack_umi(const char *umi, CellRead &rd);
+std::string unpack_umi(const CellRead &rd);
+
+// the reads are buffered per cell and appended to the file as one extent once a cell
+// holds `cell_buffer` reads, or for every cell once all buffers together hold more
+// than `memory_budget` bytes. the index is written by `close`
+class CellReadWriter
+{
+public:
+    CellReadWriter(const std::string &fn, const std::vector<std::string> &cell_ids, size_t memory_budget = 256 << 20, size_t cell_buffer = 4096);
+    ~CellReadWriter();
+
+    CellReadWriter(const CellReadWriter&) = delete;
+    CellReadWriter &operator=(const CellReadWriter&) = delete;
+
+    // add a read to a cell, given by its index in `cell_ids`
+    void add(int cell, const char *gene_id, const char *umi, int pos);
+    // write the remaining reads and the index
+    void close();
+
+private:
+    std::string fn;
+    std::ofstream out;
+    size_t memory_budget;
+    size_t cell_buffer;
+    size_t buffered = 0;
+    uint64_t n_records = 0;
+    std::vector<std::string> cell_ids;
+    std::vector<std::string> gene_ids;
+    std::unordered_map<std::string, uint32_t> gene_idx;
+    std::vector<std::vector<CellRead>> buffers;
+    // per cell (first record, number of records)
+    std::vector<std::vector<std::pair<uint64_t, uint32_t>>> extents;
+
+    void flush(size_t cell, bool release);
+    void write(const void *data, size_t size);
+};
+
+// reads a `CellReadWriter` container. the file is memory mapped where supported,
+// elsewhere the extents of a cell are read when it is loaded
+class CellReadReader
+{
+public:
+    explicit CellReadReader(const std::string &fn);
+
+    CellReadReader(const CellReadReader&) = delete;
+    CellReadReader &operator=(const CellReadReader&) = delete;
+
+    // gene id -> (UMI, position) reads of a cell, empty if the cell has no reads
+    std::unordered_map<std::string, std::vector<umi_pos_pair>> read_cell(const std::string &cell_id);
+
+private:
+    std::string fn;
+    FileView view;
+    const char *mapped = NULL; // data of `view` if the file is mapped
+    size_t file_size = 0;
+    std::ifstream in;
+    std::vector<std::string> gene_ids;
+    std::unordered_map<std::string, std::vector<std::pair<uint64_t, uint32_t>>> cell_extents;
+
+    void read(uint64_t offset, void *data, size_t size);
+};
+
+#endif
@@ -0,0 +1,87 @@
+// cellwriter.cpp
+#include "cellwriter.h"
+
+using std::string;
+
+CellWriter::CellWriter(Barcode &bar, size_t memory_budget, size_t cell_buffer) :
+    memory_budget(memory_budget), cell_buffer(cell_buffer), cell_ids(bar.cell_ids())
+{
+}
+
+int CellWriter::add_output(const string &count_dir, const string &header_line)
+{
+    std::vector<string> out_paths;
+    for (const string &cell_id : cell_ids)
+    {
+        out_paths.push_back(join_path(count_dir, cell_id + ".csv"));
+        std::ofstream ofile(out_paths.back());
+        ofile << header_line << "\n";
+        if (!ofile)
+        {
+            Rcpp::stop("fail to write the count file: " + out_paths.back() + "\n");
+        }
+    }
+    paths.push_back(out_paths);
+    buffers.push_back(std::vector<string>(cell_ids.size()));
+    return paths.size() - 1;
+}
+
+void CellWriter::add(int output, int cell, const char *first, const char *second, long long pos, char status)
+{
+    string &buf = buffers[output][cell];
+    size_t old_size = buf.size();
+
+    char num[32];
+    int len = snprintf(num, sizeof(num), "%lld", pos);
+    buf.append(first).append(1, ',').append(second).append(1, ',').append(num, len);
+    if (status)
+    {
+        buf.append(1, ',').append(1, status);
+    }
+    buf.append(1, '\n');
+    buffered += buf.size() - old_size;
+
+    if (buf.size() >= cell_buffer)
+    {
+        flush(output, cell, false);
+    }
+    if (buffered > memory_budget)
+    {
+        flush();
+    }
+}
+
+void CellWriter::flush()
+{
+    for (size_t i = 0; i < buffers.size(); i++)
+    {
+        for (size_t j = 0; j < buffers[i].size(); j++)
+        {
+            flush(i, j, true);
+        }
+    }
+}
+
+void CellWriter::flush(size_t output, size_t cell, bool release)
+{
+    string &buf = buffers[output][cell];
+    if (buf.empty())
+    {
+        return;
+    }
+    std::ofstream ofile(paths[output][cell], std::ios::app);
+    ofile.write(buf.data(), buf.size());
+    if (!ofile)
+    {
+        Rcpp::stop("fail to write the count file: " + paths[output][cell] + "\n");
+    }
+    buffered -= buf.size();
+    if (release)
+    {
+        string().swap(buf);
+    }
+    else
+    {
+        buf.clear(); // the cell is likely to fill its buffer again
+    }
+}
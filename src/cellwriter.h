@@ -0,0 +1,43 @@
+// cellwriter.h
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "cellbarcode.h"
+
+#ifndef CELLWRITER_H
+#define CELLWRITER_H
+
+// writes the per cell csv files of `barcode_demultiplex` while the bam file is read.
+// the lines of each cell are buffered and appended to the cell file once the buffer
+// reaches `cell_buffer` bytes, and every buffer is written out and released when all
+// outputs together hold more than `memory_budget` bytes, so the memory used does not
+// grow with the number of reads. the lines of a cell keep their order
+class CellWriter
+{
+public:
+    explicit CellWriter(Barcode &bar, size_t memory_budget = 256 << 20, size_t cell_buffer = 64 << 10);
+
+    // create [count_dir]/[cell_id].csv holding `header_line` for every cell of the
+    // barcode annotation and return the output number
+    int add_output(const std::string &count_dir, const std::string &header_line);
+
+    // queue the line "first,second,pos" to a cell, given by the index `Barcode::cell_id` takes.
+    // ",status" is added if `status` is not 0
+    void add(int output, int cell, const char *first, const char *second, long long pos, char status = 0);
+
+    // append the buffered lines of every output to the files
+    void flush();
+
+private:
+    size_t memory_budget;
+    size_t cell_buffer;
+    size_t buffered = 0;
+    std::vector<std::string> cell_ids;
+    // output -> cell -> file path and buffered lines
+    std::vector<std::vector<std::string>> paths;
+    std::vector<std::vector<std::string>> buffers;
+
+    void flush(size_t output, size_t cell, bool release);
+};
+
+#endif
@@ -7,6 +7,7 @@
 #include "htslib/bgzf.h"
 #include "htslib/kseq.h"
 #include "htslib/thread_pool.h"
+#include "htslib/tbx.h"
 
 /*
 #include <htslib/sam.h>
@@ -0,0 +1,77 @@
+// htspool.cpp
+#include <algorithm>
+#include "htspool.h"
+
+namespace {
+// remove `fp` from `files` if it is there
+template <typename T>
+void forget(std::vector<T*> &files, T *fp)
+{
+    auto it = std::find(files.begin(), files.end(), fp);
+    if (it != files.end())
+    {
+        files.erase(it);
+    }
+}
+}
+
+HtsPool::HtsPool(int nthreads)
+{
+    p.pool = nthreads > 0 ? hts_tpool_init(nthreads) : NULL;
+    p.qsize = 0;
+    n = p.pool ? nthreads : 0;
+}
+
+HtsPool::~HtsPool()
+{
+    // the reader and writer threads of open files use the pool until they are closed
+    for (BGZF *fp : bgzf_files)
+    {
+        bgzf_close(fp);
+    }
+    for (samFile *fp : sam_files)
+    {
+        sam_close(fp);
+    }
+    if (p.pool) hts_tpool_destroy(p.pool);
+}
+
+void HtsPool::attach(BGZF *fp, int queue_size)
+{
+    if (!p.pool || !fp)
+    {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mtx);
+    bgzf_thread_pool(fp, p.pool, queue_size);
+    bgzf_files.push_back(fp);
+}
+
+void HtsPool::attach(samFile *fp)
+{
+    if (!p.pool || !fp)
+    {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mtx);
+    hts_set_opt(fp, HTS_OPT_THREAD_POOL, &p);
+    sam_files.push_back(fp);
+}
+
+int HtsPool::close(BGZF *fp)
+{
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        forget(bgzf_files, fp);
+    }
+    return bgzf_close(fp);
+}
+
+int HtsPool::close(samFile *fp)
+{
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        forget(sam_files, fp);
+    }
+    return sam_close(fp);
+}
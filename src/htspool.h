@@ -0,0 +1,46 @@
+// htspool.h
+#include <mutex>
+#include <vector>
+#include "config_hts.h"
+
+#ifndef HTSPOOL_H
+#define HTSPOOL_H
+
+// owns the htslib thread pool of a command. every input and output bam of the
+// command shares the pool for its bgzf decompression and compression: the pool
+// threads take jobs from whichever file queue has work, so they follow the busy
+// stage rather than being split between input and output up front.
+// attached files are closed through the pool. files still open when the pool goes
+// out of scope, e.g. after an error or a user interrupt, are closed before the
+// pool threads are stopped
+class HtsPool
+{
+public:
+    // no pool is created for less than one thread, files then stay single threaded
+    explicit HtsPool(int nthreads);
+    ~HtsPool();
+
+    HtsPool(const HtsPool&) = delete;
+    HtsPool &operator=(const HtsPool&) = delete;
+
+    // number of pool threads, 0 without a pool
+    int size() const { return n; }
+
+    // `queue_size` of 0 lets htslib size the queue from the number of threads.
+    // safe to call from several threads
+    void attach(BGZF *fp, int queue_size = 0);
+    void attach(samFile *fp);
+
+    // close a file whether or not it is attached, return the htslib close code
+    int close(BGZF *fp);
+    int close(samFile *fp);
+
+private:
+    htsThreadPool p;
+    int n;
+    std::mutex mtx;
+    std::vector<BGZF*> bgzf_files;
+    std::vector<samFile*> sam_files;
+};
+
+#endif
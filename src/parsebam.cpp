@@ -9,31 +9,30 @@ using namespace Rcpp;
 
 Bamdemultiplex::Bamdemultiplex(string odir, Barcode b, string cellular_tag, string molecular_tag, string gene_tag, string map_tag, string MT_tag)
 {
-    bar = b;
+    bar = std::move(b);
     c_tag = cellular_tag;
     m_tag = molecular_tag;
     g_tag = gene_tag;
     a_tag = map_tag;
     out_dir = odir;
     mt_tag = MT_tag;
+    stats = DemuxStats(bar.n_cells());
+}
 
-    for (const auto& n : bar.cellid_list)
+void DemuxStats::add(const DemuxStats &other)
+{
+    for (size_t i = 0; i < overall.size(); i++)
     {
-        cell_mapped_exon[n] = 0;
-        cell_mapped_intron[n] = 0;
-        cell_mapped_ambiguous[n] = 0;
-        cell_align_unmapped[n] = 0;
-        cell_unaligned[n] = 0;
-        cell_ERCC[n] = 0;
-        cell_MT[n] = 0;
+        overall[i] += other.overall[i];
+    }
+    for (size_t i = 0; i < cells.size(); i++)
+    {
+        cells[i] += other.cells[i];
+    }
+    for (size_t i = 0; i < chr.size() && i < other.chr.size(); i++)
+    {
+        chr[i] += other.chr[i];
     }
-
-    overall_count_stat["barcode_match"] = 0;
-    overall_count_stat["barcode_unmatch_unaligned"] = 0;
-    overall_count_stat["barcode_unmatch_aligned"] = 0;
-    overall_count_stat["barcode_unmatch_mapped_to_exon"] = 0;
-    overall_count_stat["barcode_unmatch_mapped_to_intron"] = 0;
-    overall_count_stat["barcode_unmatch_ambiguous_mapping"] = 0;
 }
 
 void Bamdemultiplex::write_statistics(string overall_stat_f, string chr_stat_f, string cell_stat_f)
@@ -44,9 +43,9 @@ void Bamdemultiplex::write_statistics(string overall_stat_f, string chr_stat_f,
     ofstream cell_stat(join_path(stat_dir, cell_stat_f + ".csv"));
     overall_stat << "status,count" << "\n";
 
-    for (const auto& n : overall_count_stat)
+    for (int i = 0; i < DemuxStats::N_OVERALL; i++)
     {
-        overall_stat << n.first << "," << n.second << "\n";
+        overall_stat << OVERALL_STAT_NAMES[i] << "," << stats.overall[i] << "\n";
     }
 
     chr_stat << "chromosome name,count" << "\n";
@@ -56,48 +55,23 @@ void Bamdemultiplex::write_statistics(string overall_stat_f, string chr_stat_f,
     }
 
     cell_stat << "cell_id,unaligned,aligned_unmapped,mapped_to_exon,mapped_to_intron,ambiguous_mapping,mapped_to_ERCC,mapped_to_MT" << "\n";
-    for (const auto& n : bar.cellid_list)
+    for (size_t i = 0; i < bar.n_cells(); i++)
     {
-        cell_stat << n << "," << cell_unaligned[n] << "," << \
-            cell_align_unmapped[n] << "," << \
-            cell_mapped_exon[n] << "," << \
-            cell_mapped_intron[n] << "," << \
-            cell_mapped_ambiguous[n] << "," << \
-            cell_ERCC[n] << ","<< \
-            cell_MT[n] << "\n";
+        cell_stat << bar.cell_id(i);
+        for (int k = 0; k < DemuxStats::N_CELL_STATUS; k++)
+        {
+            cell_stat << "," << stats.cell(i, (DemuxStats::CellStatus)k);
+        }
+        cell_stat << "\n";
     }
 }
 
-int Bamdemultiplex::clean_bam_barcode(string bam_path, string out_bam, int max_mismatch, int nthreads)
+int Bamdemultiplex::find_mt_idx(const bam_hdr_t *header)
 {
-    check_file_exists(bam_path); // htslib does not check if file exist so we do it manually
-    bam1_t *b = bam_init1();
-    BGZF *fp = bgzf_open(bam_path.c_str(), "r");
-    bam_hdr_t *header = bam_hdr_read(fp);
-    
-    int hts_retcode;
-
-    samFile *of = sam_open(out_bam.c_str(), "wb"); // output file
-    hts_retcode = sam_hdr_write(of, header); // (void) explicitly discard return value
-
-    // Early benchmarking shows BAM reading doesn't saturate even 2 cores
-    // so capped reading threads to 2
-    int out_threads = std::min(nthreads - 1, 2);
-    // make sure we're not using 0 or negative cores
-    out_threads = std::max(nthreads, 1);
-
-    hts_tpool *p;
-    const int queue_size = 64;
-
-    if (out_threads > 1) {
-        p = hts_tpool_init(out_threads);
-        bgzf_thread_pool(fp, p, queue_size);
-    }
-
     int mt_idx = -1;
     for (int i = 0; i < header->n_targets; ++i)
     {
-        chr_aligned_stat[header->target_name[i]] = 0;
+        chr_aligned_stat.emplace(header->target_name[i], 0); // keep counts from previous bam files
         if (strcmp(header->target_name[i], mt_tag.c_str()) == 0)
         {
             mt_idx = i;
@@ -108,238 +82,678 @@ int Bamdemultiplex::clean_bam_barcode(string bam_path, string out_bam, int max_m
     {
         Rcpp::Rcout << "Warning: mitochondrial chromosome not found using chromosome name `"<< mt_tag << "`.\n";
     }
+    return mt_idx;
+}
 
-    const char * c_ptr = c_tag.c_str();
+DemuxStats Bamdemultiplex::new_stats(const bam_hdr_t *header) const
+{
+    return DemuxStats(bar.n_cells(), header->n_targets);
+}
 
-    string bc_seq;
-    string match_res;
-    //int map_status;
+void Bamdemultiplex::add_stats(const bam_hdr_t *header, const DemuxStats &read_stats)
+{
+    stats.add(read_stats);
+    for (int i = 0; i < header->n_targets && i < (int)read_stats.chr.size(); i++)
+    {
+        chr_aligned_stat[header->target_name[i]] += read_stats.chr[i];
+    }
+}
 
-    size_t _interrupt_ind = 0;
+bool Bamdemultiplex::tally_read(DemuxStats &read_stats, const bam_hdr_t *header, const bam1_t *b, const BarcodeCache::Match *match, bool has_gene, bool has_map_status, int map_status, int mt_idx) const
+{
+    bool is_unmapped = (b->core.flag & BAM_FUNMAP) > 0;
+    if (is_unmapped)
+    {
+        if (!match)
+        {
+            read_stats.overall[DemuxStats::UNMATCH_UNALIGNED]++;
+        }
+        else
+        {
+            read_stats.overall[DemuxStats::BARCODE_MATCH]++;
+            read_stats.cell(match->cell, DemuxStats::UNALIGNED)++;
+        }
+        return false;
+    }
 
-    while (bam_read1(fp, b) >= 0)
+    read_stats.chr[b->core.tid]++;
+    if (has_gene) // found a gene; read mapped to transcriptome
     {
-        if (++_interrupt_ind % 1024 == 0) checkUserInterrupt();
-        //match barcode
-        bc_seq = (char*)(bam_aux_get(b, c_ptr) + 1); // +1 to skip `Z`
-        match_res = bar.get_closest_match(bc_seq, max_mismatch);
+        if (!match)
+        {
+            read_stats.overall[DemuxStats::UNMATCH_EXON]++;
+            return false;
+        }
 
-        bool is_unmapped = (b->core.flag & BAM_FUNMAP) > 0;
-        // if the read is aligned and with matched barcode.
-        if ((!is_unmapped) & (!match_res.empty())) 
+        read_stats.overall[DemuxStats::BARCODE_MATCH]++;
+        if (std::strncmp (header->target_name[b->core.tid],"ERCC",4) == 0)
         {
-            bam_aux_update_str(b, c_ptr, match_res.length()+1, match_res.c_str());
-            hts_retcode = sam_write1(of, header, b); // (void) discards return value
+            read_stats.cell(match->cell, DemuxStats::MAPPED_ERCC)++;
         }
+        else
+        {
+            read_stats.cell(match->cell, DemuxStats::MAPPED_EXON)++;
+        }
+        if (b->core.tid == mt_idx)
+        {
+            read_stats.cell(match->cell, DemuxStats::MAPPED_MT)++;
+        }
+        return true;
     }
 
-    sam_close(of);
-    bgzf_close(fp);
-    return 0;
+    // return:
+    //  <=0 - unique map to exon, number indicate the distance to transcript end pos
+    //  1 - ambiguous map to multiple exon
+    //  2 - map to intron
+    //  3 - unmapped
+    //  4 - unaligned
+    if (!match)
+    {
+        if (has_map_status && map_status == 1)
+        {
+            read_stats.overall[DemuxStats::UNMATCH_AMBIGUOUS]++;
+        }
+        else if (has_map_status && map_status == 2)
+        {
+            read_stats.overall[DemuxStats::UNMATCH_INTRON]++;
+        }
+        else
+        {
+            read_stats.overall[DemuxStats::UNMATCH_ALIGNED]++;
+        }
+    }
+    else
+    {
+        read_stats.overall[DemuxStats::BARCODE_MATCH]++;
+        if (has_map_status && map_status == 1)
+        {
+            read_stats.cell(match->cell, DemuxStats::MAPPED_AMBIGUOUS)++;
+        }
+        else if (has_map_status && map_status == 2)
+        {
+            read_stats.cell(match->cell, DemuxStats::MAPPED_INTRON)++;
+        }
+        else
+        {
+            read_stats.cell(match->cell, DemuxStats::ALIGN_UNMAPPED)++;
+        }
+    }
+    return false;
 }
 
-int Bamdemultiplex::barcode_demultiplex(string bam_path, int max_mismatch, bool has_UMI, int nthreads)
+BarcodeCache &Bamdemultiplex::barcode_cache(int max_mismatch)
 {
-    check_file_exists(bam_path); // htslib does not check if file exist so we do it manually
-    bam1_t *b = bam_init1();
-    BGZF *fp = bgzf_open(bam_path.c_str(), "r");
-    bam_hdr_t *header = bam_hdr_read(fp);
+    if (!bc_cache || bc_cache->max_mismatch() != max_mismatch)
+    {
+        bc_cache = std::make_shared<BarcodeCache>(bar, max_mismatch);
+    }
+    return *bc_cache;
+}
 
-    // Early benchmarking shows BAM reading doesn't saturate even 2 cores
-    // so capped reading threads to 2
-    int out_threads = std::min(nthreads - 1, 2);
-    // make sure we're not using 0 or negative cores
-    out_threads = std::max(nthreads, 1);
+namespace {
+// corrected barcode of the cell barcode tag, NULL if the tag is missing or has no match
+const BarcodeCache::Match *find_barcode(BarcodeCache &cache, const bam1_t *b, const char *c_ptr)
+{
+    uint8_t *c_data = bam_aux_get(b, c_ptr);
+    if (!c_data)
+    {
+        return NULL;
+    }
+    const char *bc_seq = (char*)(c_data + 1); // +1 to skip `Z`
+    return cache.find(bc_seq, strlen(bc_seq));
+}
+}
 
-    hts_tpool *p;
-    const int queue_size = 64;
+namespace {
+// an output line of `barcode_demultiplex`, its two text fields are NUL terminated in `BamBatch::text`
+struct DemuxLine
+{
+    int output; // -1 for the binary cell reads
+    int cell;
+    size_t first;
+    size_t second;
+    int pos;
+    char status;
+};
+
+// reads handed to a worker together with what it made of them, in read order
+struct BamBatch
+{
+    std::vector<bam1_t*> reads;
+    size_t n_reads = 0;
+    size_t seq = 0;
+    // `barcode_demultiplex`: the count file lines of the reads
+    std::vector<DemuxLine> lines;
+    string text;
+    // `clean_bam_barcode`: per read the index of its cell, -1 if the read is dropped
+    std::vector<int> cells;
+
+    void add_line(int output, int cell, const char *first, const char *second, int pos, char status = 0)
+    {
+        DemuxLine line = {output, cell, text.size(), 0, pos, status};
+        text.append(first).append(1, '\0');
+        line.second = text.size();
+        text.append(second).append(1, '\0');
+        lines.push_back(line);
+    }
+};
 
-    if (out_threads > 1) {
-        p = hts_tpool_init(out_threads);
-        bgzf_thread_pool(fp, p, queue_size);
+// the calling thread reads batches of records, the workers process them and the calling
+// thread takes them back in the order they were read, so the output is written as in
+// a serial run. the workers are stopped and joined when the pipeline goes out of scope,
+// also after an error or a user interrupt on the calling thread
+class BamPipeline
+{
+public:
+    // `work(batch, worker)` runs on `n_workers` threads, or on the calling thread without workers
+    BamPipeline(int n_workers, size_t batch_size, const std::function<void(BamBatch&, int)> &work) :
+        batch_size(batch_size), work(work), batches(2 * n_workers + 1)
+    {
+        // enough batches to keep every worker busy while the finished ones are written
+        for (auto &batch : batches)
+        {
+            batch.reads.resize(batch_size);
+            for (auto &b : batch.reads)
+            {
+                b = bam_init1();
+            }
+            free_batches.push_back(&batch);
+        }
+        for (int w = 0; w < n_workers; w++)
+        {
+            threads.push_back(std::thread([this, w]()
+            {
+                BamBatch *batch;
+                while ((batch = take()) != NULL)
+                {
+                    std::exception_ptr err;
+                    try
+                    {
+                        this->work(*batch, w);
+                    }
+                    catch (...)
+                    {
+                        err = std::current_exception();
+                    }
+                    std::lock_guard<std::mutex> lock(mtx);
+                    if (err && !error)
+                    {
+                        error = err;
+                    }
+                    done[batch->seq] = batch;
+                    done_cv.notify_one();
+                }
+            }));
+        }
     }
 
-    int mt_idx = -1;
-    for (int i = 0; i < header->n_targets; ++i)
+    ~BamPipeline()
     {
-        chr_aligned_stat[header->target_name[i]] = 0;
-        if (strcmp(header->target_name[i], mt_tag.c_str()) == 0)
         {
-            mt_idx = i;
+            std::lock_guard<std::mutex> lock(mtx);
+            closed = true;
+        }
+        todo_cv.notify_all();
+        for (auto &t : threads)
+        {
+            t.join();
+        }
+        for (auto &batch : batches)
+        {
+            for (auto &b : batch.reads)
+            {
+                bam_destroy1(b);
+            }
         }
     }
 
-    if (mt_idx == -1)
+    // read `fp` to the end, `write(batch)` gets the processed batches in read order
+    // on the calling thread
+    void run(BGZF *fp, const std::function<void(BamBatch&)> &write)
     {
-        Rcpp::Rcout << "Warning: mitochondrial chromosome not found using chromosome name `"<< mt_tag << "`.\n";
+        bool eof = false;
+        while (!eof)
+        {
+            checkUserInterrupt();
+            BamBatch *batch = free_batch();
+            if (!batch)
+            {
+                // every batch is in flight, write out the oldest and reuse it
+                batch = next_done(true);
+                write(*batch);
+            }
+            batch->n_reads = 0;
+            batch->lines.clear();
+            batch->text.clear();
+            batch->cells.clear();
+            while (batch->n_reads < batch_size && bam_read1(fp, batch->reads[batch->n_reads]) >= 0)
+            {
+                batch->n_reads++;
+            }
+            eof = batch->n_reads < batch_size;
+
+            if (threads.empty())
+            {
+                work(*batch, 0);
+                write(*batch);
+                recycle(batch);
+                continue;
+            }
+            submit(batch);
+            while ((batch = next_done(false)) != NULL)
+            {
+                write(*batch);
+                recycle(batch);
+            }
+        }
+        BamBatch *batch;
+        while ((batch = next_done(true)) != NULL)
+        {
+            write(*batch);
+            recycle(batch);
+        }
     }
 
-    string output_dir = join_path(out_dir, "count");
-    unordered_map<string, string> out_fn_path = bar.get_count_file_path(output_dir);
-    unordered_map<string, std::vector<string>> out_reads;
-    const char * c_ptr = c_tag.c_str();
-    const char * m_ptr = m_tag.c_str();
-    const char * g_ptr = g_tag.c_str();
-    const char * a_ptr = a_tag.c_str();
+private:
+    size_t batch_size;
+    std::function<void(BamBatch&, int)> work;
+    std::vector<BamBatch> batches;
+    std::vector<BamBatch*> free_batches;
+    std::vector<std::thread> threads;
+    size_t n_submitted = 0;
+    size_t n_taken = 0;
+
+    std::mutex mtx;
+    std::condition_variable todo_cv;
+    std::condition_variable done_cv;
+    std::deque<BamBatch*> todo;
+    std::map<size_t, BamBatch*> done;
+    bool closed = false;
+    std::exception_ptr error;
+
+    // a batch that is not in flight, NULL if there is none
+    BamBatch *free_batch()
+    {
+        if (free_batches.empty())
+        {
+            return NULL;
+        }
+        BamBatch *batch = free_batches.back();
+        free_batches.pop_back();
+        return batch;
+    }
+
+    void recycle(BamBatch *batch)
+    {
+        free_batches.push_back(batch);
+    }
+
+    void submit(BamBatch *batch)
+    {
+        batch->seq = n_submitted++;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            todo.push_back(batch);
+        }
+        todo_cv.notify_one();
+    }
+
+    // the next batch in submission order, NULL if none is in flight or if it is
+    // not processed yet and `wait` is false. an error of a worker is rethrown here
+    BamBatch *next_done(bool wait)
+    {
+        if (n_taken == n_submitted)
+        {
+            return NULL;
+        }
+        std::unique_lock<std::mutex> lock(mtx);
+        if (wait)
+        {
+            done_cv.wait(lock, [this]() { return done.count(n_taken) > 0; });
+        }
+        if (error)
+        {
+            std::rethrow_exception(error);
+        }
+        auto it = done.find(n_taken);
+        if (it == done.end())
+        {
+            return NULL;
+        }
+        BamBatch *batch = it->second;
+        done.erase(it);
+        n_taken++;
+        return batch;
+    }
 
-    string bc_seq;
-    string match_res;
-    int map_status;
+    BamBatch *take()
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        todo_cv.wait(lock, [this]() { return closed || !todo.empty(); });
+        if (closed)
+        {
+            return NULL;
+        }
+        BamBatch *batch = todo.front();
+        todo.pop_front();
+        return batch;
+    }
+};
+}
 
-    size_t _interrupt_ind = 0;
+int Bamdemultiplex::clean_bam_barcode(string bam_path, string out_bam, int max_mismatch, int nthreads, string out_format, bool cell_index)
+{
+    bool cell_sorted = out_format == "cell_sorted";
+    bool per_cell = out_format == "per_cell";
+    if (!cell_sorted && !per_cell && out_format != "bam")
+    {
+        stop("unknown output format: " + out_format + ", should be bam, cell_sorted or per_cell\n");
+    }
+    check_file_exists(bam_path); // htslib does not check if file exist so we do it manually
+    BGZF *fp = bgzf_open(bam_path.c_str(), "r");
+    bam_hdr_t *header = bam_hdr_read(fp);
 
-    while (bam_read1(fp, b) >= 0)
+    // this thread reads and writes the records, the other threads are split between
+    // the workers correcting the barcodes and the input and output (de)compression
+    int n_workers = std::max((nthreads - 1) / 2, 0);
+    HtsPool pool(nthreads - 1 - n_workers);
+    const int queue_size = 64;
+    pool.attach(fp, queue_size);
+
+    samFile *of = NULL; // output file
+    string of_fn = out_bam;
+    if (!per_cell)
     {
-        if (++_interrupt_ind % 1024 == 0) checkUserInterrupt();
-        //match barcode
-        bc_seq = (char*)(bam_aux_get(b, c_ptr) + 1); // +1 to skip `Z`
-        match_res = bar.get_closest_match(bc_seq, max_mismatch);
+        of = sam_open(out_bam.c_str(), "wb");
+        if (!of)
+        {
+            stop("cannot open output bam file: " + out_bam + "\n");
+        }
+        pool.attach(of);
+        if (sam_hdr_write(of, header) < 0)
+        {
+            stop("fail to write the bam header: " + out_bam + "\n");
+        }
+    }
 
-        bool is_unmapped = (b->core.flag & BAM_FUNMAP) > 0;
-        if (is_unmapped)
+    find_mt_idx(header); // warns if the mitochondrial chromosome is missing
+
+    const char * c_ptr = c_tag.c_str();
+    BarcodeCache &cache = barcode_cache(max_mismatch);
+    // grouped outputs are written once every read is corrected
+    std::unique_ptr<CellBamSorter> sorter;
+    if (cell_sorted || per_cell)
+    {
+        sorter.reset(new CellBamSorter(per_cell ? join_path(out_bam, "cell_reads.tmp") : out_bam + ".tmp", bar.n_cells()));
+    }
+
+    // the workers correct the barcodes and update the tags in place with their own
+    // tag builder and counts
+    std::vector<AuxTagBuilder> worker_tags(n_workers + 1);
+    // per worker: unaligned, without barcode tag, barcode not matched
+    std::vector<std::array<unsigned long long, 3>> rejected(n_workers + 1, {{0, 0, 0}});
+    unsigned long long n_written = 0;
+
+    auto correct = [&](BamBatch &batch, int worker)
+    {
+        AuxTagBuilder &tags = worker_tags[worker];
+        batch.cells.assign(batch.n_reads, -1);
+        for (size_t k = 0; k < batch.n_reads; k++)
         {
-            if (match_res.empty())
+            bam1_t *b = batch.reads[k];
+            // only aligned reads with a matched barcode are kept
+            if ((b->core.flag & BAM_FUNMAP) > 0)
             {
-                overall_count_stat["barcode_unmatch_unaligned"]++;
+                rejected[worker][0]++;
+                continue;
             }
-            else
+            const BarcodeCache::Match *match = find_barcode(cache, b, c_ptr);
+            if (!match)
             {
-                overall_count_stat["barcode_match"]++;
-                cell_unaligned[bar.barcode_dict[match_res]]++;
+                rejected[worker][bam_aux_get(b, c_ptr) ? 2 : 1]++;
+                continue;
             }
-
+            tags.update_str(c_ptr, match->seq, match->len);
+            if (tags.write(b) < 0)
+            {
+                // rethrown on the main thread by the pipeline
+                throw std::runtime_error(string("fail to add the bam tags: ") + bam_get_qname(b) + "\n");
+            }
+            batch.cells[k] = match->cell;
         }
-        else
+    };
+
+    auto write_reads = [&](BamBatch &batch)
+    {
+        for (size_t k = 0; k < batch.n_reads; k++)
         {
-            map_status = bam_aux2i(bam_aux_get(b, a_ptr));
-            chr_aligned_stat[header->target_name[b->core.tid]]++;
-            if (bam_aux_get(b, g_ptr)) // found a gene; read mapped to transcriptome
+            if (batch.cells[k] < 0)
+            {
+                continue;
+            }
+            n_written++;
+            if (sorter)
+            {
+                sorter->add(batch.cells[k], batch.reads[k]);
+            }
+            else if (sam_write1(of, header, batch.reads[k]) < 0)
             {
+                stop("fail to write the bam file: " + out_bam + "\n");
+            }
+        }
+    };
+
+    BamPipeline pipeline(n_workers, 1024, correct);
+    pipeline.run(fp, write_reads);
+
+    unsigned long long n_rejected[3] = {0, 0, 0};
+    for (const auto &r : rejected)
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            n_rejected[i] += r[i];
+        }
+    }
+    Rcout << "reads written: " << n_written << "\n";
+    Rcout << "reads dropped: " << n_rejected[0] << " unaligned, " << n_rejected[1] << " without barcode tag, "
+          << n_rejected[2] << " with unmatched barcode" << "\n";
+    cache.report();
+    pool.close(fp);
 
-                if (match_res.empty())
+    if (cell_sorted)
+    {
+        sorter->for_each([&](int, const bam1_t *rec)
+        {
+            if (sam_write1(of, header, rec) < 0)
+            {
+                stop("fail to write the bam file: " + out_bam + "\n");
+            }
+        }, pool.size() > 0);
+    }
+    else if (per_cell)
+    {
+        // one cell file is open at a time, cells without reads get no file
+        int open_cell = -1;
+        sorter->for_each([&](int cell, const bam1_t *rec)
+        {
+            if (cell != open_cell)
+            {
+                if (of && pool.close(of) < 0)
                 {
-                    overall_count_stat["barcode_unmatch_mapped_to_exon"]++;
+                    stop("fail to write the bam file: " + of_fn + "\n");
                 }
-                else
+                open_cell = cell;
+                of_fn = join_path(out_bam, bar.cell_id(cell) + ".bam");
+                of = sam_open(of_fn.c_str(), "wb");
+                if (!of)
                 {
-                    overall_count_stat["barcode_match"]++;
-                    if (std::strncmp (header->target_name[b->core.tid],"ERCC",4) == 0)
-                    {
-                        cell_ERCC[bar.barcode_dict[match_res]]++;
-                    }
-                    else
-                    {
-                        cell_mapped_exon[bar.barcode_dict[match_res]]++;
-                    }
-                    if (b->core.tid == mt_idx)
-                    {
-                        cell_MT[bar.barcode_dict[match_res]]++;
-                    }
-                    if (a_tag.empty())
-                    {
-                        if(has_UMI)
-                        {
-                            out_reads[bar.barcode_dict[match_res]].push_back(string(bam_aux2Z(bam_aux_get(b, g_ptr)))+","+
-                            string(bam_aux2Z(bam_aux_get(b, m_ptr)))+","+
-                            std::to_string(b->core.pos));
-                        }
-                        else
-                        {
-                            out_reads[bar.barcode_dict[match_res]].push_back(string(bam_aux2Z(bam_aux_get(b, g_ptr)))+","+
-                            string(bam_get_qname(b))+","+
-                            std::to_string(b->core.pos));
-                        }
-                        
-                    }
-                    else
-                    {
-                        if(has_UMI)
-                        {
-                            out_reads[bar.barcode_dict[match_res]].push_back(string(bam_aux2Z(bam_aux_get(b, g_ptr)))+","+
-                            string(bam_aux2Z(bam_aux_get(b, m_ptr)))+","+
-                            std::to_string(-map_status));
-                        }
-                        else
-                        {
-                            out_reads[bar.barcode_dict[match_res]].push_back(string(bam_aux2Z(bam_aux_get(b, g_ptr)))+","+
-                            string(bam_get_qname(b))+","+
-                            std::to_string(-map_status));
-                        }
-                    }
-
+                    stop("cannot open output bam file: " + of_fn + "\n");
+                }
+                pool.attach(of);
+                if (sam_hdr_write(of, header) < 0)
+                {
+                    stop("fail to write the bam header: " + of_fn + "\n");
                 }
             }
-            else
+            if (sam_write1(of, header, rec) < 0)
             {
-                // return:
-                //  <=0 - unique map to exon, number indicate the distance to transcript end pos
-                //  1 - ambiguous map to multiple exon
-                //  2 - map to intron
-                //  3 - unmapped
-                //  4 - unaligned
-                if (match_res.empty())
-                {
-                    if (a_tag.empty())
-                    {
-                        overall_count_stat["barcode_unmatch_aligned"]++;
-                    }
-                    else
-                    {
-                        if (map_status == 1)
-                        {
-                            overall_count_stat["barcode_unmatch_ambiguous_mapping"]++;
-                        }
-                        else if (map_status == 2)
-                        {
-                            overall_count_stat["barcode_unmatch_mapped_to_intron"]++;
-                        }
-                        else
-                        {
-                            overall_count_stat["barcode_unmatch_aligned"]++;
-                        }
-                    }
+                stop("fail to write the bam file: " + of_fn + "\n");
+            }
+        }, pool.size() > 0);
+    }
 
-                }
-                else
+    bam_hdr_destroy(header);
+    if (of && pool.close(of) < 0)
+    {
+        stop("fail to write the bam file: " + of_fn + "\n");
+    }
+
+    if (cell_index && !per_cell)
+    {
+        // htslib does not expose the final virtual offsets while the pool compresses
+        // the output, so the index is built by reading the written file back
+        index_cell_bam(out_bam, out_bam + ".cbi", bar, c_tag, pool);
+    }
+    return 0;
+}
+
+int Bamdemultiplex::barcode_demultiplex(string bam_path, int max_mismatch, bool has_UMI, int nthreads)
+{
+    check_file_exists(bam_path); // htslib does not check if file exist so we do it manually
+    BGZF *fp = bgzf_open(bam_path.c_str(), "r");
+    bam_hdr_t *header = bam_hdr_read(fp);
+
+    // Early benchmarking shows BAM reading doesn't saturate even 2 cores
+    // so capped reading threads to 2. the threads besides the calling one are
+    // split between the decompression and the workers classifying the reads
+    int pool_threads = std::min((nthreads - 1) / 2, 2);
+    HtsPool pool(pool_threads);
+    const int queue_size = 64;
+    pool.attach(fp, queue_size);
+
+    int mt_idx = find_mt_idx(header);
+
+    // the count files are written while reading, the reads are not kept in memory
+    CellWriter writer(bar);
+    string reads_fn = join_path(join_path(out_dir, "count"), "cell_reads.bin");
+    std::unique_ptr<CellReadWriter> reads_file;
+    int out_reads = -1;
+    if (binary_counts)
+    {
+        if (!has_UMI)
+        {
+            stop("binary count files need UMIs\n");
+        }
+        reads_file.reset(new CellReadWriter(reads_fn, bar.cell_ids()));
+    }
+    else
+    {
+        std::remove(reads_fn.c_str()); // it would take precedence over the csv files
+        out_reads = writer.add_output(join_path(out_dir, "count"), "gene_id,UMI,position");
+    }
+    int velocity_reads = v_tag.empty() ? -1 : writer.add_output(join_path(out_dir, "count_velocity"), "gene_id,UMI,position,status");
+    std::vector<int> feature_reads;
+    for (const auto &feature : feature_tags)
+    {
+        feature_reads.push_back(writer.add_output(join_path(out_dir, "count_" + feature.first), "gene_id,UMI,position"));
+    }
+    const char * c_ptr = c_tag.c_str();
+    const char * m_ptr = m_tag.c_str();
+    const char * g_ptr = g_tag.c_str();
+    const char * a_ptr = a_tag.c_str();
+    const char * v_ptr = v_tag.c_str();
+
+    BarcodeCache &cache = barcode_cache(max_mismatch);
+    // the calling thread reads the bam file and writes the count files, the workers
+    // correct the barcodes and classify the reads with their own statistics
+    int n_workers = std::max(nthreads - 1 - pool_threads, 0);
+    std::vector<DemuxStats> worker_stats(n_workers + 1, new_stats(header));
+
+    auto classify = [&](BamBatch &batch, int worker)
+    {
+        DemuxStats &read_stats = worker_stats[worker];
+        for (size_t k = 0; k < batch.n_reads; k++)
+        {
+            bam1_t *b = batch.reads[k];
+            //match barcode
+            const BarcodeCache::Match *match = find_barcode(cache, b, c_ptr);
+
+            bool is_unmapped = (b->core.flag & BAM_FUNMAP) > 0;
+            bool has_gene = false;
+            int map_status = 0;
+            if (!is_unmapped)
+            {
+                map_status = a_tag.empty() ? 0 : bam_aux2i(bam_aux_get(b, a_ptr));
+                // found a gene; read mapped to transcriptome
+                has_gene = bam_aux_get(b, g_ptr) != NULL && map_status <= 0;
+            }
+
+            if (tally_read(read_stats, header, b, match, has_gene, !a_tag.empty(), map_status, mt_idx))
+            {
+                // position is the distance to transcript end when the mapping status is available
+                int pos = a_tag.empty() ? b->core.pos : -map_status;
+                batch.add_line(out_reads, match->cell, bam_aux2Z(bam_aux_get(b, g_ptr)),
+                    has_UMI ? bam_aux2Z(bam_aux_get(b, m_ptr)) : bam_get_qname(b), pos);
+            }
+
+            // the velocity tag holds the status and the gene as "U:gene_id", intronic
+            // reads have no gene tag
+            uint8_t *v_data;
+            const char *v_str;
+            if (!v_tag.empty() && match && !is_unmapped && (v_data = bam_aux_get(b, v_ptr)) != NULL
+                && (v_str = bam_aux2Z(v_data)) != NULL && v_str[0] != '\0' && v_str[1] == ':')
+            {
+                batch.add_line(velocity_reads, match->cell, v_str + 2,
+                    has_UMI ? bam_aux2Z(bam_aux_get(b, m_ptr)) : bam_get_qname(b), b->core.pos, v_str[0]);
+            }
+
+            if (match && !is_unmapped)
+            {
+                for (size_t i = 0; i < feature_tags.size(); i++)
                 {
-                    overall_count_stat["barcode_match"]++;
-                    if (a_tag.empty())
+                    uint8_t *f_data = bam_aux_get(b, feature_tags[i].second.c_str());
+                    if (f_data)
                     {
-                        cell_align_unmapped[bar.barcode_dict[match_res]]++;
-                    }
-                    else
-                    {
-                        if (map_status == 1)
-                        {
-                            cell_mapped_ambiguous[bar.barcode_dict[match_res]]++;
-                        }
-                        else if (map_status == 2)
-                        {
-                            cell_mapped_intron[bar.barcode_dict[match_res]]++;
-                        }
-                        else
-                        {
-                            cell_align_unmapped[bar.barcode_dict[match_res]]++;
-                        }
+                        batch.add_line(feature_reads[i], match->cell, bam_aux2Z(f_data),
+                            has_UMI ? bam_aux2Z(bam_aux_get(b, m_ptr)) : bam_get_qname(b), b->core.pos);
                     }
                 }
             }
         }
-    }
+    };
 
-    for (auto const& fn: out_fn_path)
+    auto write_lines = [&](BamBatch &batch)
     {
-        ofstream ofile(fn.second);
-        ofile << "gene_id,UMI,position\n";
-        for (auto const& rd: out_reads[fn.first])
+        for (const DemuxLine &line : batch.lines)
         {
-            ofile << rd << "\n";
+            const char *first = batch.text.c_str() + line.first;
+            const char *second = batch.text.c_str() + line.second;
+            if (line.output == -1)
+            {
+                reads_file->add(line.cell, first, second, line.pos);
+            }
+            else
+            {
+                writer.add(line.output, line.cell, first, second, line.pos, line.status);
+            }
         }
-        ofile.close();
-    }
+    };
 
+    BamPipeline pipeline(n_workers, 1024, classify);
+    pipeline.run(fp, write_lines);
 
+    for (const DemuxStats &s : worker_stats)
+    {
+        add_stats(header, s);
+    }
+    cache.report();
+    writer.flush();
+    if (reads_file)
+    {
+        reads_file->close();
+    }
 
-    bgzf_close(fp);
+    pool.close(fp);
+    bam_hdr_destroy(header);
     return 0;
 }
@@ -1,29 +1,66 @@
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <cstdio>
 #include <cstring>
 #include <string>
+#include <vector>
 #include <unordered_map>
+#include <map>
+#include <deque>
+#include <functional>
+#include <exception>
+#include <mutex>
+#include <condition_variable>
 #include <thread>
 #include <algorithm>
+#include <array>
 #include <Rcpp.h>
 #include "config_hts.h"
+#include "bamtags.h"
+#include "htspool.h"
 #include "utils.h"
 #include "cellbarcode.h"
+#include "cellwriter.h"
+#include "cellreads.h"
+#include "cellbam.h"
+#include "cellindex.h"
 #include "htslib/thread_pool.h"
 
 #ifndef PARSEBAM_H
 #define PARSEBAM_H
 
-// overall_count_stat: count statistics for all cells
-// chr_aligned_stat: per chromosome count
-// per cell statistics:
-// cell_mapped: mapped to exon
-// cell_mapped_intron: mapped to intron
-// cell_mapped_ambiguous: ambiguous map to multiple exon
-// cell_align_unmapped: aligned to genome but not mapped to any feature
-// cell_unaligned: not aligned
-//
+// read counts of `Bamdemultiplex`, kept in arrays indexed by status, by cell (the index
+// `Barcode::cell_id` takes) and by chromosome (its index in the bam header) so counting a
+// read needs no hash lookup. each thread counts into its own set, the sets are merged at the end
+struct DemuxStats
+{
+    // overall statistics, in the order of `OVERALL_STAT_NAMES`
+    enum Overall { BARCODE_MATCH, UNMATCH_UNALIGNED, UNMATCH_ALIGNED, UNMATCH_EXON, UNMATCH_INTRON, UNMATCH_AMBIGUOUS, N_OVERALL };
+    // per cell statistics, in the column order of the cell statistics file
+    enum CellStatus { UNALIGNED, ALIGN_UNMAPPED, MAPPED_EXON, MAPPED_INTRON, MAPPED_AMBIGUOUS, MAPPED_ERCC, MAPPED_MT, N_CELL_STATUS };
+
+    std::vector<unsigned long long> overall;
+    std::vector<unsigned long long> cells; // [cell * N_CELL_STATUS + status]
+    std::vector<unsigned long long> chr;
+
+    DemuxStats(size_t n_cells = 0, size_t n_chr = 0) :
+        overall(N_OVERALL), cells(n_cells * N_CELL_STATUS), chr(n_chr) {}
+
+    unsigned long long &cell(int cell_idx, CellStatus status) { return cells[cell_idx * N_CELL_STATUS + status]; }
+    // add the overall and per cell counts of `other`, and its chromosome counts if it has any
+    void add(const DemuxStats &other);
+};
+
+const char *const OVERALL_STAT_NAMES[DemuxStats::N_OVERALL] = {
+    "barcode_match",
+    "barcode_unmatch_unaligned",
+    "barcode_unmatch_aligned",
+    "barcode_unmatch_mapped_to_exon",
+    "barcode_unmatch_mapped_to_intron",
+    "barcode_unmatch_ambiguous_mapping"
+};
+
 class Bamdemultiplex
 {
 public:
@@ -34,16 +71,22 @@ public:
     std::string a_tag;
     std::string out_dir;
     std::string mt_tag;
+    // RNA velocity tag written by `Mapping::parse_align` as "status:gene_id", when set the
+    // reads of matched cells with a status also go to out_dir/count_velocity/[cell_id].csv
+    std::string v_tag;
+    // (feature set name, tag) pairs written by `Mapping::add_feature_set`, the tagged reads
+    // of matched cells go to out_dir/count_[name]/[cell_id].csv
+    std::vector<std::pair<std::string, std::string>> feature_tags;
+    // write the gene reads of all cells to out_dir/count/cell_reads.bin (see `CellReadWriter`)
+    // rather than to one csv file per cell. needs UMIs
+    bool binary_counts = false;
 
-    std::unordered_map<std::string, int> overall_count_stat;
-    std::unordered_map<std::string, int> chr_aligned_stat;
-    std::unordered_map<std::string, int> cell_mapped_exon;
-    std::unordered_map<std::string, int> cell_mapped_intron;
-    std::unordered_map<std::string, int> cell_mapped_ambiguous;
-    std::unordered_map<std::string, int> cell_align_unmapped;
-    std::unordered_map<std::string, int> cell_unaligned;
-    std::unordered_map<std::string, int> cell_ERCC;
-    std::unordered_map<std::string, int> cell_MT;
+    // overall and per cell counts of every bam file processed so far
+    DemuxStats stats;
+    // per chromosome counts by name, bam files may order their chromosomes differently
+    std::unordered_map<std::string, unsigned long long> chr_aligned_stat;
+    // barcode corrections shared by the commands run on this object
+    std::shared_ptr<BarcodeCache> bc_cache;
 
     Bamdemultiplex(
         std::string odir,
@@ -55,7 +98,23 @@ public:
         std::string MT_tag
     );
     int barcode_demultiplex(std::string bam_path, int max_mismatch, bool has_UMI, int nthreads);
-    int clean_bam_barcode(std::string bam_path, std::string out_bam, int max_mismatch, int nthreads);
+    // add one read to `read_stats`, `match` is its corrected barcode (NULL if none).
+    // return true if the read has a matched barcode and is mapped to a gene
+    bool tally_read(DemuxStats &read_stats, const bam_hdr_t *header, const bam1_t *b, const BarcodeCache::Match *match, bool has_gene, bool has_map_status, int map_status, int mt_idx) const;
+    // add the chromosomes to the per chromosome statistics and return the index of the mitochondrial chromosome (-1 if absent)
+    int find_mt_idx(const bam_hdr_t *header);
+    // empty statistics for the reads of a bam file with `header`
+    DemuxStats new_stats(const bam_hdr_t *header) const;
+    // add the statistics of the reads of a bam file with `header` to the totals
+    void add_stats(const bam_hdr_t *header, const DemuxStats &read_stats);
+    // write the aligned reads with a matched barcode to `out_bam` with the corrected barcode.
+    // `out_format` is "bam" to keep the input order, "cell_sorted" to group the reads by cell
+    // in the cell order of `Barcode`, or "per_cell" to write [out_bam]/[cell_id].bam
+    // for every cell with reads. the reads of a cell keep their input order. with `cell_index` the
+    // bam output is indexed by cell in [out_bam].cbi (see `CellIndex`)
+    int clean_bam_barcode(std::string bam_path, std::string out_bam, int max_mismatch, int nthreads, std::string out_format = "bam", bool cell_index = false);
+    // the cache of `bar` corrections, reused while `max_mismatch` stays the same
+    BarcodeCache &barcode_cache(int max_mismatch);
     void write_statistics(
         std::string overall_stat_f,
         std::string chr_stat_f,
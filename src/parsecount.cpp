@@ -180,6 +180,155 @@ int UMI_correct3(map<umi_pos_pair, int>& UMI_count)
 }
 
 
+namespace {
+// a UMI packed as by `pack_umi`, the key of the UMI network
+struct PackedUMI
+{
+    uint64_t umi;
+    uint32_t umi_n;
+    uint32_t umi_len;
+
+    bool operator==(const PackedUMI &o) const
+    {
+        return umi == o.umi && umi_n == o.umi_n && umi_len == o.umi_len;
+    }
+};
+
+struct PackedUMIHash
+{
+    size_t operator()(const PackedUMI &u) const
+    {
+        return std::hash<uint64_t>()(u.umi ^ ((uint64_t)u.umi_n << 32 | u.umi_len) * 0x9E3779B97F4A7C15ULL);
+    }
+};
+
+// a distinct UMI sequence of a gene, at the position with the most reads
+struct UMINode
+{
+    const umi_pos_pair *umi_pos;
+    int count;
+    int pos_count;
+    PackedUMI key;
+};
+}
+
+int UMI_correct4(map<umi_pos_pair, int>& UMI_count)
+{
+    int corrected_UMI = 0;
+
+    // reads of the same sequence at different positions are one node
+    vector<UMINode> nodes;
+    for (auto const& UMI: UMI_count)
+    {
+        if (!nodes.empty() && nodes.back().umi_pos->first == UMI.first.first)
+        {
+            UMINode &node = nodes.back();
+            node.count += UMI.second;
+            if (UMI.second > node.pos_count)
+            {
+                node.umi_pos = &UMI.first;
+                node.pos_count = UMI.second;
+            }
+            corrected_UMI++;
+            continue;
+        }
+        UMINode node = {&UMI.first, UMI.second, UMI.second, {}};
+        nodes.push_back(node);
+    }
+
+    bool has_n = false;
+    unordered_map<PackedUMI, int, PackedUMIHash> node_idx;
+    node_idx.reserve(nodes.size());
+    for (size_t i = 0; i < nodes.size(); i++)
+    {
+        CellRead rd;
+        if (!pack_umi(nodes[i].umi_pos->first.c_str(), rd))
+        {
+            Rcpp::stop("UMI longer than " + std::to_string(MAX_PACKED_UMI) + " bases, use another UMI correction: " + nodes[i].umi_pos->first + "\n");
+        }
+        nodes[i].key = {rd.umi, rd.umi_n, rd.umi_len};
+        node_idx[nodes[i].key] = i;
+        has_n = has_n || rd.umi_n;
+    }
+
+    // directional network: UMI a absorbs its neighbour b at one mismatch if
+    // count(a) >= 2 * count(b) - 1. starting from the most frequent UMI not yet
+    // absorbed, each UMI takes every UMI reachable through such edges
+    vector<int> order(nodes.size());
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return nodes[a].count > nodes[b].count; });
+
+    vector<int> parent(nodes.size(), -1);
+    vector<int> queue;
+    map<umi_pos_pair, int> merged;
+    for (int root : order)
+    {
+        if (parent[root] >= 0)
+        {
+            continue;
+        }
+        parent[root] = root;
+        int count = 0;
+        queue.assign(1, root);
+        for (size_t q = 0; q < queue.size(); q++)
+        {
+            const UMINode &node = nodes[queue[q]];
+            count += node.count;
+            // the one mismatch variants of the UMI, N is only tried if the gene has one
+            for (uint32_t i = 0; i < node.key.umi_len; i++)
+            {
+                uint64_t base_mask = (uint64_t)3 << (2 * i);
+                uint32_t n_bit = 1u << i;
+                for (uint64_t code = 0; code < 5; code++)
+                {
+                    PackedUMI variant = node.key;
+                    variant.umi &= ~base_mask;
+                    if (code == 4)
+                    {
+                        if (!has_n || (node.key.umi_n & n_bit)) continue;
+                        variant.umi_n |= n_bit;
+                    }
+                    else
+                    {
+                        variant.umi |= code << (2 * i);
+                        variant.umi_n &= ~n_bit;
+                    }
+                    if (variant == node.key)
+                    {
+                        continue;
+                    }
+                    auto it = node_idx.find(variant);
+                    if (it == node_idx.end() || parent[it->second] >= 0 || node.count < 2 * nodes[it->second].count - 1)
+                    {
+                        continue;
+                    }
+                    parent[it->second] = root;
+                    queue.push_back(it->second);
+                    if (__DEBUG){Rcout << "merge: " << nodes[it->second].umi_pos->first << "::" << node.umi_pos->first << "\t" << nodes[it->second].count << "::" << node.count << "\n";}
+                }
+            }
+        }
+        corrected_UMI += queue.size() - 1;
+        merged[*nodes[root].umi_pos] = count;
+    }
+
+    UMI_count.swap(merged);
+    return corrected_UMI;
+}
+
+gene_umi_count count_gene_reads(const unordered_map<string, vector<umi_pos_pair>> &gene_read)
+{
+    gene_umi_count gene_umi;
+    for (auto const& a_gene: gene_read)
+    {
+        gene_umi[a_gene.first] = vector_counter(a_gene.second);
+    }
+    return gene_umi;
+}
+
 unordered_map<string, int> UMI_dedup(
     unordered_map<string, vector<umi_pos_pair>> gene_read,
     vector<int>& UMI_dup_count,
@@ -187,18 +336,30 @@ unordered_map<string, int> UMI_dedup(
     int UMI_correct,
     bool read_filter
 )
+{
+    return UMI_dedup(count_gene_reads(gene_read), UMI_dup_count, dedup_stat, UMI_correct, read_filter);
+}
+
+unordered_map<string, int> UMI_dedup(
+    gene_umi_count gene_umi,
+    vector<int>& UMI_dup_count,
+    struct UMI_dedup_stat& dedup_stat,
+    int UMI_correct,
+    bool read_filter
+)
 {
     unordered_map<string, int> gene_counter;
 
-    for(auto const& a_gene: gene_read)
+    for(auto& a_gene: gene_umi)
     {
-        if (read_filter && a_gene.second.size() == 1)
+        // a gene with a single read
+        if (read_filter && a_gene.second.size() == 1 && a_gene.second.begin()->second == 1)
         {
             dedup_stat.filtered_gene++;
             continue;
         }
 
-        map<umi_pos_pair, int> UMI_count = vector_counter(a_gene.second);
+        map<umi_pos_pair, int> &UMI_count = a_gene.second;
         if (UMI_correct == 1)
         {
             dedup_stat.corrected_UMI += UMI_correct1(UMI_count);
@@ -211,6 +372,10 @@ unordered_map<string, int> UMI_dedup(
         {
             dedup_stat.corrected_UMI += UMI_correct3(UMI_count);
         }
+        else if (UMI_correct == 4)
+        {
+            dedup_stat.corrected_UMI += UMI_correct4(UMI_count);
+        }
         else
         {
             Rcpp::stop("not implemented\n");
@@ -279,21 +444,36 @@ void write_stat(string cnt_fn, string stat_fn, vector<int> UMI_dup_count, unorde
     stat_file.close();
 }
 
-void get_counting_matrix(Barcode bar, string in_dir, int UMI_correct, bool read_filter)
+void get_counting_matrix(const Barcode &bar, string in_dir, int UMI_correct, bool read_filter)
 {
+    string reads_fn = join_path(join_path(in_dir, "count"), "cell_reads.bin");
+    if (ifstream(reads_fn).good())
+    {
+        CellReadReader reads_file(reads_fn);
+        write_counting_matrix(bar, in_dir, UMI_correct, read_filter,
+            [&](const string &cell_id) { return count_gene_reads(reads_file.read_cell(cell_id)); });
+        return;
+    }
+
     char sep = ',';
     unordered_map<string, string> cnt_files = bar.get_count_file_path(join_path(in_dir, "count"));
+    write_counting_matrix(bar, in_dir, UMI_correct, read_filter,
+        [&](const string &cell_id) { return count_gene_reads(read_count(cnt_files[cell_id], sep)); });
+}
+
+void write_counting_matrix(const Barcode &bar, string out_dir, int UMI_correct, bool read_filter, const cell_read_loader &load_cell)
+{
     unordered_map<string, vector<int>> gene_cnt_matrix; // store gene count matrix
     vector<string> all_gene_list; // store all gene ids
     vector<int> UMI_dup_count(MAX_UMI_DUP+1, 0); // store UMI duplication statistics
     unordered_map<string, UMI_dedup_stat> UMI_dedup_stat_dict;
-    int cell_number = bar.cellid_list.size();
+    const vector<string> cell_ids = bar.cell_ids();
+    int cell_number = cell_ids.size();
     int ind = 0;
-    for (auto const& ce : bar.cellid_list) // for each cell
+    for (auto const& ce : cell_ids) // for each cell
     {
         UMI_dedup_stat_dict[ce] = {}; // init zero
-        unordered_map<string, vector<umi_pos_pair>> gene_read = read_count(cnt_files[ce], sep);
-        unordered_map<string, int> gene_cnt =  UMI_dedup(gene_read, UMI_dup_count, UMI_dedup_stat_dict[ce], UMI_correct, read_filter);
+        unordered_map<string, int> gene_cnt =  UMI_dedup(load_cell(ce), UMI_dup_count, UMI_dedup_stat_dict[ce], UMI_correct, read_filter);
 
         for (auto const& ge : gene_cnt) // for each gene
         {
@@ -312,9 +492,108 @@ void get_counting_matrix(Barcode bar, string in_dir, int UMI_correct, bool read_
     }
 
     // write to file
-    write_mat(join_path(in_dir, "gene_count.csv"), gene_cnt_matrix, bar.cellid_list);
-    string stat_dir = join_path(in_dir, "stat");
+    write_mat(join_path(out_dir, "gene_count.csv"), gene_cnt_matrix, cell_ids);
+    string stat_dir = join_path(out_dir, "stat");
     write_stat(join_path(stat_dir, "UMI_duplication_count.csv"), join_path(stat_dir, "UMI_dedup_stat.csv"), UMI_dup_count, UMI_dedup_stat_dict);
 
 }
 
+void get_feature_matrix(const Barcode &bar, string in_dir, string name, int UMI_correct, bool read_filter)
+{
+    char sep = ',';
+    unordered_map<string, string> cnt_files = bar.get_count_file_path(join_path(in_dir, "count_" + name));
+    unordered_map<string, vector<int>> feature_cnt_matrix;
+    vector<int> UMI_dup_count(MAX_UMI_DUP+1, 0); // only reported for the gene counts
+    const vector<string> cell_ids = bar.cell_ids();
+    int cell_number = cell_ids.size();
+    int ind = 0;
+    for (auto const& ce : cell_ids) // for each cell
+    {
+        UMI_dedup_stat s = {};
+        unordered_map<string, int> feature_cnt = UMI_dedup(read_count(cnt_files[ce], sep), UMI_dup_count, s, UMI_correct, read_filter);
+        for (auto const& fe : feature_cnt) // for each feature
+        {
+            auto & vec = feature_cnt_matrix[fe.first];
+            vec.resize(cell_number, 0); // init with all zeros
+            vec[ind] = fe.second;
+        }
+        ind++;
+    }
+    write_mat(join_path(in_dir, name + "_count.csv"), feature_cnt_matrix, cell_ids);
+}
+
+
+void read_velocity_count(string fn, unordered_map<string, vector<umi_pos_pair>> layers[N_VELOCITY_LAYERS])
+{
+    ifstream infile(fn);
+    vector<std::pair<string, umi_pos_pair>> reads;
+    unordered_map<string, unordered_map<string, int>> molecule_layer; // gene -> UMI -> layer
+    string line;
+    getline(infile, line); // skip header
+
+    while(getline(infile, line))
+    {
+        size_t comma1_pos = line.find(',');
+        size_t comma2_pos = line.find(',', comma1_pos + 1);
+        size_t comma3_pos = line.find(',', comma2_pos + 1);
+        if (comma3_pos == string::npos || comma3_pos + 1 >= line.size())
+        {
+            continue;
+        }
+
+        string gene_id = line.substr(0, comma1_pos);
+        string UMI = line.substr(comma1_pos + 1, comma2_pos - comma1_pos - 1);
+        int pos = stoi(line.substr(comma2_pos + 1, comma3_pos - comma2_pos - 1));
+        int layer = std::find(VELOCITY_STATUS, VELOCITY_STATUS + N_VELOCITY_LAYERS, line[comma3_pos + 1]) - VELOCITY_STATUS;
+        if (layer == N_VELOCITY_LAYERS)
+        {
+            continue;
+        }
+
+        auto res = molecule_layer[gene_id].insert(make_pair(UMI, layer));
+        if (!res.second && res.first->second != layer)
+        {
+            res.first->second = 2; // reads of the molecule disagree
+        }
+        reads.push_back(make_pair(gene_id, make_pair(UMI, pos)));
+    }
+    infile.close();
+
+    for (auto const& rd : reads)
+    {
+        int layer = molecule_layer[rd.first][rd.second.first];
+        layers[layer][rd.first].push_back(rd.second);
+    }
+}
+
+void get_velocity_matrix(const Barcode &bar, string in_dir, int UMI_correct, bool read_filter)
+{
+    unordered_map<string, string> cnt_files = bar.get_count_file_path(join_path(in_dir, "count_velocity"));
+    unordered_map<string, vector<int>> gene_cnt_matrix[N_VELOCITY_LAYERS];
+    vector<int> UMI_dup_count(MAX_UMI_DUP+1, 0); // only reported for the gene counts
+    const vector<string> cell_ids = bar.cell_ids();
+    int cell_number = cell_ids.size();
+    int ind = 0;
+    for (auto const& ce : cell_ids) // for each cell
+    {
+        unordered_map<string, vector<umi_pos_pair>> layers[N_VELOCITY_LAYERS];
+        read_velocity_count(cnt_files[ce], layers);
+        for (int l = 0; l < N_VELOCITY_LAYERS; l++)
+        {
+            UMI_dedup_stat s = {};
+            unordered_map<string, int> gene_cnt = UMI_dedup(layers[l], UMI_dup_count, s, UMI_correct, read_filter);
+            for (auto const& ge : gene_cnt) // for each gene
+            {
+                auto & vec = gene_cnt_matrix[l][ge.first];
+                vec.resize(cell_number, 0); // init with all zeros
+                vec[ind] = ge.second;
+            }
+        }
+        ind++;
+    }
+
+    for (int l = 0; l < N_VELOCITY_LAYERS; l++)
+    {
+        write_mat(join_path(in_dir, string("velocity_") + VELOCITY_LAYER_NAMES[l] + ".csv"), gene_cnt_matrix[l], cell_ids);
+    }
+}
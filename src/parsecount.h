@@ -7,9 +7,11 @@
 #include <fstream>
 #include <map>
 #include <algorithm>
+#include <functional>
 #include <Rcpp.h>
 #include "utils.h"
 #include "cellbarcode.h"
+#include "cellreads.h"
 
 #ifndef PARSECOUNT_H
 #define PARSECOUNT_H
@@ -31,6 +33,15 @@ std::unordered_map<std::string, std::vector<umi_pos_pair>> read_count(std::strin
 int UMI_correct1(std::unordered_map<umi_pos_pair, int>& UMI_count); // sequence
 int UMI_correct2(std::unordered_map<umi_pos_pair, int>& UMI_count); // sequence + position
 int UMI_correct3(std::unordered_map<umi_pos_pair, int>& UMI_count); // sequence (2 edit distance)
+// sequence, directional adjacency as in UMI-tools: the one mismatch neighbours of each
+// UMI are looked up in a hash table of the packed UMIs, so a gene takes O(n * UMI length)
+int UMI_correct4(std::map<umi_pos_pair, int>& UMI_count);
+
+// gene id -> (UMI, position) -> number of reads
+typedef std::unordered_map<std::string, std::map<umi_pos_pair, int>> gene_umi_count;
+
+// tally the (UMI, position) pairs of each gene
+gene_umi_count count_gene_reads(const std::unordered_map<std::string, std::vector<umi_pos_pair>> &gene_read);
 
 std::unordered_map<std::string, int> UMI_dedup(
     std::unordered_map<std::string, std::vector<umi_pos_pair>> gene_read,
@@ -40,9 +51,46 @@ std::unordered_map<std::string, int> UMI_dedup(
     bool read_filter
 );
 
+// same as above on reads already tallied per (UMI, position)
+std::unordered_map<std::string, int> UMI_dedup(
+    gene_umi_count gene_umi,
+    std::vector<int>& UMI_dup_count,
+    UMI_dedup_stat& s,
+    int UMI_correct,
+    bool read_filter
+);
+
 void write_mat(std::string fn, std::unordered_map<std::string, std::vector<int>> gene_cnt_matrix, std::vector<std::string> cellid_list);
 
 void write_stat(std::string cnt_fn, std::string stat_fn, std::vector<int> UMI_dup_count, std::unordered_map<std::string, UMI_dedup_stat> UMI_dedup_stat_dict);
 
-void get_counting_matrix(Barcode bar, std::string in_dir, int UMI_correct, bool read_filter);
+// returns the (gene -> UMI, position) read counts of a cell given its cell id
+typedef std::function<gene_umi_count(const std::string&)> cell_read_loader;
+
+// read the cell reads of `in_dir`/count/cell_reads.bin if present, the per cell count files
+// under `in_dir`/count otherwise, and write the gene count matrix and UMI statistics
+void get_counting_matrix(const Barcode &bar, std::string in_dir, int UMI_correct, bool read_filter);
+
+// UMI deduplicate the reads of every cell in `bar`, in cell order, and write
+// `out_dir`/gene_count.csv plus the UMI statistics under `out_dir`/stat.
+// reads are obtained from `load_cell` so they do not have to come from files
+void write_counting_matrix(const Barcode &bar, std::string out_dir, int UMI_correct, bool read_filter, const cell_read_loader &load_cell);
+
+// UMI deduplicate the reads of a named feature set, read from the per cell count files
+// under `in_dir`/count_[name], and write the feature count matrix to `in_dir`/[name]_count.csv
+void get_feature_matrix(const Barcode &bar, std::string in_dir, std::string name, int UMI_correct, bool read_filter);
+
+// RNA velocity layers of the per cell count files under count_velocity
+const int N_VELOCITY_LAYERS = 3;
+const char VELOCITY_STATUS[N_VELOCITY_LAYERS] = {'S', 'U', 'A'};
+const char *const VELOCITY_LAYER_NAMES[N_VELOCITY_LAYERS] = {"spliced", "unspliced", "ambiguous"};
+
+// read a `gene_id,UMI,position,status` velocity count file into one (gene -> UMI, position)
+// map per layer. a molecule (gene, UMI) takes the status shared by all its reads,
+// or is ambiguous if its reads disagree
+void read_velocity_count(std::string fn, std::unordered_map<std::string, std::vector<umi_pos_pair>> layers[N_VELOCITY_LAYERS]);
+
+// UMI deduplicate the velocity reads of every cell in `bar` and write one gene count
+// matrix per layer to `in_dir`/velocity_[spliced|unspliced|ambiguous].csv
+void get_velocity_matrix(const Barcode &bar, std::string in_dir, int UMI_correct, bool read_filter);
 #endif
@@ -3,7 +3,9 @@
 #include "parsecount.h"
 #include "parsebam.h"
 #include "cellbarcode.h"
+#include "cellindex.h"
 #include "transcriptmapping.h"
+#include "singlepass.h"
 #include "detect_barcode.h"
 #include "Timer.h"
 #include <iostream>
@@ -82,6 +84,23 @@ void rcpp_sc_trim_barcode_paired(Rcpp::CharacterVector outfq,
   Rcpp::Rcout << "time elapsed: " << timer.time_elapsed() << "\n\n";
 }
 
+// `anno` is either a character vector of annotation files, read by the chunked
+// parser with `nthreads` threads, or a SAF data frame prepared in R
+void add_annotation_arg(Mapping &a, Rcpp::RObject anno, bool fix_chr, int nthreads)
+{
+  if (Rf_isString(anno))
+  {
+    for (const auto &fn : Rcpp::as<std::vector<std::string>>(anno))
+    {
+      a.add_annotation(fn, fix_chr, nthreads);
+    }
+  }
+  else
+  {
+    a.add_annotation(Rcpp::as<Rcpp::DataFrame>(anno), fix_chr);
+  }
+}
+
 // [[Rcpp::plugins(cpp11)]]
 // [[Rcpp::export]]
 
@@ -117,13 +136,14 @@ void rcpp_sc_exon_mapping(Rcpp::CharacterVector inbam,
   int c_nthreads = Rcpp::as<int>(nthreads);
   
   Mapping a = Mapping();
+  a.restrict_to_bam_contigs(c_inbam_vec);
   Rcpp::Rcout << "adding annotation files..." << "\n";
   
   Timer timer;
   for (const auto& n : token)
   {
     timer.start();
-    a.add_annotation(n, c_fix_chr);
+    a.add_annotation(n, c_fix_chr, c_nthreads);
     Rcpp::Rcout << "time elapsed: " << timer.time_elapsed() << "\n\n";
   }
   
@@ -140,16 +160,23 @@ void rcpp_sc_exon_mapping(Rcpp::CharacterVector inbam,
 void rcpp_sc_exon_mapping_df_anno(
     Rcpp::CharacterVector inbam,
     Rcpp::CharacterVector outbam,
-    Rcpp::DataFrame anno,
+    Rcpp::RObject anno,
     Rcpp::CharacterVector am,
     Rcpp::CharacterVector ge,
     Rcpp::CharacterVector bc,
     Rcpp::CharacterVector mb,
+    Rcpp::CharacterVector vs,
     Rcpp::NumericVector bc_len,
     Rcpp::CharacterVector bc_vector,
     Rcpp::NumericVector UMI_len,
     Rcpp::NumericVector stnd,
     Rcpp::NumericVector fix_chr,
+    Rcpp::CharacterVector lookup_chr,
+    Rcpp::List feature_sets,
+    Rcpp::LogicalVector slim_bam,
+    Rcpp::LogicalVector drop_names,
+    Rcpp::NumericVector compress_level,
+    Rcpp::LogicalVector ordered_merge,
     Rcpp::NumericVector nthreads)
 {
   //std::string c_inbam = Rcpp::as<std::string>(inbam);
@@ -166,16 +193,34 @@ void rcpp_sc_exon_mapping_df_anno(
   bool c_fix_chr = Rcpp::as<int>(fix_chr)==1?true:false;
   std::vector<std::string> c_inbam_vec = Rcpp::as<std::vector<std::string>>(inbam);
   std::vector<std::string> c_bc_vec = Rcpp::as<std::vector<std::string>>(bc_vector);
+  std::vector<std::string> c_lookup_chr = Rcpp::as<std::vector<std::string>>(lookup_chr);
   int c_nthreads = Rcpp::as<int>(nthreads);
   
   Mapping a = Mapping();
+  a.velocity_tag = Rcpp::as<std::string>(vs);
+  a.slim_bam = Rcpp::as<bool>(slim_bam);
+  a.slim_qname = Rcpp::as<bool>(drop_names);
+  a.compress_level = Rcpp::as<int>(compress_level);
+  a.ordered_merge = Rcpp::as<bool>(ordered_merge);
+  a.restrict_to_bam_contigs(c_inbam_vec);
   Rcpp::Rcout << "adding annotation files..." << "\n";
   
   Timer timer;
   timer.start();
-  a.add_annotation(anno, c_fix_chr);
+  add_annotation_arg(a, anno, c_fix_chr, c_nthreads);
+  // each feature set is a list(name, tag, anno) with the annotation in SAF format
+  for (int i = 0; i < feature_sets.size(); i++)
+  {
+    Rcpp::List fs = feature_sets[i];
+    a.add_feature_set(Rcpp::as<std::string>(fs["name"]), Rcpp::as<std::string>(fs["tag"]), Rcpp::as<Rcpp::DataFrame>(fs["anno"]), c_fix_chr);
+  }
   Rcpp::Rcout << "time elapsed: " << timer.time_elapsed() << "\n\n";
   
+  if (c_lookup_chr.size() > 0)
+  {
+    a.build_feature_lookup(c_lookup_chr);
+  }
+  
   Rcpp::Rcout << "annotating exon features..." << "\n";
   
   a.parse_align_warpper(c_inbam_vec, c_bc_vec, c_outbam, c_stnd, c_am, c_ge, c_bc, c_mb, c_bc_len, c_UMI_len, c_nthreads);
@@ -192,8 +237,11 @@ void rcpp_sc_demultiplex(Rcpp::CharacterVector inbam,
                          Rcpp::CharacterVector ge,
                          Rcpp::CharacterVector bc,
                          Rcpp::CharacterVector mb,
+                         Rcpp::CharacterVector vs,
+                         Rcpp::CharacterVector feature_tags,
                          Rcpp::CharacterVector mito,
                          Rcpp::LogicalVector has_UMI,
+                         Rcpp::LogicalVector binary_counts,
                          Rcpp::NumericVector nthreads)
 {
   std::string c_inbam = Rcpp::as<std::string>(inbam);
@@ -218,7 +266,18 @@ void rcpp_sc_demultiplex(Rcpp::CharacterVector inbam,
   Timer timer;
   timer.start();
   
-  Bamdemultiplex bam_de = Bamdemultiplex(c_outdir, bar, c_bc, c_mb, c_ge, c_am, c_mito);
+  Bamdemultiplex bam_de = Bamdemultiplex(c_outdir, std::move(bar), c_bc, c_mb, c_ge, c_am, c_mito);
+  bam_de.v_tag = Rcpp::as<std::string>(vs);
+  bam_de.binary_counts = Rcpp::as<bool>(binary_counts);
+  // feature set tags are named by their feature set
+  if (feature_tags.size() > 0)
+  {
+    std::vector<std::string> set_names = Rcpp::as<std::vector<std::string>>(feature_tags.names());
+    for (int i = 0; i < feature_tags.size(); i++)
+    {
+      bam_de.feature_tags.push_back(std::make_pair(set_names[i], Rcpp::as<std::string>(feature_tags[i])));
+    }
+  }
   
   bam_de.barcode_demultiplex(c_inbam, c_max_mis, c_has_UMI, c_nthreads);
   bam_de.write_statistics("overall_stat", "chr_stat", "cell_stat");
@@ -237,12 +296,15 @@ void rcpp_sc_clean_bam(Rcpp::CharacterVector inbam,
                        Rcpp::CharacterVector bc,
                        Rcpp::CharacterVector mb,
                        Rcpp::CharacterVector mito,
+                       Rcpp::CharacterVector output_format,
+                       Rcpp::LogicalVector cell_index,
                        Rcpp::NumericVector nthreads)
 {
   std::string c_inbam = Rcpp::as<std::string>(inbam);
   std::string c_outbam = Rcpp::as<std::string>(outbam);
   std::string c_bc_anno = Rcpp::as<std::string>(bc_anno);
   std::string c_mito = Rcpp::as<std::string>(mito);
+  std::string c_output_format = Rcpp::as<std::string>(output_format);
   
   std::string c_am = Rcpp::as<std::string>(am);
   std::string c_ge = Rcpp::as<std::string>(ge);
@@ -251,6 +313,7 @@ void rcpp_sc_clean_bam(Rcpp::CharacterVector inbam,
   
   int c_max_mis = Rcpp::as<int>(max_mis);
   int c_nthreads = Rcpp::as<int>(nthreads);
+  bool c_cell_index = Rcpp::as<bool>(cell_index);
   
   Barcode bar;
   bar.read_anno(c_bc_anno);
@@ -260,14 +323,44 @@ void rcpp_sc_clean_bam(Rcpp::CharacterVector inbam,
   Timer timer;
   timer.start();
   
-  Bamdemultiplex bam_de = Bamdemultiplex("", bar, c_bc, c_mb, c_ge, c_am, c_mito);
-  bam_de.clean_bam_barcode(c_inbam, c_outbam, c_max_mis, c_nthreads);
+  Bamdemultiplex bam_de = Bamdemultiplex("", std::move(bar), c_bc, c_mb, c_ge, c_am, c_mito);
+  bam_de.clean_bam_barcode(c_inbam, c_outbam, c_max_mis, c_nthreads, c_output_format, c_cell_index);
   Rcpp::Rcout << "time elapsed: " << timer.time_elapsed() << "\n\n";
 }
 
 // [[Rcpp::plugins(cpp11)]]
 // [[Rcpp::export]]
 
+int rcpp_sc_fetch_cell_reads(Rcpp::CharacterVector inbam,
+                             Rcpp::CharacterVector index,
+                             Rcpp::CharacterVector cell_id,
+                             Rcpp::CharacterVector outbam)
+{
+  std::string c_inbam = Rcpp::as<std::string>(inbam);
+  std::string c_index = Rcpp::as<std::string>(index);
+  std::string c_cell_id = Rcpp::as<std::string>(cell_id);
+  std::string c_outbam = Rcpp::as<std::string>(outbam);
+
+  return fetch_cell_reads(c_inbam, c_index, c_cell_id, c_outbam);
+}
+
+// [[Rcpp::plugins(cpp11)]]
+// [[Rcpp::export]]
+
+void rcpp_sc_write_whitelist(Rcpp::CharacterVector bc_anno,
+                             Rcpp::CharacterVector out_fn)
+{
+  std::string c_bc_anno = Rcpp::as<std::string>(bc_anno);
+  std::string c_out_fn = Rcpp::as<std::string>(out_fn);
+
+  Barcode bar;
+  bar.read_anno(c_bc_anno);
+  bar.write_whitelist(c_out_fn);
+}
+
+// [[Rcpp::plugins(cpp11)]]
+// [[Rcpp::export]]
+
 void rcpp_sc_gene_counting(Rcpp::CharacterVector outdir,
                            Rcpp::CharacterVector bc_anno,
                            Rcpp::NumericVector UMI_cor,
@@ -294,6 +387,129 @@ void rcpp_sc_gene_counting(Rcpp::CharacterVector outdir,
 // [[Rcpp::plugins(cpp11)]]
 // [[Rcpp::export]]
 
+void rcpp_sc_velocity_counting(Rcpp::CharacterVector outdir,
+                               Rcpp::CharacterVector bc_anno,
+                               Rcpp::NumericVector UMI_cor,
+                               Rcpp::NumericVector gene_fl)
+{
+  std::string c_outdir = Rcpp::as<std::string>(outdir);
+  std::string c_bc_anno = Rcpp::as<std::string>(bc_anno);
+  int c_UMI_cor = Rcpp::as<int>(UMI_cor);
+  bool c_gene_fl = Rcpp::as<int>(gene_fl)==1?true:false;
+  
+  Barcode bar;
+  
+  Rcpp::Rcout << "summarising spliced and unspliced counts..." << "\n";
+  
+  Timer timer;
+  timer.start();
+  
+  bar.read_anno(c_bc_anno);
+  get_velocity_matrix(bar, c_outdir, c_UMI_cor, c_gene_fl);
+  
+  Rcpp::Rcout << "time elapsed: " << timer.time_elapsed() << "\n\n";
+}
+
+// [[Rcpp::plugins(cpp11)]]
+// [[Rcpp::export]]
+
+void rcpp_sc_feature_counting(Rcpp::CharacterVector outdir,
+                              Rcpp::CharacterVector bc_anno,
+                              Rcpp::CharacterVector feature_sets,
+                              Rcpp::NumericVector UMI_cor,
+                              Rcpp::NumericVector gene_fl)
+{
+  std::string c_outdir = Rcpp::as<std::string>(outdir);
+  std::string c_bc_anno = Rcpp::as<std::string>(bc_anno);
+  std::vector<std::string> c_feature_sets = Rcpp::as<std::vector<std::string>>(feature_sets);
+  int c_UMI_cor = Rcpp::as<int>(UMI_cor);
+  bool c_gene_fl = Rcpp::as<int>(gene_fl)==1?true:false;
+  
+  Barcode bar;
+  bar.read_anno(c_bc_anno);
+  
+  Timer timer;
+  timer.start();
+  
+  for (const std::string &name : c_feature_sets)
+  {
+    Rcpp::Rcout << "summarising " << name << " counts..." << "\n";
+    get_feature_matrix(bar, c_outdir, name, c_UMI_cor, c_gene_fl);
+  }
+  
+  Rcpp::Rcout << "time elapsed: " << timer.time_elapsed() << "\n\n";
+}
+
+// [[Rcpp::plugins(cpp11)]]
+// [[Rcpp::export]]
+
+void rcpp_sc_count_aligned_bam(Rcpp::CharacterVector inbam,
+                               Rcpp::CharacterVector outbam,
+                               Rcpp::RObject anno,
+                               Rcpp::CharacterVector outdir,
+                               Rcpp::CharacterVector bc_anno,
+                               Rcpp::CharacterVector am,
+                               Rcpp::CharacterVector ge,
+                               Rcpp::CharacterVector bc,
+                               Rcpp::CharacterVector mb,
+                               Rcpp::NumericVector bc_len,
+                               Rcpp::CharacterVector bc_vector,
+                               Rcpp::NumericVector UMI_len,
+                               Rcpp::NumericVector stnd,
+                               Rcpp::NumericVector fix_chr,
+                               Rcpp::NumericVector max_mis,
+                               Rcpp::CharacterVector mito,
+                               Rcpp::LogicalVector has_UMI,
+                               Rcpp::NumericVector UMI_cor,
+                               Rcpp::NumericVector gene_fl,
+                               Rcpp::NumericVector nthreads)
+{
+  std::string c_outbam = Rcpp::as<std::string>(outbam);
+  std::string c_outdir = Rcpp::as<std::string>(outdir);
+  std::string c_bc_anno = Rcpp::as<std::string>(bc_anno);
+  std::string c_mito = Rcpp::as<std::string>(mito);
+  
+  std::string c_am = Rcpp::as<std::string>(am);
+  std::string c_ge = Rcpp::as<std::string>(ge);
+  std::string c_bc = Rcpp::as<std::string>(bc);
+  std::string c_mb = Rcpp::as<std::string>(mb);
+  
+  int c_bc_len = Rcpp::as<int>(bc_len);
+  int c_UMI_len = Rcpp::as<int>(UMI_len);
+  bool c_stnd = Rcpp::as<int>(stnd)==1?true:false;
+  bool c_fix_chr = Rcpp::as<int>(fix_chr)==1?true:false;
+  int c_max_mis = Rcpp::as<int>(max_mis);
+  bool c_has_UMI = Rcpp::as<bool>(has_UMI);
+  int c_UMI_cor = Rcpp::as<int>(UMI_cor);
+  bool c_gene_fl = Rcpp::as<int>(gene_fl)==1?true:false;
+  std::vector<std::string> c_inbam_vec = Rcpp::as<std::vector<std::string>>(inbam);
+  std::vector<std::string> c_bc_vec = Rcpp::as<std::vector<std::string>>(bc_vector);
+  int c_nthreads = Rcpp::as<int>(nthreads);
+  
+  Mapping a = Mapping();
+  a.restrict_to_bam_contigs(c_inbam_vec);
+  Rcpp::Rcout << "adding annotation files..." << "\n";
+  
+  Timer timer;
+  timer.start();
+  add_annotation_arg(a, anno, c_fix_chr, c_nthreads);
+  Rcpp::Rcout << "time elapsed: " << timer.time_elapsed() << "\n\n";
+  
+  Barcode bar;
+  bar.read_anno(c_bc_anno);
+  Bamdemultiplex bam_de = Bamdemultiplex(c_outdir, std::move(bar), c_bc, c_mb, c_ge, c_am, c_mito);
+  
+  Rcpp::Rcout << "mapping, demultiplexing and counting reads in a single pass..." << "\n";
+  timer.start();
+  SinglePassCounter counter(a, bam_de);
+  counter.count_reads(c_inbam_vec, c_bc_vec, c_outbam, c_stnd, c_bc_len, c_UMI_len, c_max_mis, c_has_UMI, c_nthreads);
+  counter.write_results(c_UMI_cor, c_gene_fl);
+  Rcpp::Rcout << "time elapsed: " << timer.time_elapsed() << "\n\n";
+}
+
+// [[Rcpp::plugins(cpp11)]]
+// [[Rcpp::export]]
+
 void rcpp_sc_detect_bc(Rcpp::CharacterVector infq,
                        Rcpp::CharacterVector outcsv,
                        Rcpp::CharacterVector prefix,
@@ -0,0 +1,230 @@
+// singlepass.cpp
+#include "singlepass.h"
+
+using namespace Rcpp;
+
+using std::string;
+using std::stringstream;
+using std::unordered_map;
+using std::vector;
+
+SinglePassCounter::SinglePassCounter(Mapping &mapping, Bamdemultiplex &demux) :
+    mapping(mapping), demux(demux)
+{
+}
+
+void SinglePassCounter::count_reads(vector<string> fn_vec, vector<string> cell_id_vec, string fn_out, bool m_strand, int bc_len, int UMI_len, int max_mismatch, bool has_UMI, int nthreads)
+{
+    if (bc_len == 0 && fn_vec.size() != cell_id_vec.size())
+    {
+        stringstream err_msg;
+        err_msg << "size of bam file and cell id vector should be the same: \n";
+        err_msg << "\t number of bam files: " << fn_vec.size() << "\n";
+        err_msg << "\t number of cell ids: " << cell_id_vec.size() << "\n";
+        stop(err_msg.str());
+    }
+
+    if (fn_vec.empty())
+    {
+        stop("no bam file is given\n");
+    }
+    // only the first header is written and the `map_exon` cache is keyed by tid,
+    // so every file has to share the references of the first one
+    check_file_exists(fn_vec[0]);
+    BGZF *fp = bgzf_open(fn_vec[0].c_str(), "r");
+    bam_hdr_t *ref_header = fp ? bam_hdr_read(fp) : NULL;
+    if (fp) bgzf_close(fp);
+    if (!ref_header)
+    {
+        stop("fail to read the bam header: " + fn_vec[0] + "\n");
+    }
+
+    mapping.reset_map_cache();
+    // this thread counts the reads, the other threads share the input and output (de)compression
+    HtsPool pool(nthreads - 1);
+    samFile *of = NULL;
+    if (!fn_out.empty())
+    {
+        of = sam_open(fn_out.c_str(), "wb");
+        if (!of)
+        {
+            bam_hdr_destroy(ref_header);
+            stop("cannot open output bam file: " + fn_out + "\n");
+        }
+        pool.attach(of);
+        if (sam_hdr_write(of, ref_header) < 0)
+        {
+            pool.close(of);
+            bam_hdr_destroy(ref_header);
+            stop("fail to write the bam header: " + fn_out + "\n");
+        }
+    }
+
+    for (size_t i = 0; i < fn_vec.size(); i++)
+    {
+        string cell_id = bc_len == 0 ? cell_id_vec[i] : "";
+        count_bam(fn_vec[i], cell_id, ref_header, of, m_strand, bc_len, UMI_len, max_mismatch, has_UMI, pool);
+    }
+
+    bam_hdr_destroy(ref_header);
+    if (of) pool.close(of);
+
+    Rcout << "number of read processed: " << total_reads << "\n";
+    const char *map_desc[5] = {"unique map to exon", "ambiguous map to multiple exon", "map to intron", "not mapped", "unaligned"};
+    for (int i = 0; i < 5; i++)
+    {
+        Rcout << map_desc[i] << ": " << map_count[i]
+              << " (" << std::fixed << std::setprecision(2) << 100. * map_count[i] / total_reads << "%)" << "\n";
+    }
+    mapping.report_map_cache();
+    demux.barcode_cache(max_mismatch).report();
+}
+
+void SinglePassCounter::count_bam(const string &bam_fn, const string &cell_id, const bam_hdr_t *ref_header, samFile *of, bool m_strand, int bc_len, int UMI_len, int max_mismatch, bool has_UMI, HtsPool &pool)
+{
+    check_file_exists(bam_fn); // htslib does not check if file exist so we do it manually
+    BGZF *fp = bgzf_open(bam_fn.c_str(), "r");
+    bam_hdr_t *header = fp ? bam_hdr_read(fp) : NULL;
+    if (!header)
+    {
+        if (fp) bgzf_close(fp);
+        stop("fail to read the bam header: " + bam_fn + "\n");
+    }
+    if (!Mapping::same_references(ref_header, header))
+    {
+        bam_hdr_destroy(header);
+        bgzf_close(fp);
+        stop("bam file has different references than the first file: " + bam_fn + "\n");
+    }
+    bam1_t *b = bam_init1();
+    pool.attach(fp, 64);
+
+    mapping.check_contigs(header);
+    AnnoCursor cursor(mapping.Anno);
+    int mt_idx = demux.find_mt_idx(header);
+
+    // chromosomes without annotation are never looked up in map_exon
+    vector<bool> annotated(header->n_targets);
+    for (int i = 0; i < header->n_targets; i++)
+    {
+        annotated[i] = mapping.Anno.gene_dict.find(header->target_name[i]) != mapping.Anno.gene_dict.end();
+    }
+
+    const char *c_ptr = demux.c_tag.c_str();
+    const char *m_ptr = demux.m_tag.c_str();
+    const char *g_ptr = demux.g_tag.c_str();
+    const char *a_ptr = demux.a_tag.c_str();
+    AuxTagBuilder tags;
+
+    string gene_id;
+    string bc_seq = cell_id;
+    string umi;
+    BarcodeCache &cache = demux.barcode_cache(max_mismatch);
+    DemuxStats read_stats = demux.new_stats(header);
+    // barcode of the previous read, consecutive reads usually come from the same cell
+    const BarcodeCache::Match *last_match = NULL;
+    gene_umi_count *gene_reads = NULL;
+
+    while (bam_read1(fp, b) >= 0)
+    {
+        if (++total_reads % 32768 == 0) checkUserInterrupt();
+
+        int ret;
+        gene_id.clear();
+        if ((b->core.flag & BAM_FUNMAP) > 0)
+        {
+            ret = 4;
+        }
+        else if (!annotated[b->core.tid])
+        {
+            ret = 3;
+        }
+        else
+        {
+            ret = mapping.map_exon(header, b, gene_id, m_strand, &cursor);
+        }
+        if (ret <= 0)
+        {
+            map_count[0]++;
+        }
+        else if (ret <= 4)
+        {
+            map_count[ret]++;
+        }
+
+        const char *qname = bam_get_qname(b);
+        if (bc_len > 0)
+        {
+            bc_seq.assign(qname, bc_len);
+        }
+        if (UMI_len > 0)
+        {
+            umi.assign(qname + bc_len + 1, UMI_len); // `+1` to skip the separator
+        }
+
+        const BarcodeCache::Match *match = bc_seq.empty() ? NULL : cache.find(bc_seq);
+        if (demux.tally_read(read_stats, header, b, match, ret <= 0, true, ret, mt_idx))
+        {
+            if (!gene_reads || match != last_match)
+            {
+                gene_reads = &cell_reads[demux.bar.cell_id(match->cell)];
+                last_match = match;
+            }
+            // same (UMI, distance to transcript end) pair as `barcode_demultiplex` reads from the map tag
+            (*gene_reads)[gene_id][umi_pos_pair(has_UMI ? umi : string(qname), -ret)]++;
+        }
+
+        if (of)
+        {
+            if (ret <= 0)
+            {
+                tags.add_str(g_ptr, gene_id);
+            }
+            if (!bc_seq.empty())
+            {
+                tags.add_str(c_ptr, bc_seq);
+            }
+            if (UMI_len > 0)
+            {
+                tags.add_str(m_ptr, umi);
+            }
+            tags.add_int(a_ptr, ret);
+            if (tags.write(b) < 0)
+            {
+                stop(string("fail to add the bam tags: ") + bam_get_qname(b) + "\n");
+            }
+
+            int re = sam_write1(of, header, b);
+            if (re < 0)
+            {
+                stringstream err_msg;
+                err_msg << "fail to write the bam file: " << bam_get_qname(b) << "\n";
+                err_msg << "return code: " << re << "\n";
+                stop(err_msg.str());
+            }
+        }
+    }
+
+    demux.add_stats(header, read_stats);
+    bam_destroy1(b);
+    bam_hdr_destroy(header);
+    pool.close(fp);
+}
+
+void SinglePassCounter::write_results(int UMI_correct, bool read_filter)
+{
+    demux.write_statistics("overall_stat", "chr_stat", "cell_stat");
+    // each cell is moved out once it has been deduplicated to release its reads early
+    write_counting_matrix(demux.bar, demux.out_dir, UMI_correct, read_filter,
+        [&](const string &cell_id)
+        {
+            gene_umi_count gene_reads;
+            auto it = cell_reads.find(cell_id);
+            if (it != cell_reads.end())
+            {
+                gene_reads.swap(it->second);
+                cell_reads.erase(it);
+            }
+            return gene_reads;
+        });
+}
@@ -0,0 +1,51 @@
+// singlepass.h
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <Rcpp.h>
+#include "config_hts.h"
+#include "htspool.h"
+#include "utils.h"
+#include "transcriptmapping.h"
+#include "parsebam.h"
+#include "parsecount.h"
+
+#ifndef SINGLEPASS_H
+#define SINGLEPASS_H
+
+// count an aligned bam in a single read of the file: exon mapping, cell barcode
+// correction, demultiplexing statistics and UMI collection are done per read,
+// so neither the tagged bam nor the per cell count files have to be written
+// and read back. the outputs are the same as running `parse_align`,
+// `barcode_demultiplex` and `get_counting_matrix` one after another.
+class SinglePassCounter
+{
+public:
+    Mapping &mapping;
+    Bamdemultiplex &demux;
+
+    SinglePassCounter(Mapping &mapping, Bamdemultiplex &demux);
+
+    // @param: fn_vec, aligned bam files with barcode and UMI in the read name,
+    //         or one cell per file (bc_len = 0) with the barcodes in cell_id_vec
+    // @param: fn_out, tagged bam output as written by `parse_align`, empty to skip it
+    void count_reads(std::vector<std::string> fn_vec, std::vector<std::string> cell_id_vec, std::string fn_out, bool m_strand, int bc_len, int UMI_len, int max_mismatch, bool has_UMI, int nthreads);
+
+    // UMI deduplicate the collected read counts, then write the gene count matrix,
+    // UMI statistics and demultiplexing statistics to the output directory
+    void write_results(int UMI_correct, bool read_filter);
+
+private:
+    // cell id -> gene id -> (UMI, position) -> number of reads, tallied as the reads
+    // arrive so only the distinct molecules are kept
+    std::unordered_map<std::string, gene_umi_count> cell_reads;
+    // same breakdown as the `parse_align` report: exon, ambiguous, intron, not mapped, unaligned
+    unsigned long long map_count[5] = {0, 0, 0, 0, 0};
+    unsigned long long total_reads = 0;
+
+    // `ref_header` is the header of the first file, whose references every file must share.
+    // `of` receives the tagged reads (or NULL), `pool` is shared by the input and output of all files
+    void count_bam(const std::string &bam_fn, const std::string &cell_id, const bam_hdr_t *ref_header, samFile *of, bool m_strand, int bc_len, int UMI_len, int max_mismatch, bool has_UMI, HtsPool &pool);
+};
+
+#endif
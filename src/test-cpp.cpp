@@ -12,9 +12,14 @@
 
 #include "Gene.h"
 #include "Interval.h"
+#include "bamtags.h"
 
+#include "cellbam.h"
 #include "cellbarcode.h"
+#include "cellindex.h"
+#include "cellreads.h"
 #include "parsecount.h"
+#include "transcriptmapping.h"
 #include "utils.h"
 
 
@@ -84,6 +89,752 @@ context("Testing classes") {
     expect_true(g1.exon_vec[0].st == 1);
     expect_true(g1.exon_vec[0].en == 10);
   }
+
+  test_that("Distance to transcript end sums the remaining exons") {
+    Gene gp("Gene1", 1);
+    gp.add_exon(Interval(40, 50, 1));
+    gp.add_exon(Interval(10, 20, 1));
+    gp.add_exon(Interval(70, 100, 1));
+    gp.sort_exon();
+    gp.flatten_exon();
+    expect_true(gp.distance_to_end(Interval(15, 30, 1)) == 5 + 10 + 30);
+    expect_true(gp.distance_to_end(Interval(42, 60, 1)) == 8 + 30);
+    expect_true(gp.distance_to_end(Interval(90, 120, 1)) == 10);
+
+    Gene gm("Gene2", -1);
+    gm.add_exon(Interval(10, 20, -1));
+    gm.add_exon(Interval(40, 50, -1));
+    gm.add_exon(Interval(70, 100, -1));
+    gm.sort_exon();
+    gm.flatten_exon();
+    expect_true(gm.distance_to_end(Interval(0, 15, -1)) == 5);
+    expect_true(gm.distance_to_end(Interval(30, 45, -1)) == 10 + 5);
+    expect_true(gm.distance_to_end(Interval(60, 80, -1)) == 10 + 10 + 10);
+  }
+
+  test_that("Reads inside a single exon are recognised") {
+    Gene g("Gene1", 1);
+    g.add_exon(Interval(10, 20, 1));
+    g.add_exon(Interval(40, 50, 1));
+    g.sort_exon();
+    g.flatten_exon();
+    expect_true(g.within_exon(Interval(10, 20, 1)));
+    expect_true(g.within_exon(Interval(42, 45, 1)));
+    expect_false(g.within_exon(Interval(15, 25, 1))); // reaches into the intron
+    expect_false(g.within_exon(Interval(30, 35, 1)));
+    expect_false(g.within_exon(Interval(15, 45, 1)));
+  }
+
+  test_that("Feature lookup tables find overlapping genes and exons") {
+    Gene g1("Gene1", 1);
+    g1.add_exon(Interval(10, 20, 1));
+    g1.add_exon(Interval(40, 50, 1));
+    Gene g2("Gene2", -1);
+    g2.add_exon(Interval(45, 60, -1));
+    std::vector<Gene> genes = {g1, g2};
+
+    FeatureRuns runs;
+    runs.build(genes);
+    std::vector<std::pair<unsigned int, bool>> hits;
+
+    runs.query(Interval(0, 9, 1), hits); // intergenic
+    expect_true(hits.empty());
+    runs.query(Interval(0, 10, 1), hits); // boundaries are inclusive
+    expect_true(hits.size() == 1 && hits[0].first == 0 && hits[0].second);
+    runs.query(Interval(25, 35, 1), hits); // intron
+    expect_true(hits.size() == 1 && hits[0].first == 0 && !hits[0].second);
+    runs.query(Interval(30, 46, 1), hits); // exons of both genes
+    expect_true(hits.size() == 2 && hits[0].second && hits[1].second);
+    runs.query(Interval(55, 70, 1), hits);
+    expect_true(hits.size() == 1 && hits[0].first == 1);
+    runs.query(Interval(61, 70, 1), hits);
+    expect_true(hits.empty());
+  }
+
+  test_that("Barcodes pack two bits per base") {
+    uint64_t key, n_mask;
+    expect_true(pack_barcode("ACGT", 4, key) && key == 0x11B);
+    expect_true(unpack_barcode(key) == "ACGT");
+    expect_true(pack_barcode("", 0, key) && key == 1 && unpack_barcode(key) == "");
+    // a leading A keeps the length apart
+    uint64_t a_key;
+    expect_true(pack_barcode("AACGT", 5, a_key) && a_key != key && unpack_barcode(a_key) == "AACGT");
+    expect_true(!pack_barcode("ACNT", 4, key));
+    expect_true(pack_barcode("ACNT", 4, key, &n_mask) && n_mask == 0xC && unpack_barcode(key) == "ACAT");
+    expect_true(!pack_barcode("ACXT", 4, key, &n_mask));
+    std::string longest(31, 'T');
+    expect_true(pack_barcode(longest.data(), 31, key) && unpack_barcode(key) == longest);
+    expect_true(!pack_barcode((longest + "T").data(), 32, key));
+  }
+
+  test_that("Closest barcode match is unique or rejected") {
+    std::string anno_fn = "test_barcode_list.txt";
+    {
+      std::ofstream anno(anno_fn);
+      anno << "AAAACCCC\nAAAAGGGG\nTTTTCCCC\nACGTACGT\n";
+    }
+    Barcode bar;
+    bar.read_anno(anno_fn);
+    expect_true(bar.get_closest_match("AAAACCCC", 1) == "AAAACCCC");
+    expect_true(bar.get_closest_match("AAAACCCA", 1) == "AAAACCCC");
+    expect_true(bar.get_closest_match("CCGTACGT", 1) == "ACGTACGT");
+    expect_true(bar.get_closest_match("AAAACCCA", 0) == "");
+    expect_true(bar.get_closest_match("AAAACCGG", 1) == ""); // two mismatches
+    expect_true(bar.get_closest_match("AAAACCGG", 2) == ""); // tie between two barcodes
+    expect_true(bar.get_closest_match("ATAACCCC", 2) == "AAAACCCC");
+    expect_true(bar.get_closest_match("AAAANCCC", 1) == "AAAACCCC"); // an N is a mismatch
+    expect_true(bar.get_closest_match("AAAANCCC", 0) == "");
+    expect_true(bar.get_closest_match("AAAACCC", 1) == ""); // other length
+
+    // barcodes of different length are only compared to sequences of their length
+    {
+      std::ofstream anno(anno_fn);
+      anno << "AAAACCCC\nAAAACCC\n";
+    }
+    Barcode mixed;
+    mixed.read_anno(anno_fn);
+    expect_true(mixed.get_closest_match("AAAACCCA", 1) == "AAAACCCC");
+    expect_true(mixed.get_closest_match("AAAACCA", 1) == "AAAACCC");
+    std::remove(anno_fn.c_str());
+  }
+
+  test_that("Barcode corrections are cached per raw barcode") {
+    std::string anno_fn = "test_barcode_anno.csv";
+    {
+      std::ofstream anno(anno_fn);
+      anno << "cell_id,barcode\ncell_AAAACCCC,AAAACCCC\ncell_AAAAGGGG,AAAAGGGG\ncell_TTTTCCCC,TTTTCCCC\n";
+    }
+    Barcode bar;
+    bar.read_anno(anno_fn);
+    std::remove(anno_fn.c_str());
+    BarcodeCache cache(bar, 1);
+    for (int i = 0; i < 3; i++)
+    {
+      const BarcodeCache::Match *match = cache.find("AAAACCCA");
+      expect_true(match != NULL && match->barcode() == "AAAACCCC" && bar.cell_id(match->cell) == "cell_AAAACCCC");
+      expect_true(match->cell == 0);
+      expect_true(cache.find("AAAACCGG") == NULL);
+    }
+    // an N is not packed, the barcode is cached as a string
+    for (int i = 0; i < 2; i++)
+    {
+      const BarcodeCache::Match *match = cache.find("TTTTNCCC");
+      expect_true(match != NULL && match->barcode() == "TTTTCCCC" && match->cell == 2);
+    }
+    expect_true(cache.size() == 3);
+    expect_true(cache.hits() == 5);
+    expect_true(cache.misses() == 3);
+  }
+
+  test_that("Barcode annotations survive the binary whitelist") {
+    std::string anno_fn = "test_barcode_anno.csv";
+    std::string wl_fn = "test_barcode_anno.bcwl";
+    {
+      std::ofstream anno(anno_fn);
+      anno << "cell_id,barcode\r\ncell1,AAAACCCC\r\ncell2,ACGTACGT\r\ncell1,TTTTGGGG\r\n";
+    }
+    Barcode bar;
+    bar.read_anno(anno_fn);
+    expect_true(bar.cell_ids() == std::vector<std::string>({"cell1", "cell2"}));
+    expect_true(bar.n_barcodes() == 3 && unpack_barcode(bar.barcode(2)) == "TTTTGGGG");
+    expect_true(bar.find_cell(bar.barcode(2)) == 0);
+    bar.write_whitelist(wl_fn);
+    Barcode wl;
+    wl.read_anno(wl_fn);
+    expect_true(wl.cell_ids() == bar.cell_ids());
+    expect_true(wl.n_barcodes() == bar.n_barcodes());
+    for (size_t i = 0; i < bar.n_barcodes(); i++)
+    {
+      expect_true(wl.barcode(i) == bar.barcode(i));
+    }
+    expect_true(wl.barcode_dict == bar.barcode_dict);
+    expect_true(wl.get_closest_match("TTTTGGGA", 1) == "TTTTGGGG");
+
+    // a list of barcodes without header, each barcode is its own cell
+    {
+      std::ofstream anno(anno_fn);
+      anno << "ACGTACGT\nAAAACCCC\nACGTACGT\n";
+    }
+    Barcode list;
+    list.read_anno(anno_fn);
+    expect_true(list.n_cells() == 2 && list.n_barcodes() == 2);
+    expect_true(list.cell_ids() == std::vector<std::string>({"ACGTACGT", "AAAACCCC"}));
+    expect_true(list.cell_id(1) == "AAAACCCC");
+    list.write_whitelist(wl_fn);
+    Barcode list_wl;
+    list_wl.read_anno(wl_fn);
+    expect_true(list_wl.cell_ids() == list.cell_ids());
+    expect_true(list_wl.barcode_dict == list.barcode_dict);
+
+    // annotated cells added to the list keep the barcodes of the list as their ids
+    {
+      std::ofstream anno(anno_fn);
+      anno << "cell_id,barcode\ncell1,TTTTGGGG\ncell2,ACGTACGT\n";
+    }
+    list_wl.read_anno(anno_fn);
+    expect_true(list_wl.cell_ids() == std::vector<std::string>({"ACGTACGT", "AAAACCCC", "cell1", "cell2"}));
+    expect_true(list_wl.n_barcodes() == 3);
+    uint64_t key;
+    pack_barcode("ACGTACGT", 8, key);
+    expect_true(list_wl.find_cell(key) == 3); // moved to its new cell
+    expect_true(list_wl.get_closest_match("TTTTGGGA", 1) == "TTTTGGGG");
+
+    // barcodes that do not pack are rejected
+    {
+      std::ofstream anno(anno_fn);
+      anno << "cell_id,barcode\ncell1,AAAANCCC\n";
+    }
+    Barcode bad;
+    bool stopped = false;
+    try {
+      bad.read_anno(anno_fn);
+    } catch (...) {
+      stopped = true;
+    }
+    expect_true(stopped);
+    std::remove(anno_fn.c_str());
+    std::remove(wl_fn.c_str());
+  }
+
+  test_that("Cell reads survive the binary container") {
+    std::string fn = "test_cell_reads.bin";
+    std::vector<std::string> cells = {"cell1", "cell2", "cell3"};
+    {
+      // a buffer of two reads per cell puts the reads of a cell in several extents
+      CellReadWriter writer(fn, cells, 1 << 20, 2);
+      writer.add(1, "gene1", "ACGTNA", 10);
+      writer.add(0, "gene2", "TTTT", -5);
+      writer.add(1, "gene1", "ACGTAA", 12);
+      writer.add(1, "gene2", "GGGG", 0);
+      writer.close();
+    }
+    CellReadReader reader(fn);
+    auto cell2 = reader.read_cell("cell2");
+    expect_true(cell2.size() == 2);
+    expect_true(cell2["gene1"].size() == 2);
+    expect_true(cell2["gene1"][0] == umi_pos_pair("ACGTNA", 10));
+    expect_true(cell2["gene1"][1] == umi_pos_pair("ACGTAA", 12));
+    expect_true(cell2["gene2"].size() == 1 && cell2["gene2"][0] == umi_pos_pair("GGGG", 0));
+    auto cell1 = reader.read_cell("cell1");
+    expect_true(cell1.size() == 1 && cell1["gene2"][0] == umi_pos_pair("TTTT", -5));
+    expect_true(reader.read_cell("cell3").empty());
+    expect_true(reader.read_cell("cell4").empty());
+    std::remove(fn.c_str());
+  }
+
+  test_that("Bam records are grouped by cell") {
+    // (cell, position) of the records in input order
+    std::vector<std::pair<int, int>> input = {{2, 0}, {0, 1}, {2, 2}, {1, 3}, {2, 4}, {0, 5}, {2, 6}};
+    for (bool prefetch : {false, true}) {
+      std::string fn = "test_cell_bam.tmp";
+      std::vector<std::pair<int, int>> output;
+      bool data_ok = true;
+      {
+        // a tiny budget spills the records to the temporary file as they are added
+        CellBamSorter sorter(fn, 4, 100);
+        for (auto &rec : input) {
+          bam1_t b = {};
+          b.core.pos = rec.second;
+          b.l_data = b.m_data = 1 + rec.second; // data of varying length
+          b.data = (uint8_t*)malloc(b.m_data);
+          memset(b.data, 'a' + rec.second, b.l_data);
+          sorter.add(rec.first, &b);
+          free(b.data);
+        }
+        sorter.for_each([&](int cell, const bam1_t *b) {
+          output.push_back(std::make_pair(cell, (int)b->core.pos));
+          for (int i = 0; i < b->l_data; i++) {
+            data_ok = data_ok && b->data[i] == 'a' + b->core.pos && b->l_data == 1 + b->core.pos;
+          }
+        }, prefetch);
+      }
+      std::vector<std::pair<int, int>> expected = {{0, 1}, {0, 5}, {1, 3}, {2, 0}, {2, 2}, {2, 4}, {2, 6}};
+      expect_true(output == expected);
+      expect_true(data_ok);
+      expect_false(std::ifstream(fn).good());
+    }
+  }
+
+  test_that("Cell index merges consecutive reads of a cell") {
+    std::string fn = "test_cell_index.cbi";
+    {
+      CellIndex index(std::vector<std::string>{"cell1", "cell2", "cell3"});
+      index.add(0, 10, 20);
+      index.add(0, 20, 35); // follows the previous read of the cell
+      index.add(1, 35, 50);
+      index.add(0, 50, 60);
+      index.write(fn, 1234);
+    }
+    CellIndex index(fn);
+    expect_true(index.bam_size() == 1234);
+    const std::vector<VirtualRange> *cell1 = index.find("cell1");
+    expect_true(cell1 != NULL && cell1->size() == 2);
+    expect_true((*cell1)[0] == VirtualRange(10, 35) && (*cell1)[1] == VirtualRange(50, 60));
+    expect_true(index.find("cell2") != NULL && index.find("cell2")->size() == 1);
+    expect_true(index.find("cell3") != NULL && index.find("cell3")->empty());
+    expect_true(index.find("cell4") == NULL);
+    std::remove(fn.c_str());
+  }
+
+  test_that("Cell reads are not fetched from a file that is not a bam file") {
+    const std::string bam_fn = "test_not_bam.bam";
+    const std::string fn = "test_not_bam.cbi";
+    {
+      std::ofstream out(bam_fn);
+      out << "not a bam file\n";
+    }
+    {
+      CellIndex index(std::vector<std::string>{"cell1"});
+      index.add(0, 0, 10);
+      index.write(fn, 15);
+    }
+    bool stopped = false;
+    try {
+      fetch_cell_reads(bam_fn, fn, "cell1", "test_not_bam_cell1.bam");
+    } catch (...) {
+      stopped = true;
+    }
+    expect_true(stopped);
+    expect_false(std::ifstream("test_not_bam_cell1.bam").good());
+    std::remove(bam_fn.c_str());
+    std::remove(fn.c_str());
+  }
+
+  test_that("Aux tags are appended in a single write") {
+    bam1_t b = {};
+    b.l_data = 4; // read name "*" with padding
+    b.m_data = 4;
+    b.data = (uint8_t*)calloc(b.m_data, 1);
+    b.data[0] = '*';
+    b.core.l_qname = 4;
+
+    AuxTagBuilder tags;
+    tags.add_str("CB", "ACGTxx", 4);
+    tags.add_char("VS", 'S');
+    tags.add_int("YE", -12);
+    expect_true(tags.write(&b) == 0);
+    expect_true(tags.empty());
+
+    const uint8_t expected[] = {'C','B','Z','A','C','G','T',0, 'V','S','A','S', 'Y','E','i'};
+    int32_t value;
+    memcpy(&value, b.data + 4 + sizeof(expected), sizeof(value));
+    expect_true(b.l_data == 4 + (int)sizeof(expected) + 4);
+    expect_true(b.m_data >= (uint32_t)b.l_data);
+    expect_true(memcmp(b.data + 4, expected, sizeof(expected)) == 0);
+    expect_true(value == -12);
+    free(b.data);
+  }
+
+  test_that("Mapping results are cached by alignment footprint") {
+    AlignmentCache cache;
+    cache.reset(0);
+    expect_false(cache.enabled());
+
+    // rounded up to 8 slots
+    cache.reset(5);
+    expect_true(cache.enabled());
+    int ret = 0;
+    int gene_idx = 0;
+    expect_false(cache.get(3, ret, gene_idx));
+    cache.put(3, -25, 7);
+    cache.put(4, 2, -1);
+    expect_true(cache.get(3, ret, gene_idx) && ret == -25 && gene_idx == 7);
+    expect_true(cache.get(4, ret, gene_idx) && ret == 2 && gene_idx == -1);
+
+    // a key sharing the slot replaces the entry
+    cache.put(3 + 8, 1, 9);
+    expect_false(cache.get(3, ret, gene_idx));
+    expect_true(cache.get(3 + 8, ret, gene_idx) && ret == 1 && gene_idx == 9);
+
+    cache.count(true);
+    cache.count(false);
+    cache.count(false);
+    expect_true(cache.hits() == 1 && cache.misses() == 2);
+    cache.reset(8);
+    expect_false(cache.get(4, ret, gene_idx));
+    expect_true(cache.hits() == 0 && cache.misses() == 0);
+    cache.reset(0);
+    expect_false(cache.enabled());
+
+    // reads with the same position, strand and cigar share a footprint
+    uint32_t cigar[2] = {20 << BAM_CIGAR_SHIFT | BAM_CMATCH, 30 << BAM_CIGAR_SHIFT | BAM_CMATCH};
+    bam1_t b = {};
+    b.core.tid = 1;
+    b.core.pos = 1000;
+    b.core.l_qname = 0;
+    b.core.n_cigar = 2;
+    b.data = (uint8_t *)cigar;
+    const uint64_t key = AlignmentCache::footprint(&b, true);
+    expect_true(key != 0);
+    expect_true(AlignmentCache::footprint(&b, true) == key);
+    expect_false(AlignmentCache::footprint(&b, false) == key);
+    cigar[1] = 31 << BAM_CIGAR_SHIFT | BAM_CMATCH;
+    expect_false(AlignmentCache::footprint(&b, true) == key);
+    b.core.flag = BAM_FREVERSE;
+    cigar[1] = 30 << BAM_CIGAR_SHIFT | BAM_CMATCH;
+    expect_false(AlignmentCache::footprint(&b, true) == key);
+  }
+}
+
+// "chr gene_id st-en:strand ..." for every gene, sorted, so two annotations compare equal
+// regardless of the order their genes were loaded in
+static std::vector<std::string> gene_lines(const GeneAnnotation &anno) {
+  std::vector<std::string> lines;
+  for (const auto &chr : anno.gene_dict) {
+    for (const auto &gene : chr.second) {
+      std::ostringstream line;
+      line << chr.first << " " << gene.gene_id;
+      for (const auto &exon : gene.exon_vec) {
+        line << " " << exon.st << "-" << exon.en << ":" << exon.snd;
+      }
+      lines.push_back(line.str());
+    }
+  }
+  std::sort(lines.begin(), lines.end());
+  return lines;
+}
+
+// the installed location of a file in inst/extdata
+static std::string extdata_file(const std::string &fn) {
+  Rcpp::Function system_file("system.file");
+  return Rcpp::as<std::string>(system_file("extdata", fn, Rcpp::Named("package") = "scPipe"));
+}
+
+// write a bam file from sam text starting with its header lines
+static void write_bam(const std::string &fn, const std::string &sam) {
+  const std::string sam_fn = fn + ".sam";
+  {
+    std::ofstream out(sam_fn);
+    out << sam;
+  }
+  samFile *in = sam_open(sam_fn.c_str(), "r");
+  bam_hdr_t *header = sam_hdr_read(in);
+  samFile *out = sam_open(fn.c_str(), "wb");
+  sam_hdr_write(out, header);
+  bam1_t *b = bam_init1();
+  while (sam_read1(in, header, b) >= 0) {
+    sam_write1(out, header, b);
+  }
+  bam_destroy1(b);
+  sam_close(out);
+  bam_hdr_destroy(header);
+  sam_close(in);
+  std::remove(sam_fn.c_str());
+}
+
+// the header text followed by one line per read, to compare bam files whatever
+// their compression blocks
+static std::vector<std::string> bam_records(const std::string &fn) {
+  std::vector<std::string> records;
+  BGZF *fp = bgzf_open(fn.c_str(), "r");
+  bam_hdr_t *header = fp ? bam_hdr_read(fp) : NULL;
+  if (!header) {
+    if (fp) bgzf_close(fp);
+    return records;
+  }
+  records.push_back(std::string(header->text, header->l_text));
+  bam1_t *b = bam_init1();
+  while (bam_read1(fp, b) >= 0) {
+    std::ostringstream r;
+    r << b->core.tid << " " << b->core.pos << " " << b->core.flag << " " << (int)b->core.qual << " "
+      << b->core.mtid << " " << b->core.mpos << " " << b->core.isize << " ";
+    r << std::string((const char *)b->data, b->l_data);
+    records.push_back(r.str());
+  }
+  bam_destroy1(b);
+  bam_hdr_destroy(header);
+  bgzf_close(fp);
+  return records;
+}
+
+// names of the reads of a bam file in file order
+static std::vector<std::string> bam_read_names(const std::string &fn) {
+  std::vector<std::string> names;
+  BGZF *fp = bgzf_open(fn.c_str(), "r");
+  bam_hdr_t *header = fp ? bam_hdr_read(fp) : NULL;
+  if (!header) {
+    if (fp) bgzf_close(fp);
+    return names;
+  }
+  bam1_t *b = bam_init1();
+  while (bam_read1(fp, b) >= 0) {
+    names.push_back(bam_get_qname(b));
+  }
+  bam_destroy1(b);
+  bam_hdr_destroy(header);
+  bgzf_close(fp);
+  return names;
+}
+
+context("Testing annotation parsing") {
+  test_that("Annotation files are parsed like their SAF import") {
+    Rcpp::Environment scPipe = Rcpp::Environment::namespace_env("scPipe");
+    Rcpp::Function anno_import = scPipe["anno_import"];
+    const char *fns[] = {
+      "ens_tiny_anno.gff3.gz", "ens_tiny_anno.gtf.gz",
+      "gen_tiny_anno.gff3.gz", "gen_tiny_anno.gtf.gz",
+      "ref_tiny_anno.gff3.gz"
+    };
+    for (const char *fn : fns) {
+      const std::string path = extdata_file(fn);
+      Mapping files;
+      files.add_annotation(path, false, 2);
+      Mapping saf;
+      saf.add_annotation(Rcpp::DataFrame(anno_import(path)), false);
+      expect_true(files.Anno.ngenes() > 0);
+      expect_true(gene_lines(files.Anno) == gene_lines(saf.Anno));
+    }
+  }
+
+  test_that("BED gene ids come from the name column") {
+    const std::string fn = "test_anno.bed";
+    {
+      std::ofstream bed(fn);
+      bed << "name\tchr\tstart\tend\tstrand\n";
+      bed << "gene1\tchr1\t10\t20\t+\n";
+      bed << "gene1\tchr1\t30\t40\t+\n";
+      bed << "gene2\tchr2\t50\t60\t-\n";
+    }
+    Mapping a;
+    a.add_annotation(fn, false);
+    std::vector<std::string> expected = {
+      "chr1 gene1 10-20:1 30-40:1",
+      "chr2 gene2 50-60:-1"
+    };
+    expect_true(gene_lines(a.Anno) == expected);
+    std::remove(fn.c_str());
+  }
+
+  test_that("ENSEMBL exons find their gene through the transcript in any line order") {
+    const std::string fn = "test_anno.gff3";
+    {
+      std::ofstream gff3(fn);
+      gff3 << "##gff-version 3\n";
+      gff3 << "1\tEnsembl\texon\t300\t400\t.\t-\t.\tParent=transcript:T2\n";
+      gff3 << "1\tEnsembl\texon\t100\t200\t.\t+\t.\tParent=transcript:T1\n";
+      gff3 << "1\tEnsembl\tmRNA\t100\t200\t.\t+\t.\tID=transcript:T1;Parent=gene:G1\n";
+      gff3 << "1\tEnsembl\texon\t150\t250\t.\t+\t.\tParent=transcript:T1\n";
+      gff3 << "1\tEnsembl\tgene\t100\t250\t.\t+\t.\tID=gene:G1\n";
+      gff3 << "1\tEnsembl\tmRNA\t300\t400\t.\t-\t.\tID=transcript:T2;Parent=gene:G2\n";
+      gff3 << "1\tEnsembl\tncRNA_gene\t300\t400\t.\t-\t.\tID=gene:G2\n";
+    }
+    Mapping a;
+    a.add_annotation(fn, false, 2);
+    std::vector<std::string> expected = {
+      "1 G1 100-250:1",
+      "1 G2 300-400:-1"
+    };
+    expect_true(gene_lines(a.Anno) == expected);
+    std::remove(fn.c_str());
+  }
+  test_that("Only the contigs in the bam header are loaded") {
+    const std::string bam_fn = "test_contigs.bam";
+    write_bam(bam_fn, "@SQ\tSN:chr2\tLN:1000\n");
+    const std::string gff3 =
+      "##gff-version 3\n"
+      "#description: test annotation (GENCODE 1)\n"
+      "chr1\tHAVANA\texon\t100\t200\t.\t+\t.\tID=exon:1;Parent=T1;gene_id=G1\n"
+      "chr2\tHAVANA\texon\t300\t400\t.\t-\t.\tID=exon:2;Parent=T2;gene_id=G2\n";
+    const std::vector<std::string> expected = {"chr2 G2 300-400:-1"};
+
+    const std::string fn = "test_anno.gff3";
+    {
+      std::ofstream out(fn);
+      out << gff3;
+    }
+    Mapping a;
+    a.restrict_to_bam_contigs({bam_fn});
+    a.add_annotation(fn, false);
+    expect_true(gene_lines(a.Anno) == expected);
+
+    // a tabix index only reads the blocks of the chromosomes in the header
+    const std::string gz_fn = "test_anno.gff3.gz";
+    BGZF *gz = bgzf_open(gz_fn.c_str(), "w");
+    bgzf_write(gz, gff3.data(), gff3.size());
+    bgzf_close(gz);
+    expect_true(tbx_index_build(gz_fn.c_str(), 0, &tbx_conf_gff) == 0);
+    Mapping b;
+    b.restrict_to_bam_contigs({bam_fn});
+    b.add_annotation(gz_fn, false);
+    expect_true(gene_lines(b.Anno) == expected);
+
+    std::remove(fn.c_str());
+    std::remove(gz_fn.c_str());
+    std::remove((gz_fn + ".tbi").c_str());
+    std::remove(bam_fn.c_str());
+  }
+}
+
+context("Testing read tagging") {
+  // genes of two exons every 2kb, on both chromosomes
+  const std::string bed_fn = "test_tag.bed";
+  {
+    std::ofstream bed(bed_fn);
+    bed << "name\tchr\tstart\tend\tstrand\n";
+    for (int i = 0; i < 40; i++) {
+      const std::string chr = i < 30 ? "chr1" : "chr2";
+      const int st = (i < 30 ? i : i - 30) * 2000 + 1;
+      bed << "G" << i << "\t" << chr << "\t" << st << "\t" << st + 300 << "\t+\n";
+      bed << "G" << i << "\t" << chr << "\t" << st + 800 << "\t" << st + 1000 << "\t+\n";
+    }
+  }
+
+  // coordinate sorted reads, some spliced across the region boundaries, with
+  // unmapped reads at the end
+  const std::string bam_fn = "test_tag.bam";
+  {
+    std::ostringstream sam;
+    sam << "@HD\tVN:1.6\tSO:coordinate\n@SQ\tSN:chr1\tLN:60000\n@SQ\tSN:chr2\tLN:20000\n";
+    const char *barcodes[] = {"ACGTACGT", "TTGCAAGC", "GATCGATC"};
+    for (int i = 0; i < 400; i++) {
+      const char *chr = i < 300 ? "chr1" : "chr2";
+      const int pos = (i < 300 ? i : i - 300) * 197 + 1;
+      sam << barcodes[i % 3] << "_" << (i % 2 ? "AACCGG" : "TTGGCA") << "#r" << i << "\t"
+          << (i % 2 ? 16 : 0) << "\t" << chr << "\t" << pos << "\t60\t"
+          << (i % 4 == 0 ? "20M600N30M" : "50M") << "\t*\t0\t0\t*\t*\n";
+    }
+    for (int i = 0; i < 5; i++) {
+      sam << barcodes[i % 3] << "_AACCGG#u" << i << "\t4\t*\t0\t0\t*\t*\t0\t0\t*\t*\n";
+    }
+    write_bam(bam_fn, sam.str());
+  }
+
+  test_that("Region parallel tagging writes the same reads as the serial pass") {
+    expect_true(bam_index_build(bam_fn.c_str(), 0) == 0);
+
+    Mapping serial;
+    serial.add_annotation(bed_fn, false);
+    serial.region_parallel = false;
+    serial.parse_align(bam_fn, "test_serial.bam", false, "YE", "GE", "BC", "OX", 8, "wb", "", 6, 1);
+
+    Mapping regions;
+    regions.add_annotation(bed_fn, false);
+    regions.parse_align(bam_fn, "test_regions.bam", false, "YE", "GE", "BC", "OX", 8, "wb", "", 6, 3);
+
+    const std::vector<std::string> expected = bam_records("test_serial.bam");
+    expect_true(expected.size() == 406);
+    expect_true(bam_records("test_regions.bam") == expected);
+
+    std::remove("test_serial.bam");
+    std::remove("test_regions.bam");
+    std::remove((bam_fn + ".bai").c_str());
+  }
+
+  test_that("Velocity status tells exonic, intronic and overhanging reads apart") {
+    // G0 has exons 1-301 and 801-1001, G1 starts at 2001
+    write_bam("test_velocity.bam",
+      "@SQ\tSN:chr1\tLN:60000\n@SQ\tSN:chr2\tLN:20000\n"
+      "ACGTACGT_AACCGG#exon\t0\tchr1\t51\t60\t50M\t*\t0\t0\t*\t*\n"
+      "ACGTACGT_AACCGG#junction\t0\tchr1\t242\t60\t50M520N50M\t*\t0\t0\t*\t*\n"
+      "ACGTACGT_AACCGG#junction_intron\t0\tchr1\t242\t60\t50M260N50M\t*\t0\t0\t*\t*\n"
+      "ACGTACGT_AACCGG#intron\t0\tchr1\t401\t60\t50M\t*\t0\t0\t*\t*\n"
+      "ACGTACGT_AACCGG#past_end\t0\tchr1\t961\t60\t100M\t*\t0\t0\t*\t*\n"
+      "ACGTACGT_AACCGG#intergenic\t0\tchr1\t1401\t60\t50M\t*\t0\t0\t*\t*\n"
+      "ACGTACGT_AACCGG#before_start\t0\tchr1\t1971\t60\t50M\t*\t0\t0\t*\t*\n");
+
+    Mapping a;
+    a.add_annotation(bed_fn, false);
+    a.region_parallel = false;
+    a.velocity_tag = "VS";
+    a.parse_align("test_velocity.bam", "test_velocity_out.bam", false, "YE", "GE", "BC", "OX", 8, "wb", "", 6, 1);
+
+    // read name -> gene tag and velocity tag, "-" if missing
+    std::map<std::string, std::pair<std::string, std::string>> tags;
+    BGZF *fp = bgzf_open("test_velocity_out.bam", "r");
+    bam_hdr_t *header = bam_hdr_read(fp);
+    bam1_t *b = bam_init1();
+    while (bam_read1(fp, b) >= 0) {
+      const char *ge = bam_aux2Z(bam_aux_get(b, "GE"));
+      const char *vs = bam_aux2Z(bam_aux_get(b, "VS"));
+      const std::string name = bam_get_qname(b);
+      tags[name.substr(name.find('#') + 1)] = std::make_pair(ge ? ge : "-", vs ? vs : "-");
+    }
+    bam_destroy1(b);
+    bam_hdr_destroy(header);
+    bgzf_close(fp);
+
+    expect_true(tags.size() == 7);
+    expect_true(tags["exon"] == std::make_pair(std::string("G0"), std::string("S:G0")));
+    expect_true(tags["junction"] == std::make_pair(std::string("G0"), std::string("S:G0")));
+    expect_true(tags["junction_intron"].second == "A:G0");
+    // intronic reads are not mapped to the gene, only their velocity tag names it
+    expect_true(tags["intron"] == std::make_pair(std::string("-"), std::string("U:G0")));
+    expect_true(tags["past_end"].second == "A:G0");
+    expect_true(tags["intergenic"] == std::make_pair(std::string("-"), std::string("-")));
+    expect_true(tags["before_start"].second == "A:G1");
+
+    std::remove("test_velocity.bam");
+    std::remove("test_velocity_out.bam");
+  }
+
+  // one file per batch of reads, the first batch is the largest
+  std::vector<std::string> batch_fns;
+  std::vector<std::string> batch_names;
+  for (int f = 0; f < 4; f++) {
+    std::ostringstream sam;
+    sam << "@SQ\tSN:chr1\tLN:60000\n@SQ\tSN:chr2\tLN:20000\n";
+    const int n_reads = f == 0 ? 3000 : 200;
+    for (int i = 0; i < n_reads; i++) {
+      std::ostringstream name;
+      name << "ACGTACGT_AACCGG#f" << f << "r" << i;
+      batch_names.push_back(name.str());
+      sam << name.str() << "\t0\tchr1\t" << (i * 13) % 59000 + 1 << "\t60\t50M\t*\t0\t0\t*\t*\n";
+    }
+    batch_fns.push_back("test_batch" + std::to_string(f) + ".bam");
+    write_bam(batch_fns.back(), sam.str());
+  }
+
+  test_that("Multiple bam files are merged in the order they are given") {
+    Mapping a;
+    a.add_annotation(bed_fn, false);
+    a.parse_align_warpper(batch_fns, {}, "test_merged.bam", false, "YE", "GE", "BC", "OX", 8, 6, 3);
+    expect_true(bam_read_names("test_merged.bam") == batch_names);
+
+    // without ordering the same reads are written in any order
+    Mapping b;
+    b.add_annotation(bed_fn, false);
+    b.ordered_merge = false;
+    b.parse_align_warpper(batch_fns, {}, "test_merged.bam", false, "YE", "GE", "BC", "OX", 8, 6, 3);
+    std::vector<std::string> names = bam_read_names("test_merged.bam");
+    std::vector<std::string> expected = batch_names;
+    std::sort(names.begin(), names.end());
+    std::sort(expected.begin(), expected.end());
+    expect_true(names == expected);
+    std::remove("test_merged.bam");
+  }
+
+  test_that("Bam files with different references are not merged") {
+    write_bam("test_other_refs.bam", "@SQ\tSN:chr1\tLN:60000\n@SQ\tSN:chr2\tLN:30000\n");
+    BGZF *fp = bgzf_open(batch_fns[0].c_str(), "r");
+    bam_hdr_t *header = bam_hdr_read(fp);
+    bgzf_close(fp);
+    fp = bgzf_open("test_other_refs.bam", "r");
+    bam_hdr_t *other = bam_hdr_read(fp);
+    bgzf_close(fp);
+    expect_true(Mapping::same_references(header, header));
+    expect_false(Mapping::same_references(header, other));
+    bam_hdr_destroy(other);
+    bam_hdr_destroy(header);
+
+    Mapping a;
+    a.add_annotation(bed_fn, false);
+    bool rejected = false;
+    try {
+      a.parse_align_warpper({batch_fns[0], "test_other_refs.bam"}, {}, "test_merged.bam", false, "YE", "GE", "BC", "OX", 8, 6, 2);
+    } catch (...) {
+      rejected = true;
+    }
+    expect_true(rejected);
+    std::remove("test_merged.bam");
+    std::remove("test_other_refs.bam");
+  }
+
+  for (const auto &fn : batch_fns) {
+    std::remove(fn.c_str());
+  }
+
+  std::remove(bam_fn.c_str());
+  std::remove(bed_fn.c_str());
 }
 
 /* 
@@ -140,4 +891,37 @@ context("Test UMI deduplication") {
     expect_true(UMI_dup_count[2] == 1);
     expect_true(s.corrected_UMI == 4);
   }
+
+  test_that("Reads tallied per UMI are deduplicated the same way") {
+    gene_read["GENE04"] = {std::make_pair("ATGCTAAC", 100)};
+    std::vector<int> dup_count(MAX_UMI_DUP + 1);
+    UMI_dedup_stat s1 = {};
+    std::unordered_map<std::string, int> res = UMI_dedup(gene_read, dup_count, s1, 1, true);
+
+    gene_umi_count gene_umi = count_gene_reads(gene_read);
+    expect_true(gene_umi["GENE01"][umi_pos_pair("ATGCTAAC", 100)] == 1);
+    std::vector<int> tally_dup_count(MAX_UMI_DUP + 1);
+    UMI_dedup_stat s2 = {};
+    expect_true(UMI_dedup(gene_umi, tally_dup_count, s2, 1, true) == res);
+    expect_true(tally_dup_count == dup_count);
+    expect_true(s2.filtered_gene == 1 && s1.filtered_gene == 1);
+    expect_true(s2.corrected_UMI == s1.corrected_UMI);
+  }
+
+  test_that("Directional UMI correction follows decreasing counts") {
+    std::map<umi_pos_pair, int> UMI_count;
+    UMI_count[umi_pos_pair("AAAAAAAA", 10)] = 6;
+    UMI_count[umi_pos_pair("AAAAAAAA", 12)] = 4;
+    UMI_count[umi_pos_pair("AAAAAAAC", 10)] = 4; // absorbed by AAAAAAAA, 10 >= 2 * 4 - 1
+    UMI_count[umi_pos_pair("AAAAAACC", 10)] = 2; // absorbed through AAAAAAAC, 4 >= 2 * 2 - 1
+    UMI_count[umi_pos_pair("AAAAAAAG", 20)] = 8; // too frequent to be absorbed by AAAAAAAA
+    UMI_count[umi_pos_pair("AAAAAAAN", 20)] = 1; // closer to AAAAAAAA, absorbed by it first
+    UMI_count[umi_pos_pair("TTTTTTTT", 30)] = 1;
+    int corrected = UMI_correct4(UMI_count);
+    expect_true(UMI_count.size() == 3);
+    expect_true(UMI_count[umi_pos_pair("AAAAAAAA", 10)] == 17);
+    expect_true(UMI_count[umi_pos_pair("AAAAAAAG", 20)] == 8);
+    expect_true(UMI_count[umi_pos_pair("TTTTTTTT", 30)] == 1);
+    expect_true(corrected == 4);
+  }
 }
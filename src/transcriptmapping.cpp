@@ -20,25 +20,51 @@ using namespace std::this_thread;
 using namespace std::chrono;
 using namespace Rcpp;
 
-string GeneAnnotation::get_attribute(
-    const vector<string> &all_attributes,
-    const string &target_attribute
-)
+StrView GeneAnnotation::get_attribute(
+    const vector<StrView> &all_attributes,
+    const char *target_attribute
+) const
+{
+  for (const StrView &attr : all_attributes) {
+    auto sep_loc = attr.find('=');
+    if (sep_loc == string::npos)
+    {
+      continue;
+    }
+    // compare key, return value
+    if (attr.substr(0, sep_loc) == target_attribute) {
+      return attr.substr(sep_loc + 1);
+    }
+  }
+  return StrView();
+}
+
+StrView GeneAnnotation::get_gtf_attribute(
+    const vector<StrView> &all_attributes,
+    const char *target_attribute
+) const
 {
-  for (const string &attr : all_attributes) {
-    auto sep_loc = attr.find("=");
-    // get key
-    const string key = attr.substr(0, sep_loc);
-    // get value
-    const string val = attr.substr(sep_loc + 1);
-    if (key == target_attribute) {
+  // gtf attributes are `key "value"` pairs separated by semicolons
+  for (const StrView &raw_attr : all_attributes) {
+    const StrView attr = raw_attr.trim();
+    auto sep_loc = attr.find(' ');
+    if (sep_loc == string::npos)
+    {
+      continue;
+    }
+    if (attr.substr(0, sep_loc) == target_attribute) {
+      StrView val = attr.substr(sep_loc + 1).trim();
+      if (val.size() >= 2 && val[0] == '"' && val[val.size() - 1] == '"')
+      {
+        val = val.substr(1, val.size() - 2);
+      }
       return val;
     }
   }
-  return "";
+  return StrView();
 }
 
-int GeneAnnotation::get_strand(char st)
+int GeneAnnotation::get_strand(char st) const
 {
   int strand = 0;
   if (st == '+')
@@ -52,14 +78,14 @@ int GeneAnnotation::get_strand(char st)
   return strand;
 }
 
-string GeneAnnotation::get_ID(const vector<string> &attributes)
+StrView GeneAnnotation::get_ID(const vector<StrView> &attributes) const
 {
   for (const auto &attr : attributes)
   {
-    if (attr.substr(0, 2) == "ID")
+    if (attr.starts_with("ID"))
     {
       // check for ENSEMBL notation
-      if (anno_source == "ensembl")
+      if (anno_source == "ensembl" && attr.rfind(':') != string::npos)
       {
         return attr.substr(attr.rfind(':') + 1);
       }
@@ -69,17 +95,17 @@ string GeneAnnotation::get_ID(const vector<string> &attributes)
       }
     }
   }
-  return "";
+  return StrView();
 }
 
-const string GeneAnnotation::get_parent(const vector<string> &attributes)
+StrView GeneAnnotation::get_parent(const vector<StrView> &attributes) const
 {
   for (const auto &attr : attributes)
   {
-    if (attr.substr(0, 6) == "Parent")
+    if (attr.starts_with("Parent"))
     {
       // check for ENSEMBL notation
-      if (anno_source == "ensembl")
+      if (anno_source == "ensembl" && attr.rfind(':') != string::npos)
       {
         return attr.substr(attr.rfind(':') + 1);
       }
@@ -89,10 +115,10 @@ const string GeneAnnotation::get_parent(const vector<string> &attributes)
       }
     }
   }
-  return "";
+  return StrView();
 }
 
-string GeneAnnotation::fix_name(string chr_name)
+string GeneAnnotation::fix_name(string chr_name) const
 {
   string new_chr_name;
   if (chr_name.compare(0, 3, "chr") == 0)
@@ -117,7 +143,7 @@ string GeneAnnotation::fix_name(string chr_name)
   }
 }
 
-string GeneAnnotation::get_gene_id(const vector<string> &attributes)
+StrView GeneAnnotation::get_gene_id(const vector<StrView> &attributes) const
 {
   if (anno_source == "gencode")
   {
@@ -127,115 +153,314 @@ string GeneAnnotation::get_gene_id(const vector<string> &attributes)
   {
     return get_refseq_gene_id(attributes);
   }
-  return "";
+  return StrView();
 }
 
-string GeneAnnotation::get_gencode_gene_id(const vector<string> &attributes)
+StrView GeneAnnotation::get_gencode_gene_id(const vector<StrView> &attributes) const
 {
   return get_attribute(attributes, "gene_id");
 }
 
-string GeneAnnotation::get_refseq_gene_id(const vector<string> &attributes)
+StrView GeneAnnotation::get_refseq_gene_id(const vector<StrView> &attributes) const
 {
-  string dbxref = get_attribute(attributes, "Dbxref");
+  StrView dbxref = get_attribute(attributes, "Dbxref");
   
   // GeneID may be missing
-  if (dbxref.find("GeneID") == string::npos)
+  auto start = dbxref.find("GeneID");
+  if (start == string::npos)
   {
-    return "";
+    return StrView();
   }
   
-  auto start = dbxref.find("GeneID") + 7; // start after "GeneID:"
-  auto end = dbxref.find(",", start);
-  auto id_length = end - start;
+  start += 7; // start after "GeneID:"
+  auto end = dbxref.find(',', start);
+  auto id_length = (end == string::npos) ? string::npos : end - start;
   
   return dbxref.substr(start, id_length);
 }
 
-void GeneAnnotation::parse_anno_entry(
-    const bool &fix_chrname,
-    const string &line,
-    unordered_map<string, unordered_map<string, Gene>> &chr_to_genes_dict,
-    unordered_map<string, string> &transcript_to_gene_dict
-)
+bool GeneAnnotation::is_gene(const vector<StrView> &fields, const vector<StrView> &attributes) const
 {
-  const vector<string> fields = split(line, '\t');
-  const vector<string> attributes = split(fields[ATTRIBUTES], ';');
+  if (fields[TYPE].find("gene") != string::npos)
+  {
+    return true;
+  }
   
-  string chr_name = fields[SEQID];
-  const string parent = get_parent(attributes);
-  const string type = fields[TYPE];
-  const string ID = get_ID(attributes);
-  const int strand = get_strand(fields[STRAND][0]);
-  const int interval_start = atoi(fields[START].c_str());
-  const int interval_end = atoi(fields[END].c_str());
+  if (get_attribute(attributes, "ID").find("gene:") != string::npos)
+  {
+    return true;
+  }
   
+  return false;
+}
+
+bool GeneAnnotation::keep_contig(const StrView &chr, bool fix_chrname) const
+{
+  if (contig_filter.empty())
+  {
+    return true;
+  }
+  string chr_name = chr.str();
   if (fix_chrname)
   {
     chr_name = fix_name(chr_name);
   }
+  return contig_filter.find(chr_name) != contig_filter.end();
+}
+
+void GeneAnnotation::parse_anno_chunk(const StrView &chunk, AnnoFormat format, bool fix_chrname, AnnoChunk &records) const
+{
+  vector<StrView> fields;
+  vector<StrView> attributes;
+  StrView line;
+  size_t offset = 0;
   
-  // DEBUG USE
-  // Rcout << "Parsing: " << line << "\n";
-  // Rcout << "Type: " << type << " "
-  //       << "ID: " << ID << " "
-  //       << "Parent: " << parent << "\n\n";
-  // DEBUG USE
+  // annotations are grouped by contig, so remember the last decision
+  StrView last_chr;
+  bool last_keep = true;
   
-  string target_gene;
-  if (anno_source == "ensembl")
+  while (next_line(chunk, offset, line))
   {
-    if (is_exon(fields, attributes))
+    // skip header and empty lines
+    if (line.empty() || line[0] == '#')
+    {
+      continue;
+    }
+    
+    if (format != BED && !contig_filter.empty())
     {
-      if (parent_is_known_transcript(transcript_to_gene_dict, parent))
+      // check the contig before tokenising the rest of the line
+      const StrView chr = line.substr(0, line.find('\t'));
+      if (last_chr.ptr == nullptr || chr != last_chr)
       {
-        target_gene = transcript_to_gene_dict[parent];
+        last_chr = chr;
+        last_keep = keep_contig(chr, fix_chrname);
       }
-      else
+      if (!last_keep)
       {
-        stringstream err_msg;
-        err_msg << "cannot find grandparent for exon:" << "\n";
-        err_msg << line << "\n";
-        stop(err_msg.str());
+        continue;
       }
     }
-    else if (is_transcript(fields, attributes))
+    
+    split_view(line, '\t', fields);
+    
+    if (format == BED)
     {
-      if (!ID.empty() && !parent.empty())
+      if (fields.size() < 5)
       {
-        transcript_to_gene_dict[ID] = parent;
+        continue;
       }
-      return;
+      if (!contig_filter.empty())
+      {
+        if (last_chr.ptr == nullptr || fields[1] != last_chr)
+        {
+          last_chr = fields[1];
+          last_keep = keep_contig(fields[1], fix_chrname);
+        }
+        if (!last_keep)
+        {
+          continue;
+        }
+      }
+      // columns: gene id, chromosome, start, end, strand
+      records.exons.push_back({
+        fields[1], fields[0], line,
+        Interval((int)fields[2].to_long(), (int)fields[3].to_long(), get_strand(fields[4][0]))
+      });
+      continue;
     }
-    else if (is_gene(fields, attributes)) {
-      recorded_genes.insert(ID);
-      return;
+    
+    if ((int)fields.size() <= ATTRIBUTES)
+    {
+      continue;
+    }
+    
+    const StrView &type = fields[TYPE];
+    split_view(fields[ATTRIBUTES], ';', attributes);
+    const Interval it(
+      (int)fields[START].to_long(),
+      (int)fields[END].to_long(),
+      get_strand(fields[STRAND].empty() ? '.' : fields[STRAND][0])
+    );
+    
+    if (format == GTF)
+    {
+      if (type == "exon")
+      {
+        const StrView gene_id = get_gtf_attribute(attributes, "gene_id");
+        if (!gene_id.empty())
+        {
+          records.exons.push_back({fields[SEQID], gene_id, line, it});
+        }
+      }
+    }
+    else if (anno_source == "ensembl")
+    {
+      // exons refer to transcripts, which refer to genes. the hierarchy is
+      // resolved after all chunks are parsed, so the order of lines does not matter
+      if (type == "exon")
+      {
+        records.exons.push_back({fields[SEQID], get_parent(attributes), line, it});
+      }
+      else
+      {
+        const StrView ID = get_ID(attributes);
+        const StrView parent = get_parent(attributes);
+        if (!ID.empty() && !parent.empty())
+        {
+          records.transcripts.push_back(std::make_pair(ID, parent));
+        }
+        if (is_gene(fields, attributes))
+        {
+          records.genes.push_back(ID);
+        }
+      }
+    }
+    else if (anno_source == "gencode" || anno_source == "refseq")
+    {
+      if (type == "exon")
+      {
+        const StrView gene_id = get_gene_id(attributes);
+        if (!gene_id.empty())
+        {
+          records.exons.push_back({fields[SEQID], gene_id, line, it});
+        }
+      }
     }
   }
-  else if (anno_source == "gencode" || anno_source == "refseq")
+}
+
+void GeneAnnotation::parse_chunks(const StrView &content, AnnoFormat format, bool fix_chrname, int nthreads)
+{
+  // split the file into line aligned chunks and tokenise each chunk on its own thread.
+  // the chunk records only hold views into `content`, strings are created at merge time.
+  const vector<StrView> pieces = line_aligned_chunks(content, std::max(nthreads, 1));
+  vector<AnnoChunk> chunks(pieces.size());
+  
+  vector<thread> workers;
+  for (size_t i = 1; i < pieces.size(); i++)
+  {
+    workers.emplace_back([&, i]() { parse_anno_chunk(pieces[i], format, fix_chrname, chunks[i]); });
+  }
+  if (!pieces.empty())
+  {
+    parse_anno_chunk(pieces[0], format, fix_chrname, chunks[0]);
+  }
+  for (auto &w : workers)
   {
-    if (type == "exon")
+    w.join();
+  }
+  checkUserInterrupt();
+  
+  // ENSEMBL gff3: map transcripts to genes once all genes are known
+  unordered_map<string, string> transcript_to_gene_dict;
+  if (format == GFF3 && anno_source == "ensembl")
+  {
+    for (const auto &chunk : chunks)
+    {
+      for (const auto &gene : chunk.genes)
+      {
+        recorded_genes.insert(gene.str());
+      }
+    }
+    string parent_key;
+    for (const auto &chunk : chunks)
     {
-      target_gene = get_gene_id(attributes);
+      for (const auto &tx : chunk.transcripts)
+      {
+        parent_key.assign(tx.second.ptr, tx.second.len);
+        if (recorded_genes.find(parent_key) != recorded_genes.end())
+        {
+          transcript_to_gene_dict[tx.first.str()] = parent_key;
+        }
+      }
     }
   }
   
-  if (!target_gene.empty())
+  // merge the exons of every chunk, in file order
+  unordered_map<string, unordered_map<string, Gene>> chr_to_genes_dict;
+  unordered_map<string, Gene> *current_chr = nullptr;
+  StrView last_chr;
+  string chr_key;
+  string gene_key;
+  for (const auto &chunk : chunks)
   {
-    auto &current_chr = chr_to_genes_dict[chr_name];
-    current_chr[target_gene].add_exon(Interval(interval_start, interval_end, strand));
-    current_chr[target_gene].set_ID(target_gene);
+    for (const auto &exon : chunk.exons)
+    {
+      if (current_chr == nullptr || exon.chr != last_chr)
+      {
+        chr_key = exon.chr.str();
+        if (fix_chrname)
+        {
+          chr_key = fix_name(chr_key);
+        }
+        current_chr = &chr_to_genes_dict[chr_key];
+        last_chr = exon.chr;
+      }
+      
+      gene_key.assign(exon.target.ptr, exon.target.len);
+      if (format == GFF3 && anno_source == "ensembl")
+      {
+        auto tx = transcript_to_gene_dict.find(gene_key);
+        if (tx == transcript_to_gene_dict.end())
+        {
+          stringstream err_msg;
+          err_msg << "cannot find grandparent for exon:" << "\n";
+          err_msg << exon.line.str() << "\n";
+          stop(err_msg.str());
+        }
+        gene_key = tx->second;
+      }
+      
+      Gene &gene = (*current_chr)[gene_key];
+      gene.add_exon(exon.it);
+      if (gene.gene_id.empty())
+      {
+        gene.set_ID(gene_key);
+      }
+    }
   }
   
-  return;
+  add_genes(chr_to_genes_dict);
+}
+
+void GeneAnnotation::add_genes(unordered_map<string, unordered_map<string, Gene>> &chr_to_genes_dict)
+{
+  // push genes into annotation class member
+  for (auto &chr : chr_to_genes_dict)
+  {
+    const auto &chr_name = chr.first;
+    auto &current_genes = gene_dict[chr_name];
+    
+    // merge overlapping exons in each gene
+    for (auto &gene : chr.second)
+    {
+      gene.second.sort_exon();
+      gene.second.flatten_exon();
+      current_genes.push_back(gene.second);
+    }
+    
+    // sort genes based on starting position
+    sort(current_genes.begin(), current_genes.end(),
+         [] (const Gene &g1, const Gene &g2) { return g1.st < g2.st; }
+    );
+    
+    // create bins of genes, rebuilt from scratch in case an earlier
+    // annotation file already added genes to this chromosome
+    auto &bins = bins_dict[chr_name];
+    bins.gene_bins.clear();
+    bins.make_bins(current_genes);
+    // lookup tables refer to genes by index, drop them until they are rebuilt
+    runs_dict.erase(chr_name);
+  }
 }
 
-string GeneAnnotation::guess_anno_source(string gff3_fn)
+string GeneAnnotation::guess_anno_source(const StrView &content)
 {
-  ifstream infile(gff3_fn);
-  string line;
+  StrView line;
+  size_t offset = 0;
   
-  while (getline(infile, line))
+  while (next_line(content, offset, line))
   {
     if (line.find("GENCODE") != string::npos) {
       Rcout << "guessing annotation source: GENCODE" << "\n";
@@ -257,141 +482,104 @@ string GeneAnnotation::guess_anno_source(string gff3_fn)
   return "ensembl";
 }
 
-const bool GeneAnnotation::parent_is_gene(const string &parent)
-{
-  return recorded_genes.find(parent) != recorded_genes.end();
-}
-
-const bool GeneAnnotation::parent_is_known_transcript(const unordered_map<string, string> &transcript_to_gene_dict, const string &parent)
-{
-  return transcript_to_gene_dict.find(parent) != transcript_to_gene_dict.end();
-}
-
-const bool GeneAnnotation::is_gene(const vector<string> &fields, const vector<string> &attributes)
+bool GeneAnnotation::read_indexed_contigs(const string &fn, bool fix_chrname, string &content) const
 {
-  string type = fields[TYPE];
-  if (type.find("gene") != string::npos)
+  if (contig_filter.empty())
   {
-    return true;
+    return false;
   }
-  
-  string id = get_attribute(attributes, "ID");
-  if (id.find("gene:") != string::npos)
+  if (!ifstream(fn + ".tbi").good() && !ifstream(fn + ".csi").good())
   {
-    return true;
+    return false;
   }
   
-  return false;
-}
-
-const bool GeneAnnotation::is_exon(const vector<string> &fields, const vector<string> &attributes)
-{
-  return fields[TYPE] == "exon";
-}
-
-const bool GeneAnnotation::is_transcript(const vector<string> &fields, const vector<string> &attributes)
-{
-  // assume feature is transcript is it has a gene as parent
-  return parent_is_gene(get_parent(attributes));
-}
-
-void GeneAnnotation::parse_gff3_annotation(string gff3_fn, bool fix_chrname)
-{
-  ifstream infile(gff3_fn);
+  tbx_t *tbx = tbx_index_load(fn.c_str());
+  htsFile *fp = hts_open(fn.c_str(), "r");
+  if (!tbx || !fp)
+  {
+    if (tbx) tbx_destroy(tbx);
+    if (fp) hts_close(fp);
+    return false;
+  }
   
-  string line;
-  unordered_map<string, unordered_map<string, Gene>> chr_to_genes_dict;
-  unordered_map<string, string> transcript_to_gene_dict; // store transcript - gene mapping
+  kstring_t str = {0, 0, NULL};
+  content.clear();
   
-  // assigned to class member
-  anno_source = guess_anno_source(gff3_fn);
+  // the header lines are needed to guess the annotation source
+  while (hts_getline(fp, KS_SEP_LINE, &str) >= 0 && str.l > 0 && str.s[0] == '#')
+  {
+    content.append(str.s, str.l);
+    content.push_back('\n');
+  }
   
-  size_t _interrupt_ind = 0;
-  // create transcript-gene mapping
-  while (getline(infile, line))
+  // jump straight to the blocks of the contigs we need
+  int n_seq = 0;
+  const char **seq_names = tbx_seqnames(tbx, &n_seq);
+  int n_loaded = 0;
+  for (int i = 0; i < n_seq; i++)
   {
-    if (++_interrupt_ind % 256 == 0) checkUserInterrupt();
-    // skip header lines
-    if (line[0] == '#')
+    if (!keep_contig(StrView(seq_names[i], strlen(seq_names[i])), fix_chrname))
     {
       continue;
     }
-    
-    parse_anno_entry(fix_chrname, line, chr_to_genes_dict, transcript_to_gene_dict);
-  }
-  
-  // push genes into annotation class member
-  for (auto &chr : chr_to_genes_dict)
-  {
-    const auto &chr_name = chr.first;
-    
-    // merge overlapping exons in each gene
-    for (auto &gene : chr.second)
+    hts_itr_t *itr = tbx_itr_querys(tbx, seq_names[i]);
+    if (!itr)
     {
-      gene.second.sort_exon();
-      gene.second.flatten_exon();
-      gene_dict[chr_name].push_back(gene.second);
+      continue;
     }
-    
-    auto &current_genes = gene_dict[chr_name];
-    // sort genes based on starting position
-    sort(current_genes.begin(), current_genes.end(),
-         [] (const Gene &g1, const Gene &g2) { return g1.st < g2.st; }
-    );
-    
-    // create bins of genes
-    bins_dict[chr_name].make_bins(current_genes);
+    while (tbx_itr_next(fp, tbx, itr, &str) >= 0)
+    {
+      content.append(str.s, str.l);
+      content.push_back('\n');
+    }
+    hts_itr_destroy(itr);
+    n_loaded++;
   }
+  Rcout << "read " << n_loaded << " of " << n_seq << " contigs through index: " << fn << "\n";
+  
+  free(seq_names);
+  free(str.s);
+  hts_close(fp);
+  tbx_destroy(tbx);
+  return true;
 }
 
-void GeneAnnotation::parse_bed_annotation(string bed_fn, bool fix_chrname)
+void GeneAnnotation::parse_gff3_annotation(string gff3_fn, bool fix_chrname, int nthreads)
 {
-  ifstream infile(bed_fn);
-  
-  string line;
-  unordered_map<string, unordered_map<string, Gene>> tmp_gene_dict;
-  int strand = 0;
-  vector<string> token;
-  
-  getline(infile, line); // skip the header
-  while(getline(infile, line))
+  string content;
+  if (!read_indexed_contigs(gff3_fn, fix_chrname, content))
   {
-    token = split(line, '\t');
-    strand = get_strand(token[4][0]);
-    if (fix_chrname)
-    {
-      tmp_gene_dict[fix_name(token[1])][token[0]].add_exon(Interval(atoi(token[2].c_str()), atoi(token[3].c_str()), strand));
-      tmp_gene_dict[fix_name(token[1])][token[0]].set_ID(token[1]);
-    }
-    else
-    {
-      tmp_gene_dict[token[1]][token[0]].add_exon(Interval(atoi(token[2].c_str()), atoi(token[3].c_str()), strand));
-      tmp_gene_dict[token[1]][token[0]].set_ID(token[1]);
-    }
-    
+    content = read_text_file(gff3_fn);
   }
   
-  for (auto iter : tmp_gene_dict)
+  // assigned to class member
+  anno_source = guess_anno_source(StrView(content));
+  
+  parse_chunks(StrView(content), GFF3, fix_chrname, nthreads);
+}
+
+void GeneAnnotation::parse_gtf_annotation(string gtf_fn, bool fix_chrname, int nthreads)
+{
+  string content;
+  if (!read_indexed_contigs(gtf_fn, fix_chrname, content))
   {
-    for (auto sub_iter : iter.second)
-    {
-      if (sub_iter.second.exon_vec.size()>1)
-      {
-        sub_iter.second.sort_exon();
-        sub_iter.second.flatten_exon();
-      }
-      gene_dict[iter.first].push_back(sub_iter.second);
-    }
-    if (gene_dict[iter.first].size()>1)
-    {
-      sort(gene_dict[iter.first].begin(), gene_dict[iter.first].end(),
-           [] (const Gene &g1, const Gene &g2) { return g1.st < g2.st; }
-      );
-    }
-    
-    // create bins of genes
-    bins_dict[iter.first].make_bins(gene_dict[iter.first]);
+    content = read_text_file(gtf_fn);
   }
+  parse_chunks(StrView(content), GTF, fix_chrname, nthreads);
+}
+
+void GeneAnnotation::parse_bed_annotation(string bed_fn, bool fix_chrname, int nthreads)
+{
+  const string content = read_text_file(bed_fn);
+  
+  // skip the header
+  StrView body(content);
+  size_t offset = 0;
+  StrView header;
+  next_line(body, offset, header);
+  body = body.substr(offset);
+  
+  parse_chunks(body, BED, fix_chrname, nthreads);
 }
 
 void GeneAnnotation::parse_saf_dataframe(DataFrame anno_df, bool fix_chrname)
@@ -409,8 +597,12 @@ void GeneAnnotation::parse_saf_dataframe(DataFrame anno_df, bool fix_chrname)
   unordered_map<Chr, unordered_map<GeneID, Gene>> tmp_gene_dict;
   for (int i = 0; i < n_entries; i++)
   {
-    std::string const &gene_id = as<std::string>(gene_ids[i]);
     std::string const &chr = as<std::string>(chrs[i]);
+    if (!keep_contig(StrView(chr), fix_chrname))
+    {
+      continue;
+    }
+    std::string const &gene_id = as<std::string>(gene_ids[i]);
     int start = starts[i];
     int end = ends[i];
     int const &strand = strands[i] == "+" ? 1 :
@@ -429,27 +621,7 @@ void GeneAnnotation::parse_saf_dataframe(DataFrame anno_df, bool fix_chrname)
     
   }
   
-  for (auto iter : tmp_gene_dict)
-  {
-    for (auto sub_iter : iter.second)
-    {
-      if (sub_iter.second.exon_vec.size()>1)
-      {
-        sub_iter.second.sort_exon();
-        sub_iter.second.flatten_exon();
-      }
-      gene_dict[iter.first].push_back(sub_iter.second);
-    }
-    if (gene_dict[iter.first].size()>1)
-    {
-      sort(gene_dict[iter.first].begin(), gene_dict[iter.first].end(),
-           [] (const Gene &g1, const Gene &g2) { return g1.st < g2.st; }
-      );
-    }
-    
-    // create bins of genes
-    bins_dict[iter.first].make_bins(gene_dict[iter.first]);
-  }
+  add_genes(tmp_gene_dict);
 }
 
 int GeneAnnotation::ngenes()
@@ -499,41 +671,603 @@ ostream& operator<< (ostream& out, const GeneAnnotation& obj)
 }
 
 
-void Mapping::add_annotation(string gff3_fn, bool fix_chrname)
+void FeatureRuns::build(const vector<Gene> &genes)
 {
-  if (gff3_fn.substr(gff3_fn.find_last_of(".")) == ".gff3" ||
-      gff3_fn.substr(gff3_fn.find_last_of(".")) == ".gff")
+  run_st.clear();
+  run_feature.clear();
+  feature_offset.assign(2, 0); // feature set 0 is empty
+  entries.clear();
+  
+  // boundaries are inclusive, so a feature [st, en] covers st to en and ends at en + 1.
+  // event: (position, gene index, +1/-1 for gene, +2/-2 for exon)
+  struct Event { int pos; unsigned int gene; int delta; };
+  vector<Event> events;
+  for (unsigned int i = 0; i < genes.size(); i++)
   {
-    Rcout << "adding gff3 annotation: " << gff3_fn << "\n";
-    Anno.parse_gff3_annotation(gff3_fn, fix_chrname);
+    events.push_back({genes[i].st, i, 1});
+    events.push_back({genes[i].en + 1, i, -1});
+    for (const auto &exon : genes[i].exon_vec)
+    {
+      events.push_back({exon.st, i, 2});
+      events.push_back({exon.en + 1, i, -2});
+    }
   }
-  else
+  sort(events.begin(), events.end(), [] (const Event &a, const Event &b) { return a.pos < b.pos; });
+  
+  // gene index -> (gene depth, exon depth), ordered to give canonical feature sets
+  std::map<unsigned int, std::pair<int, int>> active;
+  std::map<vector<unsigned int>, unsigned int> feature_ids;
+  feature_ids[vector<unsigned int>()] = 0;
+  vector<unsigned int> feature;
+  
+  for (size_t i = 0; i < events.size(); )
   {
-    Anno.parse_bed_annotation(gff3_fn, fix_chrname);
-    Rcout << "adding bed annotation: " << gff3_fn << "\n";
+    int pos = events[i].pos;
+    for (; i < events.size() && events[i].pos == pos; i++)
+    {
+      auto &depth = active[events[i].gene];
+      if (events[i].delta == 1 || events[i].delta == -1)
+      {
+        depth.first += events[i].delta;
+      }
+      else
+      {
+        depth.second += events[i].delta / 2;
+      }
+      if (depth.first <= 0 && depth.second <= 0)
+      {
+        active.erase(events[i].gene);
+      }
+    }
+    
+    feature.clear();
+    for (const auto &g : active)
+    {
+      feature.push_back(g.first << 1 | (g.second.second > 0 ? 1 : 0));
+    }
+    auto id = feature_ids.find(feature);
+    if (id == feature_ids.end())
+    {
+      id = feature_ids.insert({feature, feature_offset.size() - 1}).first;
+      entries.insert(entries.end(), feature.begin(), feature.end());
+      feature_offset.push_back(entries.size());
+    }
+    // merge with the previous run if nothing changed
+    if (run_feature.empty() || run_feature.back() != id->second)
+    {
+      run_st.push_back(pos);
+      run_feature.push_back(id->second);
+    }
   }
 }
 
-void Mapping::add_annotation(DataFrame anno, bool fix_chrname)
-{
-  Anno.parse_saf_dataframe(anno, fix_chrname);
-}
-
-int Mapping::map_exon(bam_hdr_t *header, bam1_t *b, string& gene_id, bool m_strand)
+void FeatureRuns::query(const Interval &it, vector<std::pair<unsigned int, bool>> &hits) const
 {
-  int ret = 9999;
-  int rev = bam_is_rev(b)?(-1):1;
-  uint32_t* cig = bam_get_cigar(b);
+  hits.clear();
+  // first run containing it.st, or the first run if it.st is before all features
+  auto k = std::upper_bound(run_st.begin(), run_st.end(), it.st) - run_st.begin();
+  if (k > 0) k--;
+  for (; k < (long)run_st.size() && run_st[k] <= it.en; k++)
+  {
+    unsigned int f = run_feature[k];
+    for (unsigned int e = feature_offset[f]; e < feature_offset[f + 1]; e++)
+    {
+      unsigned int gene = entries[e] >> 1;
+      bool exon = entries[e] & 1;
+      // hits are sorted by gene, blocks usually cover only one or two runs
+      auto h = std::lower_bound(hits.begin(), hits.end(), std::make_pair(gene, false),
+        [] (const std::pair<unsigned int, bool> &a, const std::pair<unsigned int, bool> &b) { return a.first < b.first; });
+      if (h != hits.end() && h->first == gene)
+      {
+        h->second = h->second || exon;
+      }
+      else
+      {
+        hits.insert(h, std::make_pair(gene, exon));
+      }
+    }
+  }
+}
+
+size_t FeatureRuns::memory_usage() const
+{
+  return run_st.size() * sizeof(int) + run_feature.size() * sizeof(unsigned int) +
+    feature_offset.size() * sizeof(unsigned int) + entries.size() * sizeof(unsigned int);
+}
+
+void GeneAnnotation::build_feature_runs(const vector<string> &chrs)
+{
+  for (auto &chr : gene_dict)
+  {
+    if (chrs.empty() || std::find(chrs.begin(), chrs.end(), chr.first) != chrs.end())
+    {
+      runs_dict[chr.first].build(chr.second);
+    }
+  }
+}
+
+AnnoCursor::AnnoCursor(const GeneAnnotation &anno) : anno(anno)
+{
+}
+
+bool AnnoCursor::seek(const bam_hdr_t *header, int tid, int pos)
+{
+  if (tid == cur_tid)
+  {
+    if (pos < cur_pos)
+    {
+      fallbacks++;
+      return false;
+    }
+  }
+  else
+  {
+    if ((int)visited.size() < header->n_targets)
+    {
+      visited.resize(header->n_targets, false);
+    }
+    // coming back to a chromosome means the input is not sorted
+    if (visited[tid])
+    {
+      fallbacks++;
+      return false;
+    }
+    visited[tid] = true;
+    cur_tid = tid;
+    auto genes_it = anno.gene_dict.find(header->target_name[tid]);
+    genes = genes_it == anno.gene_dict.end() ? NULL : &genes_it->second;
+    next_gene = 0;
+    active.clear();
+  }
+  cur_pos = pos;
+  
+  // genes ending before the read cannot overlap this or any later read
+  active.erase(
+    std::remove_if(active.begin(), active.end(), [pos](const Gene *g) { return g->en < pos; }),
+    active.end()
+  );
+  return true;
+}
+
+void AnnoCursor::overlapping(const Interval &it, vector<const Gene*> &matched_genes)
+{
+  if (!genes)
+  {
+    return;
+  }
+  // genes are sorted by start, admit every gene starting before the end of the block
+  while (next_gene < genes->size() && (*genes)[next_gene].st <= it.en)
+  {
+    const Gene &g = (*genes)[next_gene++];
+    if (g.en >= cur_pos)
+    {
+      active.push_back(&g);
+    }
+  }
+  for (const Gene *g : active)
+  {
+    if (*g == it)
+    {
+      matched_genes.push_back(g);
+    }
+  }
+}
+
+namespace {
+// splitmix64 finaliser
+inline uint64_t mix64(uint64_t x)
+{
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+}
+
+void AlignmentCache::reset(size_t n)
+{
+  size_t size = 0;
+  if (n > 0)
+  {
+    size = 1;
+    while (size < n) size <<= 1;
+  }
+  if (size != n_slots)
+  {
+    slots.reset(size > 0 ? new Slot[size] : NULL);
+    n_slots = size;
+  }
+  else
+  {
+    for (size_t i = 0; i < n_slots; i++)
+    {
+      slots[i].check.store(0, std::memory_order_relaxed);
+      slots[i].value.store(0, std::memory_order_relaxed);
+    }
+  }
+  for (Counter &c : counters)
+  {
+    c.hits = 0;
+    c.misses = 0;
+  }
+  hit_ns = 0;
+  hit_samples = 0;
+  miss_ns = 0;
+  miss_samples = 0;
+}
+
+uint64_t AlignmentCache::footprint(const bam1_t *b, bool m_strand)
+{
+  uint64_t h = mix64(((uint64_t)(uint32_t)b->core.tid << 32) | (uint32_t)b->core.pos);
+  h = mix64(h + (bam_is_rev(b) ? 2 : 0) + (m_strand ? 1 : 0));
+  const uint32_t *cig = bam_get_cigar(b);
+  for (uint32_t c = 0; c < b->core.n_cigar; c++)
+  {
+    h = mix64(h + cig[c]);
+  }
+  return h ? h : 1;
+}
+
+bool AlignmentCache::get(uint64_t key, int &ret, int &gene_idx) const
+{
+  const Slot &slot = slots[key & (n_slots - 1)];
+  uint64_t value = slot.value.load(std::memory_order_relaxed);
+  if ((slot.check.load(std::memory_order_relaxed) ^ value) != key)
+  {
+    return false;
+  }
+  ret = (int32_t)(uint32_t)(value >> 32);
+  gene_idx = (int32_t)(uint32_t)value;
+  return true;
+}
+
+void AlignmentCache::put(uint64_t key, int ret, int gene_idx)
+{
+  Slot &slot = slots[key & (n_slots - 1)];
+  uint64_t value = ((uint64_t)(uint32_t)ret << 32) | (uint32_t)gene_idx;
+  slot.value.store(value, std::memory_order_relaxed);
+  slot.check.store(key ^ value, std::memory_order_relaxed);
+}
+
+AlignmentCache::Counter &AlignmentCache::thread_counter()
+{
+  static atomic<size_t> next_thread{0};
+  thread_local size_t thread_idx = next_thread++ % n_counters;
+  return counters[thread_idx];
+}
+
+void AlignmentCache::count(bool hit)
+{
+  Counter &c = thread_counter();
+  if (hit)
+  {
+    c.hits.fetch_add(1, std::memory_order_relaxed);
+  }
+  else
+  {
+    c.misses.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+unsigned long long AlignmentCache::hits() const
+{
+  unsigned long long n = 0;
+  for (const Counter &c : counters)
+  {
+    n += c.hits;
+  }
+  return n;
+}
+
+unsigned long long AlignmentCache::misses() const
+{
+  unsigned long long n = 0;
+  for (const Counter &c : counters)
+  {
+    n += c.misses;
+  }
+  return n;
+}
+
+bool AlignmentCache::sample_lookup()
+{
+  const Counter &c = thread_counter();
+  return (c.hits.load(std::memory_order_relaxed) + c.misses.load(std::memory_order_relaxed)) % 64 == 0;
+}
+
+void AlignmentCache::add_sample(bool hit, unsigned long long ns)
+{
+  if (hit)
+  {
+    hit_ns += ns;
+    hit_samples++;
+  }
+  else
+  {
+    miss_ns += ns;
+    miss_samples++;
+  }
+}
+
+double AlignmentCache::seconds_saved() const
+{
+  if (hit_samples == 0 || miss_samples == 0)
+  {
+    return 0;
+  }
+  double saved_ns = (double)miss_ns / miss_samples - (double)hit_ns / hit_samples;
+  return std::max(saved_ns, 0.) * hits() / 1e9;
+}
+
+void Mapping::add_annotation(string gff3_fn, bool fix_chrname, int nthreads)
+{
+  // compressed annotations are read directly, the format is given by the inner extension
+  string fn = gff3_fn;
+  if (fn.size() > 3 && fn.compare(fn.size() - 3, 3, ".gz") == 0)
+  {
+    fn = fn.substr(0, fn.size() - 3);
+  }
+  auto ext_pos = fn.find_last_of(".");
+  const string ext = (ext_pos == string::npos) ? "" : fn.substr(ext_pos);
+  
+  if (ext == ".gff3" || ext == ".gff")
+  {
+    Rcout << "adding gff3 annotation: " << gff3_fn << "\n";
+    Anno.parse_gff3_annotation(gff3_fn, fix_chrname, nthreads);
+  }
+  else if (ext == ".gtf")
+  {
+    Rcout << "adding gtf annotation: " << gff3_fn << "\n";
+    Anno.parse_gtf_annotation(gff3_fn, fix_chrname, nthreads);
+  }
+  else
+  {
+    Anno.parse_bed_annotation(gff3_fn, fix_chrname, nthreads);
+    Rcout << "adding bed annotation: " << gff3_fn << "\n";
+  }
+}
+
+void Mapping::add_annotation(DataFrame anno, bool fix_chrname)
+{
+  Anno.parse_saf_dataframe(anno, fix_chrname);
+}
+
+void Mapping::restrict_to_bam_contigs(const vector<string> &bam_fns)
+{
+  for (const auto &fn : bam_fns)
+  {
+    check_file_exists(fn);
+    BGZF *fp = bgzf_open(fn.c_str(), "r");
+    bam_hdr_t *header = fp ? bam_hdr_read(fp) : NULL;
+    if (!header)
+    {
+      if (fp) bgzf_close(fp);
+      stop("fail to read the bam header: " + fn + "\n");
+    }
+    for (int i = 0; i < header->n_targets; ++i)
+    {
+      Anno.contig_filter.insert(header->target_name[i]);
+    }
+    bam_hdr_destroy(header);
+    bgzf_close(fp);
+  }
+  Rcout << "only loading annotation for the " << Anno.contig_filter.size() << " contigs in the bam header" << "\n";
+}
+
+void Mapping::add_feature_set(string name, string tag, DataFrame anno, bool fix_chrname)
+{
+  if (tag.empty() || tag == velocity_tag)
+  {
+    stop("feature set " + name + " needs a tag of its own\n");
+  }
+  for (const FeatureSet &fs : feature_sets)
+  {
+    if (fs.name == name || fs.tag == tag)
+    {
+      stop("duplicated feature set name or tag: " + name + ", " + tag + "\n");
+    }
+  }
+  
+  std::shared_ptr<Mapping> mapping = std::make_shared<Mapping>();
+  mapping->Anno.contig_filter = Anno.contig_filter;
+  mapping->cache_slots = cache_slots;
+  mapping->add_annotation(anno, fix_chrname);
+  Rcout << "feature set " << name << ": " << mapping->Anno.ngenes() << " features, tagged " << tag << "\n";
+  feature_sets.push_back({name, tag, mapping});
+}
+
+char Mapping::splice_status(bam_hdr_t *header, bam1_t *b, bool m_strand, string &gene_id)
+{
+  auto bins_it = Anno.bins_dict.find(header->target_name[b->core.tid]);
+  if (bins_it == Anno.bins_dict.end())
+  {
+    return 0;
+  }
+  int rev = bam_is_rev(b)?(-1):1;
+  uint32_t* cig = bam_get_cigar(b);
+  int tmp_pos = b->core.pos;
+  bool junction = false;
+  vector<Interval> blocks;
+  for (uint32_t c = 0; c < b->core.n_cigar; c++)
+  {
+    const bool consumes_qry = (bam_cigar_type(cig[c]) >> 0) & 1;
+    const bool consumes_ref = (bam_cigar_type(cig[c]) >> 1) & 1;
+    if (consumes_qry && consumes_ref)
+    {
+      blocks.push_back(Interval(tmp_pos, tmp_pos+bam_cigar_oplen(cig[c]), rev));
+    }
+    junction = junction || bam_cigar_op(cig[c]) == BAM_CREF_SKIP;
+    if (consumes_ref)
+    {
+      tmp_pos += bam_cigar_oplen(cig[c]);
+    }
+  }
+  
+  // bins hold copies of the genes, so candidates are told apart by id
+  const Gene *gene = NULL;
+  for (const Interval &it : blocks)
+  {
+    for (auto &gene_list_ptr : bins_it->second.get_bins(it))
+    {
+      for (auto &g : gene_list_ptr->genes)
+      {
+        if (!(g == it) || (m_strand && it.snd*g.snd == -1))
+        {
+          continue;
+        }
+        if (!gene_id.empty())
+        {
+          if (g.gene_id == gene_id)
+          {
+            gene = &g;
+          }
+        }
+        else if (gene && gene->gene_id != g.gene_id)
+        {
+          return 0; // overlaps several genes
+        }
+        else
+        {
+          gene = &g;
+        }
+      }
+    }
+  }
+  if (!gene)
+  {
+    return 0;
+  }
+  gene_id = gene->gene_id;
+  
+  // only blocks inside the gene that miss its exons are intronic, a block reaching
+  // past either end of the gene may come from an unannotated exon
+  bool intronic = false;
+  bool overhang = false;
+  for (const Interval &it : blocks)
+  {
+    if (it.st < gene->st || it.en > gene->en)
+    {
+      overhang = true;
+    }
+    else if (!gene->within_exon(it))
+    {
+      intronic = true;
+    }
+  }
+  if (overhang || (intronic && junction))
+  {
+    return 'A';
+  }
+  return intronic ? 'U' : 'S';
+}
+
+void Mapping::reset_map_cache()
+{
+  map_cache.reset(cache_slots);
+  for (FeatureSet &fs : feature_sets)
+  {
+    fs.mapping->reset_map_cache();
+  }
+}
+
+void Mapping::report_map_cache()
+{
+  unsigned long long n_hits = map_cache.hits();
+  unsigned long long lookups = n_hits + map_cache.misses();
+  if (!map_cache.enabled() || lookups == 0)
+  {
+    return;
+  }
+  Rcout << "mapping cache hits: " << n_hits << " of " << lookups
+        << " (" << fixed << setprecision(2) << 100. * n_hits / lookups << "%), "
+        << "about " << setprecision(1) << map_cache.seconds_saved() << " seconds saved" << "\n";
+}
+
+int Mapping::map_exon(bam_hdr_t *header, bam1_t *b, string& gene_id, bool m_strand, AnnoCursor *cursor)
+{
+  auto genes_it = Anno.gene_dict.find(header->target_name[b->core.tid]);
+  if (!map_cache.enabled() || genes_it == Anno.gene_dict.end())
+  {
+    return map_exon_blocks(header, b, gene_id, m_strand, cursor, NULL);
+  }
+  const vector<Gene> &genes = genes_it->second;
+  
+  bool sample = map_cache.sample_lookup();
+  steady_clock::time_point t0;
+  if (sample) t0 = steady_clock::now();
+  
+  uint64_t key = AlignmentCache::footprint(b, m_strand);
+  int ret;
+  int gene_idx;
+  bool hit = map_cache.get(key, ret, gene_idx) && gene_idx < (int)genes.size();
+  map_cache.count(hit);
+  if (hit)
+  {
+    gene_id = gene_idx >= 0 ? genes[gene_idx].gene_id : "";
+  }
+  else
+  {
+    const Gene *hit_gene = NULL;
+    ret = map_exon_blocks(header, b, gene_id, m_strand, cursor, &hit_gene);
+    gene_idx = -1;
+    if (ret <= 0 && hit_gene)
+    {
+      // genes are sorted by start, the bins hold copies so look the gene up by id
+      auto it = std::lower_bound(genes.begin(), genes.end(), hit_gene->st,
+        [] (const Gene &g, int st) { return g.st < st; }
+      );
+      for (; it != genes.end() && it->st == hit_gene->st; ++it)
+      {
+        if (it->gene_id == gene_id)
+        {
+          gene_idx = it - genes.begin();
+          break;
+        }
+      }
+    }
+    // exon hits are only cached when their gene can be restored from the index
+    if (ret > 0 || gene_idx >= 0)
+    {
+      map_cache.put(key, ret, gene_idx);
+    }
+  }
+  
+  if (sample)
+  {
+    map_cache.add_sample(hit, duration_cast<nanoseconds>(steady_clock::now() - t0).count());
+  }
+  return ret;
+}
+
+int Mapping::map_exon_blocks(bam_hdr_t *header, bam1_t *b, string& gene_id, bool m_strand, AnnoCursor *cursor, const Gene **hit_gene)
+{
+  int ret = 9999;
+  int rev = bam_is_rev(b)?(-1):1;
+  uint32_t* cig = bam_get_cigar(b);
   int tmp_pos = b->core.pos;
   int tmp_rest = 9999999; // distance to end pos
   int tmp_ret;
   string tmp_id;
+  const Gene *tmp_gene = NULL;
   gene_id = "";
   
+  // find() instead of operator[] so that concurrent lookups never modify the map
+  auto bins_it = Anno.bins_dict.find(header->target_name[b->core.tid]);
+  // lookup tables are used when built for the chromosome, then the cursor,
+  // which only serves reads in coordinate order, and the bins for all other reads
+  auto runs_it = Anno.runs_dict.find(header->target_name[b->core.tid]);
+  bool use_runs = runs_it != Anno.runs_dict.end();
+  const vector<Gene> *chr_genes = use_runs ? &Anno.gene_dict.find(header->target_name[b->core.tid])->second : NULL;
+  bool use_cursor = !use_runs && cursor && cursor->seek(header, b->core.tid, b->core.pos);
+  vector<const Gene*> matched_genes;
+  vector<bool> matched_exon; // whether the block overlaps an exon of the matched gene
+  vector<std::pair<unsigned int, bool>> run_hits;
+  
   for (int c=0; c<b->core.n_cigar; c++)
   {
     tmp_ret = 9999;
-    string chr_name{header->target_name[b->core.tid]};
     // *   bit 1 set if the cigar operation consumes the query
     // *   bit 2 set if the cigar operation consumes the reference
     const bool consumes_qry = (bam_cigar_type(cig[c]) >> 0) & 1;
@@ -541,19 +1275,43 @@ int Mapping::map_exon(bam_hdr_t *header, bam1_t *b, string& gene_id, bool m_stra
     if (consumes_qry && consumes_ref)
     {
       Interval it = Interval(tmp_pos, tmp_pos+bam_cigar_oplen(cig[c]), rev);
-      auto &bins_list = Anno.bins_dict[chr_name];
-      const vector<GeneBin*> &matched_gene_bins = bins_list.get_bins(it);
+      matched_genes.clear();
+      matched_exon.clear();
       
-      vector<Gene> matched_genes;
-      
-      for (auto &gene_list_ptr : matched_gene_bins) {
-        for (auto &gene : gene_list_ptr->genes) {
-          if (gene == it) {
-            matched_genes.push_back(gene);
+      if (use_runs)
+      {
+        runs_it->second.query(it, run_hits);
+        for (const auto &h : run_hits)
+        {
+          const Gene *gene = &(*chr_genes)[h.first];
+          matched_genes.push_back(gene);
+          matched_exon.push_back(h.second && !(m_strand && it.snd*gene->snd == -1));
+        }
+      }
+      else if (use_cursor)
+      {
+        cursor->overlapping(it, matched_genes);
+      }
+      else if (bins_it != Anno.bins_dict.end())
+      {
+        const vector<GeneBin*> &matched_gene_bins = bins_it->second.get_bins(it);
+        for (auto &gene_list_ptr : matched_gene_bins) {
+          for (auto &gene : gene_list_ptr->genes) {
+            if (gene == it) {
+              matched_genes.push_back(&gene);
+            }
           }
         }
       }
       
+      if (!use_runs)
+      {
+        for (const Gene *gene : matched_genes)
+        {
+          matched_exon.push_back(gene->in_exon(it, m_strand));
+        }
+      }
+      
       if (matched_genes.size() == 0)
       {
         // no matching gene
@@ -562,13 +1320,14 @@ int Mapping::map_exon(bam_hdr_t *header, bam1_t *b, string& gene_id, bool m_stra
       else
       {
         tmp_id = "";
-        for (auto &gene : matched_genes)
+        for (size_t g = 0; g < matched_genes.size(); g++)
         {
-          if (gene.in_exon(it, m_strand))
+          const Gene *gene = matched_genes[g];
+          if (matched_exon[g])
           {
             if (tmp_id != "")
             {
-              if (tmp_id != gene.gene_id)
+              if (tmp_id != gene->gene_id)
               {
                 tmp_ret = 1; // ambiguous mapping
                 break;
@@ -576,17 +1335,18 @@ int Mapping::map_exon(bam_hdr_t *header, bam1_t *b, string& gene_id, bool m_stra
               else
               {
                 // update the distance to end pos
-                tmp_rest = tmp_rest<(gene.distance_to_end(it))?tmp_rest:gene.distance_to_end(it);
+                tmp_rest = std::min(tmp_rest, gene->distance_to_end(it));
               }
             }
             else
             {
-              tmp_id = gene.gene_id;
+              tmp_id = gene->gene_id;
+              tmp_gene = gene;
               tmp_ret = 0;
-              tmp_rest = gene.distance_to_end(it);
+              tmp_rest = gene->distance_to_end(it);
             }
           }
-          else if ((it > gene) || (it < gene))
+          else if ((it > *gene) || (it < *gene))
           {
             tmp_ret = (tmp_ret >= 3) ? 3 : tmp_ret;
           }
@@ -610,33 +1370,158 @@ int Mapping::map_exon(bam_hdr_t *header, bam1_t *b, string& gene_id, bool m_stra
       {
         ret = 0;
         gene_id = tmp_id;
+        if (hit_gene) *hit_gene = tmp_gene;
       }
       else
       {
         ret = ret<tmp_ret?ret:tmp_ret; // choose the smallest
       }
     }
-    else if (!consumes_qry && consumes_ref)
+    else if (!consumes_qry && consumes_ref)
+    {
+      tmp_pos += bam_cigar_oplen(cig[c]);
+    }
+  }
+  if (ret == 0)
+  {
+    return -tmp_rest;
+  }
+  else
+  {
+    // return codes:
+    // 0: unique map to exon
+    // 1: ambiguous map to multiple exon
+    // 2: map to intron
+    // 3: not mapped
+    return ret;
+  }
+}
+
+void Mapping::build_feature_lookup(const vector<string> &chrs)
+{
+  vector<string> selected = chrs;
+  if (std::find(chrs.begin(), chrs.end(), "*") != chrs.end())
+  {
+    selected.clear();
+  }
+  Timer timer;
+  timer.start();
+  Anno.build_feature_runs(selected);
+  unsigned int build_ms = timer.milliseconds_elapsed();
+  
+  size_t n_runs = 0, n_features = 0, memory = 0;
+  for (const auto &runs : Anno.runs_dict)
+  {
+    n_runs += runs.second.n_runs();
+    n_features += runs.second.n_features();
+    memory += runs.second.memory_usage();
+  }
+  Rcout << "feature lookup tables built for " << Anno.runs_dict.size() << " chromosomes: "
+        << n_runs << " runs, " << n_features << " distinct features, "
+        << fixed << setprecision(2) << memory / 1048576. << " MB, "
+        << build_ms << " milliseconds" << "\n";
+  
+  // lookup speed on random 100bp blocks, the same blocks for both methods
+  const int n_queries = 200000;
+  std::mt19937 rng(1);
+  size_t n_genes = 0;
+  for (const auto &runs : Anno.runs_dict)
+  {
+    n_genes += Anno.gene_dict.at(runs.first).size();
+  }
+  vector<std::pair<const string*, Interval>> queries;
+  for (const auto &runs : Anno.runs_dict)
+  {
+    const auto &genes = Anno.gene_dict.at(runs.first);
+    int chr_end = 0;
+    for (const auto &g : genes) chr_end = std::max(chr_end, g.en);
+    int n = (int)((double)n_queries * genes.size() / std::max<size_t>(n_genes, 1));
+    for (int i = 0; i < n; i++)
+    {
+      int st = rng() % (chr_end + 1);
+      queries.push_back({&runs.first, Interval(st, st + 100, 1)});
+    }
+  }
+  if (queries.empty())
+  {
+    return;
+  }
+  
+  size_t hits_bins = 0, hits_runs = 0;
+  timer.start();
+  for (const auto &q : queries)
+  {
+    for (auto &bin : Anno.bins_dict.at(*q.first).get_bins(q.second))
     {
-      tmp_pos += bam_cigar_oplen(cig[c]);
+      for (auto &gene : bin->genes)
+      {
+        if (gene == q.second && gene.in_exon(q.second)) hits_bins++;
+      }
     }
   }
-  if (ret == 0)
+  double bins_us = std::max(timer.microseconds_elapsed(), 1u);
+  
+  vector<std::pair<unsigned int, bool>> hits;
+  timer.start();
+  for (const auto &q : queries)
   {
-    return -tmp_rest;
+    Anno.runs_dict.at(*q.first).query(q.second, hits);
+    for (const auto &h : hits) hits_runs += h.second;
   }
-  else
+  double runs_us = std::max(timer.microseconds_elapsed(), 1u);
+  
+  Rcout << "block lookups per second, gene bins: " << fixed << setprecision(0) << queries.size() / bins_us * 1e6
+        << ", lookup tables: " << queries.size() / runs_us * 1e6
+        << " (" << setprecision(1) << bins_us / runs_us << "x)" << "\n";
+  if (hits_bins != hits_runs)
   {
-    // return codes:
-    // 0: unique map to exon
-    // 1: ambiguous map to multiple exon
-    // 2: map to intron
-    // 3: not mapped
-    return ret;
+    Rcout << "Warning: lookup tables and gene bins disagree on " << queries.size() << " test blocks" << "\n";
+  }
+}
+
+void Mapping::check_contigs(const bam_hdr_t *header)
+{
+  bool found_any = false;
+  for (int i = 0; i < header->n_targets; ++i)
+  {
+    if (Anno.gene_dict.end() == Anno.gene_dict.find(header->target_name[i]))
+    {
+      Rcout << header->target_name[i] << " not found in exon annotation." << "\n";
+    }
+    else
+    {
+      found_any = true;
+    }
+    
+  }
+  if (!found_any)
+  {
+    stringstream err_msg;
+    err_msg << "ERROR: The annotation and .bam file contains different chromosome." << "\n";
+    stop(err_msg.str());
   }
 }
 
 namespace {
+void report_mapping_stats(unsigned long long cnt, const unsigned long long tmp_c[4], unsigned long long unaligned)
+{
+  Rcout << "number of read processed: " << cnt << "\n";
+  Rcout << "unique map to exon: " << tmp_c[0]
+        << " (" << fixed << setprecision(2) << 100. * tmp_c[0]/cnt << "%)" << "\n";
+  
+  Rcout << "ambiguous map to multiple exon: " << tmp_c[1]
+        << " ("  << fixed << setprecision(2) << 100. * tmp_c[1]/cnt << "%)" << "\n";
+  
+  Rcout << "map to intron: " << tmp_c[2]
+        << " (" << fixed << setprecision(2) << 100. * tmp_c[2]/cnt << "%)" << "\n";
+  
+  Rcout << "not mapped: " << tmp_c[3]
+        << " ("  << fixed << setprecision(2) << 100. * tmp_c[3]/cnt << "%)" << "\n";
+  
+  Rcout << "unaligned: " << unaligned
+        << " (" << fixed << setprecision(2) << 100. * unaligned/cnt << "%)" << "\n";
+}
+
 void report_every_3_mins(
     atomic<unsigned long long> &cnt,
     atomic<bool> &running,
@@ -658,42 +1543,63 @@ void report_every_3_mins(
     report_message = true;
   } while (running);
 }
+
+// drop the sequence and base qualities of a read, and its name if `drop_qname`.
+// `barcode_demultiplex` only needs the position, flag and tags of a read
+void slim_read(bam1_t *b, bool drop_qname)
+{
+  uint8_t *seq = bam_get_seq(b);
+  int seq_len = bam_get_aux(b) - seq;
+  memmove(seq, seq + seq_len, bam_get_l_aux(b));
+  b->core.l_qseq = 0;
+  b->l_data -= seq_len;
+  
+  // "*" is kept padded with NULs so the cigar stays 4-byte aligned
+  int name_len = b->core.l_qname - 4;
+  if (drop_qname && name_len > 0)
+  {
+    memmove(b->data + 4, b->data + b->core.l_qname, b->l_data - b->core.l_qname);
+    memcpy(b->data, "*\0\0\0", 4);
+    b->core.l_qname = 4;
+    b->core.l_extranul = 2;
+    b->l_data -= name_len;
+  }
+}
 }
 
 void Mapping::parse_align_warpper(vector<string> fn_vec, vector<string> cell_id_vec, string fn_out, bool m_strand, string map_tag, string gene_tag, string cellular_tag, string molecular_tag, int bc_len, int UMI_len, int nthreads)
 {
-  
-  if (fn_vec.size()>1)
+  if (fn_vec.size() == 1)
   {
-    if((fn_vec.size()!=cell_id_vec.size()) & (bc_len==0))
-    {
-      stringstream err_msg;
-      err_msg << "size of bam file and cell id vector should be the same: \n";
-      err_msg << "\t number of bam files: " << fn_vec.size() << "\n";
-      err_msg << "\t number of cell ids: " << cell_id_vec.size() << "\n";
-      stop(err_msg.str());
-    }
-    if (bc_len==0)
-    {
-      parse_align(fn_vec[0], fn_out, m_strand, map_tag, gene_tag, cellular_tag, molecular_tag, bc_len, "wb", cell_id_vec[0], UMI_len, nthreads);
-      for (int i=1;i<fn_vec.size();i++)
-      {
-        parse_align(fn_vec[i], fn_out, m_strand, map_tag, gene_tag, cellular_tag, molecular_tag, bc_len, "ab", cell_id_vec[i], UMI_len, nthreads);
-      }
-    }
-    else
-    {
-      parse_align(fn_vec[0], fn_out, m_strand, map_tag, gene_tag, cellular_tag, molecular_tag, bc_len, "wb", "", UMI_len, nthreads);
-      for (int i=1;i<fn_vec.size();i++)
-      {
-        parse_align(fn_vec[i], fn_out, m_strand, map_tag, gene_tag, cellular_tag, molecular_tag, bc_len, "ab", "", UMI_len, nthreads);
-      }
-    }
+    parse_align(fn_vec[0], fn_out, m_strand, map_tag, gene_tag, cellular_tag, molecular_tag, bc_len, "wb", "", UMI_len, nthreads);
+    return;
   }
-  else
+  if ((fn_vec.size() != cell_id_vec.size()) && (bc_len == 0))
   {
-    parse_align(fn_vec[0], fn_out, m_strand, map_tag, gene_tag, cellular_tag, molecular_tag, bc_len, "wb", "", UMI_len, nthreads);
+    stringstream err_msg;
+    err_msg << "size of bam file and cell id vector should be the same: \n";
+    err_msg << "\t number of bam files: " << fn_vec.size() << "\n";
+    err_msg << "\t number of cell ids: " << cell_id_vec.size() << "\n";
+    stop(err_msg.str());
   }
+  
+  // every file gets its own cursor, files are usually sorted but not ordered between each other
+  auto make_tagger = [&](size_t i) -> ReadTagger
+  {
+    TagOptions opt = {map_tag, gene_tag, cellular_tag, molecular_tag, bc_len, UMI_len, bc_len == 0 ? cell_id_vec[i] : "", m_strand};
+    std::shared_ptr<AnnoCursor> cursor = std::make_shared<AnnoCursor>(Anno);
+    std::shared_ptr<AuxTagBuilder> tags = std::make_shared<AuxTagBuilder>();
+    return [this, opt, cursor, tags](bam_hdr_t *header, bam1_t *b)
+    {
+      return tag_read(header, b, opt, cursor.get(), *tags);
+    };
+  };
+  
+  reset_map_cache();
+  unsigned long long counts[5] = {0,0,0,0,0};
+  unsigned long long cnt = parse_align_files(fn_vec, fn_out, nthreads, make_tagger, counts);
+  report_mapping_stats(cnt, counts, counts[4]);
+  report_map_cache();
 }
 
 // namespace {
@@ -729,9 +1635,91 @@ void Mapping::parse_align_warpper(vector<string> fn_vec, vector<string> cell_id_
 //     }
 // }
 
+int Mapping::tag_read(bam_hdr_t *header, bam1_t *b, const TagOptions &opt, AnnoCursor *cursor, AuxTagBuilder &tags)
+{
+  int ret;
+  string gene_id;
+  
+  if ((b->core.flag&BAM_FUNMAP) > 0)
+  {
+    ret = 4;
+  }
+  else
+  {
+    //  chromosome not found in annotation:
+    if (Anno.gene_dict.end() == Anno.gene_dict.find(header->target_name[b->core.tid]))
+    {
+      ret = 3;
+    }
+    else
+    {
+      ret = map_exon(header, b, gene_id, opt.m_strand, cursor);
+    }
+    
+    char status = 0;
+    if (!velocity_tag.empty() && (ret <= 0 || ret == 2))
+    {
+      status = splice_status(header, b, opt.m_strand, gene_id);
+    }
+    if (ret <= 0)
+    {
+      tags.add_str(opt.gene_tag.c_str(), gene_id);
+    }
+    if (status)
+    {
+      // intronic reads are not mapped to the gene, so the status carries its id
+      tags.add_str(velocity_tag.c_str(), string(1, status) + ":" + gene_id);
+    }
+    
+    // the feature sets share the decoded read and the output with the gene annotation
+    for (const FeatureSet &fs : feature_sets)
+    {
+      string feature_id;
+      if (fs.mapping->Anno.gene_dict.count(header->target_name[b->core.tid]) > 0
+          && fs.mapping->map_exon(header, b, feature_id, opt.m_strand) <= 0)
+      {
+        tags.add_str(fs.tag.c_str(), feature_id);
+      }
+    }
+  }
+  // for moving barcode and UMI from sequence name to bam tags
+  if (opt.bc_len > 0)
+  {
+    tags.add_str(opt.cellular_tag.c_str(), bam_get_qname(b), opt.bc_len);
+  } else if (opt.cell_id.size()>0)
+  {
+    tags.add_str(opt.cellular_tag.c_str(), opt.cell_id);
+  }
+  if (opt.UMI_len > 0)
+  {
+    tags.add_str(opt.molecular_tag.c_str(), bam_get_qname(b)+opt.bc_len+1, opt.UMI_len); // `+1` to skip separator
+  }
+  
+  tags.add_int(opt.map_tag.c_str(), ret);
+  if (tags.write(b) < 0)
+  {
+    throw std::runtime_error(string("fail to add the bam tags: ") + bam_get_qname(b) + "\n");
+  }
+  if (slim_bam)
+  {
+    // without UMIs the read name identifies the molecule
+    slim_read(b, slim_qname && opt.UMI_len > 0);
+  }
+  return ret;
+}
+
+string Mapping::out_mode(const string &mode) const
+{
+  if (compress_level < 0)
+  {
+    return mode;
+  }
+  return mode + std::to_string(std::min(compress_level, 9));
+}
+
 void Mapping::parse_align(string bam_fn, string fn_out, bool m_strand, string map_tag, string gene_tag, string cellular_tag, string molecular_tag, int bc_len, string write_mode, string cell_id, int UMI_len, int nthreads)
 {
-  int unaligned = 0;
+  unsigned long long unaligned = 0;
   int ret;
   
   check_file_exists(bam_fn); // htslib does not check if file exist so we do it manually
@@ -741,51 +1729,39 @@ void Mapping::parse_align(string bam_fn, string fn_out, bool m_strand, string ma
   // int UMI_len;
   // std::tie(bc_len, UMI_len) = get_bc_umi_lengths(bam_fn);
   
+  TagOptions opt = {map_tag, gene_tag, cellular_tag, molecular_tag, bc_len, UMI_len, cell_id, m_strand};
+  reset_map_cache();
+  
+  if (region_parallel && nthreads > 1 && write_mode == "wb")
+  {
+    if (parse_align_regions(bam_fn, fn_out, opt, nthreads))
+    {
+      return;
+    }
+  }
+  
+  write_mode = out_mode(write_mode);
   const char * c_write_mode = write_mode.c_str();
   // open files
   bam1_t *b = bam_init1();
   BGZF *fp = bgzf_open(bam_fn.c_str(), "r"); // input file
   samFile *of = sam_open(fn_out.c_str(), c_write_mode); // output file
   
-  // set up htslib threadpool for output
-  int out_threads = std::max(nthreads - 1, 1);
-  htsThreadPool p = {NULL, 0};
-  p.pool = hts_tpool_init(out_threads);
-  hts_set_opt(of, HTS_OPT_THREAD_POOL, &p);
+  // this thread tags the reads, the other threads share the input and output (de)compression
+  HtsPool pool(std::max(nthreads - 1, 1));
+  pool.attach(fp);
+  pool.attach(of);
   
   int hts_retcode;
   
   bam_hdr_t *header = bam_hdr_read(fp);
   hts_retcode = sam_hdr_write(of, header);
   
-  int tmp_c[4] = {0,0,0,0};
+  unsigned long long tmp_c[4] = {0,0,0,0};
   
-  bool found_any = false;
-  for (int i = 0; i < header->n_targets; ++i)
-  {
-    if (Anno.gene_dict.end() == Anno.gene_dict.find(header->target_name[i]))
-    {
-      Rcout << header->target_name[i] << " not found in exon annotation." << "\n";
-    }
-    else
-    {
-      found_any = true;
-    }
-    
-  }
-  if (!found_any)
-  {
-    stringstream err_msg;
-    err_msg << "ERROR: The annotation and .bam file contains different chromosome." << "\n";
-    stop(err_msg.str());
-  }
-  uint8_t* c_cell_id = const_cast<uint8_t*>(reinterpret_cast<const uint8_t*>(cell_id.c_str()));
-  // for moving barcode and UMI from sequence name to bam tags
-  const char * g_ptr = gene_tag.c_str();
-  const char * c_ptr = cellular_tag.c_str();
-  const char * m_ptr = molecular_tag.c_str();
-  const char * a_ptr = map_tag.c_str();
-  char buf[999] = ""; // assume the length of barcode or UMI is less than 999
+  check_contigs(header);
+  AnnoCursor cursor(Anno);
+  AuxTagBuilder tags;
   
   atomic<unsigned long long> cnt{0};
   atomic<bool> running{true};
@@ -797,149 +1773,684 @@ void Mapping::parse_align(string bam_fn, string fn_out, bool m_strand, string ma
       [&]() {
         report_every_3_mins(cnt, running, report_message);
       }
-  );
-  Timer timer;
-  timer.start();
-  
-  while (bam_read1(fp, b) >= 0)
+  );
+  Timer timer;
+  timer.start();
+  
+  while (bam_read1(fp, b) >= 0)
+  {
+    if (__DEBUG)
+    {
+      if (cnt % 1000000 == 0)
+      {
+        Rcout << "number of read processed:" << cnt << "\n";
+        Rcout << tmp_c[0] <<"\t"<< tmp_c[1] <<"\t"<<tmp_c[2] <<"\t"<<tmp_c[3] <<"\t" << "\n";
+      }
+    }
+    cnt++;
+    if (cnt % 32768 == 0) checkUserInterrupt();
+    
+    // The Rcout would be conceptually cleaner if it lived inside the spawned thread
+    // but only the master thread can interact with R without error so this code CANNOT
+    // be run inside a child thread
+    if (report_message)
+    {
+      Rcout
+      << cnt << " reads processed" << ", "
+      << cnt / timer.seconds_elapsed() / 1000 << "k reads/sec" << endl;
+      report_message = false;
+    }
+    
+    ret = tag_read(header, b, opt, &cursor, tags);
+    if (ret == 4)
+    {
+      unaligned++;
+    }
+    else if (ret <= 0)
+    {
+      tmp_c[0]++;
+    }
+    else if (ret <= 3)
+    {
+      tmp_c[ret]++;
+    }
+    
+    int re = sam_write1(of, header, b);
+    if (re < 0)
+    {
+      stringstream err_msg;
+      err_msg << "fail to write the bam file: " << bam_get_qname(b) << "\n";
+      err_msg << "return code: " << re << "\n";
+      stop(err_msg.str());
+    }
+  }
+  
+  running = false;
+  reporter_thread.join();
+  
+  // final report of processing speed
+  Rcout
+    << cnt << " reads processed" << ", "
+    << cnt / timer.seconds_elapsed() / 1000 << "k reads/sec" << endl;
+  
+  report_mapping_stats(cnt, tmp_c, unaligned);
+  report_map_cache();
+  if (cursor.fallbacks > 0)
+  {
+    Rcout << "reads out of coordinate order: " << cursor.fallbacks << "\n";
+  }
+  bam_destroy1(b);
+  bam_hdr_destroy(header);
+  pool.close(of);
+  pool.close(fp);
+}
+
+vector<Mapping::AlignRegion> Mapping::split_regions(const bam_hdr_t *header, const hts_idx_t *idx, int n_regions)
+{
+  // weight chromosomes by their number of mapped reads, or by their
+  // length if the index has no read counts
+  vector<uint64_t> weights(header->n_targets, 0);
+  uint64_t total = 0;
+  for (int tid = 0; tid < header->n_targets; tid++)
+  {
+    uint64_t mapped, unmapped;
+    // fails for chromosomes without reads
+    if (hts_idx_get_stat(idx, tid, &mapped, &unmapped) == 0)
+    {
+      weights[tid] = mapped + unmapped;
+      total += weights[tid];
+    }
+  }
+  if (total == 0)
+  {
+    total = 0;
+    for (int tid = 0; tid < header->n_targets; tid++)
+    {
+      weights[tid] = header->target_len[tid];
+      total += weights[tid];
+    }
+  }
+  
+  vector<AlignRegion> regions;
+  uint64_t target = std::max<uint64_t>(total / std::max(n_regions, 1), 1);
+  for (int tid = 0; tid < header->n_targets; tid++)
+  {
+    if (weights[tid] == 0)
+    {
+      continue;
+    }
+    // reads are assumed to be evenly spread along the chromosome
+    uint64_t n_pieces = (weights[tid] + target - 1) / target;
+    uint64_t len = header->target_len[tid];
+    uint64_t step = std::max<uint64_t>((len + n_pieces - 1) / n_pieces, 1);
+    for (uint64_t st = 0; st < len; st += step)
+    {
+      regions.push_back({tid, (int)st, (int)std::min(st + step, len)});
+    }
+  }
+  // unmapped reads without coordinate are stored after all chromosomes
+  if (hts_idx_get_n_no_coor(idx) > 0)
+  {
+    regions.push_back({HTS_IDX_NOCOOR, 0, 0});
+  }
+  return regions;
+}
+
+namespace {
+// the empty block marking the end of a BGZF file
+const unsigned char BGZF_EOF[28] = {
+  0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00, 0x42, 0x43,
+  0x02, 0x00, 0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+
+// concatenate BGZF files without recompression by dropping the EOF block of each
+// part, the parts are deleted afterwards. return false on IO error
+bool concat_bgzf(const vector<string> &parts, const string &fn_out)
+{
+  FILE *out = fopen(fn_out.c_str(), "wb");
+  if (!out)
+  {
+    return false;
+  }
+  bool ok = true;
+  vector<char> buf(1 << 22);
+  for (const string &part : parts)
+  {
+    FILE *in = fopen(part.c_str(), "rb");
+    if (!in)
+    {
+      ok = false;
+      break;
+    }
+    fseek(in, 0, SEEK_END);
+    long size = ftell(in);
+    if (size >= (long)sizeof(BGZF_EOF))
+    {
+      unsigned char tail[sizeof(BGZF_EOF)];
+      fseek(in, size - sizeof(BGZF_EOF), SEEK_SET);
+      if (fread(tail, 1, sizeof(BGZF_EOF), in) == sizeof(BGZF_EOF) &&
+          memcmp(tail, BGZF_EOF, sizeof(BGZF_EOF)) == 0)
+      {
+        size -= sizeof(BGZF_EOF);
+      }
+    }
+    fseek(in, 0, SEEK_SET);
+    while (size > 0)
+    {
+      size_t n = fread(buf.data(), 1, std::min<long>(size, buf.size()), in);
+      if (n == 0 || fwrite(buf.data(), 1, n, out) != n)
+      {
+        ok = false;
+        break;
+      }
+      size -= n;
+    }
+    fclose(in);
+    std::remove(part.c_str());
+    if (!ok)
+    {
+      break;
+    }
+  }
+  ok = ok && fwrite(BGZF_EOF, 1, sizeof(BGZF_EOF), out) == sizeof(BGZF_EOF);
+  ok = (fclose(out) == 0) && ok;
+  return ok;
+}
+
+// only the master thread can talk to R, so it reports progress while the workers run.
+// with `interrupted` it also checks for a user interrupt, sets the flag for the workers
+// to stop and rethrows, the caller then joins the workers and cleans up
+void wait_for_workers(const atomic<int> &n_running, const atomic<unsigned long long> &cnt, Timer &timer, atomic<bool> *interrupted = NULL)
+{
+  unsigned int last_report = 0;
+  while (n_running > 0)
   {
-    string gene_id;
-    
-    if (__DEBUG)
+    sleep_for(milliseconds(100));
+    if (interrupted)
     {
-      if (cnt % 1000000 == 0)
+      try
       {
-        Rcout << "number of read processed:" << cnt << "\n";
-        Rcout << tmp_c[0] <<"\t"<< tmp_c[1] <<"\t"<<tmp_c[2] <<"\t"<<tmp_c[3] <<"\t" << "\n";
+        checkUserInterrupt();
+      }
+      catch (...)
+      {
+        *interrupted = true;
+        throw;
       }
     }
-    cnt++;
-    if (cnt % 32768 == 0) checkUserInterrupt();
-    
-    // The Rcout would be conceptually cleaner if it lived inside the spawned thread
-    // but only the master thread can interact with R without error so this code CANNOT
-    // be run inside a child thread
-    if (report_message)
+    if (timer.seconds_elapsed() - last_report >= 180)
     {
+      last_report = timer.seconds_elapsed();
       Rcout
       << cnt << " reads processed" << ", "
       << cnt / timer.seconds_elapsed() / 1000 << "k reads/sec" << endl;
-      report_message = false;
     }
-    
-    if ((b->core.flag&BAM_FUNMAP) > 0)
+  }
+}
+}
+
+bool Mapping::same_references(const bam_hdr_t *a, const bam_hdr_t *b)
+{
+  if (a->n_targets != b->n_targets)
+  {
+    return false;
+  }
+  for (int i = 0; i < a->n_targets; i++)
+  {
+    if (a->target_len[i] != b->target_len[i] || strcmp(a->target_name[i], b->target_name[i]) != 0)
     {
-      unaligned++;
-      ret = 4;
+      return false;
     }
-    else
+  }
+  return true;
+}
+
+bool Mapping::parse_align_regions(string bam_fn, string fn_out, const TagOptions &opt, int nthreads)
+{
+  samFile *in = hts_open(bam_fn.c_str(), "r");
+  if (!in)
+  {
+    return false;
+  }
+  hts_idx_t *idx = sam_index_load(in, bam_fn.c_str());
+  if (!idx)
+  {
+    hts_close(in);
+    return false;
+  }
+  bam_hdr_t *header = sam_hdr_read(in);
+  if (!header)
+  {
+    hts_idx_destroy(idx);
+    hts_close(in);
+    stop("fail to read the bam header: " + bam_fn + "\n");
+  }
+  check_contigs(header);
+  
+  vector<AlignRegion> regions = split_regions(header, idx, nthreads * regions_per_thread);
+  Rcout << "bam index found, mapping " << regions.size() << " regions on " << nthreads << " threads..." << "\n";
+  
+  // part 0 holds the header, region i is written to part i+1
+  vector<string> parts;
+  for (size_t i = 0; i <= regions.size(); i++)
+  {
+    parts.push_back(fn_out + ".part" + padding(i, 5));
+  }
+  BGZF *hp = bgzf_open(parts[0].c_str(), out_mode("w").c_str());
+  if (!hp || bam_hdr_write(hp, header) < 0 || bgzf_close(hp) < 0)
+  {
+    bam_hdr_destroy(header);
+    hts_idx_destroy(idx);
+    hts_close(in);
+    stop("fail to write the bam header: " + fn_out + "\n");
+  }
+  
+  atomic<size_t> next_region{0};
+  atomic<unsigned long long> cnt{0};
+  atomic<int> n_running{nthreads};
+  atomic<bool> interrupted{false};
+  std::mutex mtx;
+  unsigned long long tmp_c[4] = {0,0,0,0};
+  unsigned long long unaligned = 0;
+  string err;
+  
+  auto worker = [&]()
+  {
+    // each thread has its own file handle and index for random access
+    samFile *fp = hts_open(bam_fn.c_str(), "r");
+    hts_idx_t *t_idx = fp ? sam_index_load(fp, bam_fn.c_str()) : NULL;
+    bam_hdr_t *t_header = fp ? sam_hdr_read(fp) : NULL;
+    bam1_t *b = bam_init1();
+    // regions are taken in increasing order, so the cursor only moves forward
+    AnnoCursor cursor(Anno);
+    AuxTagBuilder tags;
+    unsigned long long t_c[4] = {0,0,0,0};
+    unsigned long long t_unaligned = 0;
+    string t_err;
+    if (!t_idx || !t_header)
+    {
+      t_err = "fail to open the bam file: " + bam_fn + "\n";
+    }
+    
+    size_t i;
+    while (t_err.empty() && !interrupted && (i = next_region++) < regions.size())
     {
-      //  chromosome not found in annotation:
-      if (Anno.gene_dict.end() == Anno.gene_dict.find(header->target_name[b->core.tid]))
+      const AlignRegion &r = regions[i];
+      BGZF *out = bgzf_open(parts[i + 1].c_str(), out_mode("w").c_str());
+      hts_itr_t *itr = sam_itr_queryi(t_idx, r.tid, r.beg, r.end);
+      if (!out || !itr)
       {
-        ret = 3;
+        t_err = "fail to open region output: " + parts[i + 1] + "\n";
       }
-      else
+      int re;
+      unsigned long long t_cnt = 0;
+      while (t_err.empty() && (re = sam_itr_next(fp, itr, b)) >= 0)
       {
-        ret = map_exon(header, b, gene_id, m_strand);
+        if (++t_cnt % 32768 == 0 && interrupted)
+        {
+          break;
+        }
+        // reads starting before the region belong to the previous one
+        if (r.tid >= 0 && b->core.pos < r.beg)
+        {
+          continue;
+        }
+        cnt++;
+        int ret;
+        try
+        {
+          ret = tag_read(t_header, b, opt, &cursor, tags);
+        }
+        catch (const std::exception &e)
+        {
+          t_err = e.what();
+          break;
+        }
+        if (ret == 4)
+        {
+          t_unaligned++;
+        }
+        else if (ret <= 0)
+        {
+          t_c[0]++;
+        }
+        else if (ret <= 3)
+        {
+          t_c[ret]++;
+        }
+        if (bam_write1(out, b) < 0)
+        {
+          t_err = string("fail to write the bam file: ") + bam_get_qname(b) + "\n";
+        }
       }
-      
-      if (ret <= 0)
+      if (t_err.empty() && re < -1)
       {
-        tmp_c[0]++;
-        bam_aux_append(b, g_ptr, 'Z', gene_id.size()+1, (uint8_t*)gene_id.c_str());
+        t_err = "fail to read the bam file: " + bam_fn + "\n";
       }
-      else
+      if (itr) hts_itr_destroy(itr);
+      if (out && bgzf_close(out) < 0 && t_err.empty())
       {
-        if (ret >= 0 && ret <= 3)
-          tmp_c[ret]++;
+        t_err = "fail to write region output: " + parts[i + 1] + "\n";
       }
     }
-    if (bc_len > 0)
+    
+    bam_destroy1(b);
+    if (t_header) bam_hdr_destroy(t_header);
+    if (t_idx) hts_idx_destroy(t_idx);
+    if (fp) hts_close(fp);
+    
+    std::lock_guard<std::mutex> lock(mtx);
+    for (int k = 0; k < 4; k++)
     {
-      memcpy(buf, bam_get_qname(b), bc_len * sizeof(char));
-      buf[bc_len] = '\0';
-      bam_aux_append(b, c_ptr, 'Z', bc_len+1, (uint8_t*)buf);
-    } else if (cell_id.size()>0)
+      tmp_c[k] += t_c[k];
+    }
+    unaligned += t_unaligned;
+    if (err.empty())
     {
-      bam_aux_append(b, c_ptr, 'Z', cell_id.size()+1, c_cell_id);
+      err = t_err;
     }
-    if (UMI_len > 0)
+    if (!t_err.empty())
     {
-      memcpy(buf, bam_get_qname(b)+bc_len+1, UMI_len * sizeof(char)); // `+1` to add separator
-      buf[UMI_len] = '\0';
-      bam_aux_append(b, m_ptr, 'Z', UMI_len+1, (uint8_t*)buf);
+      next_region = regions.size(); // stop the other threads
     }
-    
-    bam_aux_append(b, a_ptr, 'i', sizeof(uint32_t), (uint8_t*)&ret);
-    
-    int re = sam_write1(of, header, b);
-    if (re < 0)
+    n_running--;
+  };
+  
+  Timer timer;
+  timer.start();
+  vector<thread> threads;
+  for (int t = 0; t < nthreads; t++)
+  {
+    threads.push_back(thread(worker));
+  }
+  auto finish = [&]()
+  {
+    for (auto &t : threads)
     {
-      stringstream err_msg;
-      err_msg << "fail to write the bam file: " << bam_get_qname(b) << "\n";
-      err_msg << "return code: " << re << "\n";
-      stop(err_msg.str());
+      t.join();
+    }
+    bam_hdr_destroy(header);
+    hts_idx_destroy(idx);
+    hts_close(in);
+  };
+  auto remove_parts = [&]()
+  {
+    for (const string &part : parts)
+    {
+      std::remove(part.c_str());
     }
+  };
+  try
+  {
+    wait_for_workers(n_running, cnt, timer, &interrupted);
+  }
+  catch (...)
+  {
+    // user interrupt, the workers stop at their next batch
+    finish();
+    remove_parts();
+    throw;
   }
+  finish();
   
-  running = false;
-  reporter_thread.join();
+  if (!err.empty())
+  {
+    remove_parts();
+    stop(err);
+  }
+  if (!concat_bgzf(parts, fn_out))
+  {
+    stop("fail to write the bam file: " + fn_out + "\n");
+  }
   
-  // final report of processing speed
   Rcout
     << cnt << " reads processed" << ", "
-    << cnt / timer.seconds_elapsed() / 1000 << "k reads/sec" << endl;
-  
-  Rcout << "number of read processed: " << cnt << "\n";
-  Rcout << "unique map to exon: " << tmp_c[0]
-        << " (" << fixed << setprecision(2) << 100. * tmp_c[0]/cnt << "%)" << "\n";
-  
-  Rcout << "ambiguous map to multiple exon: " << tmp_c[1]
-        << " ("  << fixed << setprecision(2) << 100. * tmp_c[1]/cnt << "%)" << "\n";
-  
-  Rcout << "map to intron: " << tmp_c[2]
-        << " (" << fixed << setprecision(2) << 100. * tmp_c[2]/cnt << "%)" << "\n";
-  
-  Rcout << "not mapped: " << tmp_c[3]
-        << " ("  << fixed << setprecision(2) << 100. * tmp_c[3]/cnt << "%)" << "\n";
-  
-  Rcout << "unaligned: " << unaligned
-        << " (" << fixed << setprecision(2) << 100. * unaligned/cnt << "%)" << "\n";
-  sam_close(of);
-  bgzf_close(fp);
-  if (p.pool) hts_tpool_destroy(p.pool);
+    << cnt / std::max(timer.seconds_elapsed(), 1u) / 1000 << "k reads/sec" << endl;
+  report_mapping_stats(cnt, tmp_c, unaligned);
+  report_map_cache();
+  return true;
 }
 
 
 
-void Mapping::sc_atac_parse_align_warpper(vector<string> fn_vec, string fn_out, string cellular_tag, string molecular_tag, int nthreads)
+unsigned long long Mapping::parse_align_files(const vector<string> &fn_vec, const string &fn_out, int nthreads, const std::function<ReadTagger(size_t)> &make_tagger, unsigned long long counts[5])
 {
-  
-  if (fn_vec.size()>1)
+  for (const string &fn : fn_vec)
   {
-    sc_atac_parse_align(fn_vec[0], fn_out, cellular_tag, molecular_tag, nthreads);
-    for (int i=1;i<fn_vec.size();i++)
+    check_file_exists(fn); // htslib does not check if file exist so we do it manually
+  }
+  BGZF *fp = bgzf_open(fn_vec[0].c_str(), "r");
+  bam_hdr_t *header = fp ? bam_hdr_read(fp) : NULL;
+  if (fp) bgzf_close(fp);
+  if (!header)
+  {
+    stop("fail to read the bam header: " + fn_vec[0] + "\n");
+  }
+  check_contigs(header);
+  
+  int n_workers = std::max(std::min<int>(nthreads, fn_vec.size()), 1);
+  // one htslib pool does the (de)compression for every file opened by the workers
+  HtsPool pool(nthreads > 1 ? nthreads : 0);
+  // a single worker writes the files in order anyway, part files are only
+  // needed to restore the input order after concurrent tagging
+  bool use_parts = ordered_merge && n_workers > 1;
+  Rcout << "tagging " << fn_vec.size() << " bam files on " << n_workers << " threads..." << "\n";
+  
+  // part 0 holds the header, file i is written to part i+1
+  vector<string> parts;
+  if (use_parts)
+  {
+    for (size_t i = 0; i <= fn_vec.size(); i++)
     {
-      sc_atac_parse_align(fn_vec[i], fn_out, cellular_tag, molecular_tag, nthreads);
+      parts.push_back(fn_out + ".part" + padding(i, 5));
     }
   }
+  BGZF *out = bgzf_open(use_parts ? parts[0].c_str() : fn_out.c_str(), out_mode("w").c_str());
+  if (!out || bam_hdr_write(out, header) < 0 || (use_parts && bgzf_close(out) < 0))
+  {
+    stop("fail to write the bam header: " + fn_out + "\n");
+  }
+  if (use_parts)
+  {
+    out = NULL;
+  }
   else
   {
-    sc_atac_parse_align(fn_vec[0], fn_out, cellular_tag, molecular_tag, nthreads);
+    pool.attach(out);
+  }
+
+  atomic<size_t> next_file{0};
+  atomic<unsigned long long> cnt{0};
+  atomic<int> n_running{n_workers};
+  atomic<bool> interrupted{false};
+  std::mutex mtx;
+  std::mutex out_mtx;
+  string err;
+  
+  auto worker = [&]()
+  {
+    // reads are written in batches so the shared output is locked once per batch
+    vector<bam1_t*> batch(use_parts ? 1 : 1024);
+    for (auto &b : batch)
+    {
+      b = bam_init1();
+    }
+    unsigned long long t_c[5] = {0,0,0,0,0};
+    string t_err;
+  
+    size_t i;
+    while (t_err.empty() && !interrupted && (i = next_file++) < fn_vec.size())
+    {
+      BGZF *in = bgzf_open(fn_vec[i].c_str(), "r");
+      bam_hdr_t *t_header = in ? bam_hdr_read(in) : NULL;
+      BGZF *t_out = out;
+      if (!t_header)
+      {
+        t_err = "fail to read the bam header: " + fn_vec[i] + "\n";
+      }
+      else if (!same_references(header, t_header))
+      {
+        t_err = "bam files have different references: " + fn_vec[0] + ", " + fn_vec[i] + "\n";
+      }
+      else if (use_parts && !(t_out = bgzf_open(parts[i + 1].c_str(), out_mode("w").c_str())))
+      {
+        t_err = "fail to open part output: " + parts[i + 1] + "\n";
+      }
+      if (t_err.empty())
+      {
+        pool.attach(in);
+        if (use_parts) pool.attach(t_out);
+      }
+      ReadTagger tag = t_err.empty() ? make_tagger(i) : ReadTagger();
+  
+      size_t n = 0;
+      auto flush = [&]()
+      {
+        std::unique_lock<std::mutex> lock(out_mtx, std::defer_lock);
+        if (!use_parts) lock.lock();
+        for (size_t k = 0; k < n && t_err.empty(); k++)
+        {
+          if (bam_write1(t_out, batch[k]) < 0)
+          {
+            t_err = string("fail to write the bam file: ") + bam_get_qname(batch[k]) + "\n";
+          }
+        }
+        n = 0;
+      };
+      int re = -1;
+      unsigned long long t_cnt = 0;
+      while (t_err.empty() && (re = bam_read1(in, batch[n])) >= 0)
+      {
+        if (++t_cnt % 32768 == 0 && interrupted)
+        {
+          re = -1;
+          break;
+        }
+        cnt++;
+        int ret;
+        try
+        {
+          ret = tag(t_header, batch[n]);
+        }
+        catch (const std::exception &e)
+        {
+          t_err = e.what();
+          break;
+        }
+        if (ret <= 0)
+        {
+          t_c[0]++;
+        }
+        else if (ret <= 4)
+        {
+          t_c[ret]++;
+        }
+        if (++n == batch.size())
+        {
+          flush();
+        }
+      }
+      flush();
+      if (t_err.empty() && re < -1)
+      {
+        t_err = "fail to read the bam file: " + fn_vec[i] + "\n";
+      }
+      if (use_parts && t_out && pool.close(t_out) < 0 && t_err.empty())
+      {
+        t_err = "fail to write part output: " + parts[i + 1] + "\n";
+      }
+      if (t_header) bam_hdr_destroy(t_header);
+      if (in) pool.close(in);
+    }
+
+    for (auto &b : batch)
+    {
+      bam_destroy1(b);
+    }
+
+    std::lock_guard<std::mutex> lock(mtx);
+    for (int k = 0; k < 5; k++)
+    {
+      counts[k] += t_c[k];
+    }
+    if (err.empty())
+    {
+      err = t_err;
+    }
+    if (!t_err.empty())
+    {
+      next_file = fn_vec.size(); // stop the other threads
+    }
+    n_running--;
+  };
+  
+  Timer timer;
+  timer.start();
+  vector<thread> threads;
+  for (int t = 0; t < n_workers; t++)
+  {
+    threads.push_back(thread(worker));
+  }
+  bool ok = true;
+  auto finish = [&]()
+  {
+    for (auto &t : threads)
+    {
+      t.join();
+    }
+    bam_hdr_destroy(header);
+    ok = !out || pool.close(out) == 0;
+  };
+  auto remove_parts = [&]()
+  {
+    for (const string &part : parts)
+    {
+      std::remove(part.c_str());
+    }
+  };
+  try
+  {
+    wait_for_workers(n_running, cnt, timer, &interrupted);
+  }
+  catch (...)
+  {
+    // user interrupt, the workers stop at their next batch
+    finish();
+    remove_parts();
+    throw;
+  }
+  finish();
+  
+  if (!err.empty())
+  {
+    remove_parts();
+    stop(err);
   }
+  if (!ok || (use_parts && !concat_bgzf(parts, fn_out)))
+  {
+    stop("fail to write the bam file: " + fn_out + "\n");
+  }
+
+  Rcout
+    << cnt << " reads processed" << ", "
+    << cnt / std::max(timer.seconds_elapsed(), 1u) / 1000 << "k reads/sec" << endl;
+  return cnt;
 }
 
 namespace {
 std::pair<int, int> get_bc_umi_lengths(string bam_fn) {
   BGZF *fp = bgzf_open(bam_fn.c_str(), "r"); // input file
-  //bam_hdr_t *bam_hdr = bam_hdr_read(fp);
-  bam_hdr_read(fp);
+  bam_hdr_t *bam_hdr = bam_hdr_read(fp);
   
   bam1_t *bam_record = bam_init1();
   
-  if (bam_read1(fp, bam_record) >= 0) {
-    string read_header = bam_get_qname(bam_record);
+  int re = bam_read1(fp, bam_record);
+  string read_header = re >= 0 ? bam_get_qname(bam_record) : "";
+  bam_destroy1(bam_record);
+  if (bam_hdr) bam_hdr_destroy(bam_hdr);
+  bgzf_close(fp);
+  
+  if (re >= 0) {
     int break_pos = read_header.find("#");
     // start from 1 to exclude @
     string first_section = read_header.substr(1, break_pos);
@@ -957,9 +2468,66 @@ std::pair<int, int> get_bc_umi_lengths(string bam_fn) {
     throw std::runtime_error("BAM file reading failed.");
   }
 }
+
+// move the barcode and UMI from the read name to bam tags
+void append_atac_tags(bam1_t *b, int bc_len, int UMI_len, const char *c_ptr, const char *m_ptr, AuxTagBuilder &tags)
+{
+  if (bc_len > 0)
+  {
+    tags.add_str(c_ptr, bam_get_qname(b), bc_len);
+  }
+
+  if (UMI_len > 0)
+  {
+    tags.add_str(m_ptr, bam_get_qname(b)+bc_len+1, UMI_len); // `+1` to skip separator
+  }
+  if (tags.write(b) < 0)
+  {
+    throw std::runtime_error(string("fail to add the bam tags: ") + bam_get_qname(b) + "\n");
+  }
+}
+}
+
+void Mapping::sc_atac_parse_align_warpper(vector<string> fn_vec, string fn_out, string cellular_tag, string molecular_tag, int nthreads)
+{
+  if (fn_vec.size() == 1)
+  {
+    sc_atac_parse_align(fn_vec[0], fn_out, cellular_tag, molecular_tag, nthreads);
+    return;
+  }
+
+  // the read name layout is detected here since only this thread can talk to R
+  vector<std::pair<int, int>> lengths;
+  for (size_t i = 0; i < fn_vec.size(); i++)
+  {
+    check_file_exists(fn_vec[i]);
+    lengths.push_back(get_bc_umi_lengths(fn_vec[i]));
+    if (i == 0 || lengths[i] != lengths[i - 1])
+    {
+      Rcout << fn_vec[i] << ": Detected bc_len: " << lengths[i].first << "  Detected UMI len:  " << lengths[i].second << "\n";
+    }
+  }
+
+  const char *c_ptr = cellular_tag.c_str();
+  const char *m_ptr = molecular_tag.c_str();
+  auto make_tagger = [&](size_t i) -> ReadTagger
+  {
+    int bc_len = lengths[i].first;
+    int UMI_len = lengths[i].second;
+    std::shared_ptr<AuxTagBuilder> tags = std::make_shared<AuxTagBuilder>();
+    return [bc_len, UMI_len, c_ptr, m_ptr, tags](bam_hdr_t *header, bam1_t *b)
+    {
+      append_atac_tags(b, bc_len, UMI_len, c_ptr, m_ptr, *tags);
+      return 0;
+    };
+  };
+  
+  unsigned long long counts[5] = {0,0,0,0,0};
+  unsigned long long cnt = parse_align_files(fn_vec, fn_out, nthreads, make_tagger, counts);
+  Rcout << "number of read processed: " << cnt << "\n";
 }
 
-void Mapping::sc_atac_parse_align(string bam_fn, string fn_out, string cellular_tag, string molecular_tag, int nthreads)
+  void Mapping::sc_atac_parse_align(string bam_fn, string fn_out, string cellular_tag, string molecular_tag, int nthreads)
 {
   
   
@@ -971,18 +2539,17 @@ void Mapping::sc_atac_parse_align(string bam_fn, string fn_out, string cellular_
   
   Rcout << "Detected bc_len: " << bc_len << "  Detected UMI len:  " << UMI_len  << "\n";
   
-  string write_mode = "wb";
+  string write_mode = out_mode("wb");
   const char * c_write_mode = write_mode.c_str();
   // open files
   bam1_t *b = bam_init1();
   BGZF *fp = bgzf_open(bam_fn.c_str(), "r"); // input file
   samFile *of = sam_open(fn_out.c_str(), c_write_mode); // output file
   
-  // set up htslib threadpool for output
-  int out_threads = std::max(nthreads - 1, 1);
-  htsThreadPool p = {NULL, 0};
-  p.pool = hts_tpool_init(out_threads);
-  hts_set_opt(of, HTS_OPT_THREAD_POOL, &p);
+  // this thread tags the reads, the other threads share the input and output (de)compression
+  HtsPool pool(std::max(nthreads - 1, 1));
+  pool.attach(fp);
+  pool.attach(of);
   
   int hts_retcode;
   
@@ -993,7 +2560,7 @@ void Mapping::sc_atac_parse_align(string bam_fn, string fn_out, string cellular_
   
   const char * c_ptr = cellular_tag.c_str();
   const char * m_ptr = molecular_tag.c_str();
-  char buf[999] = ""; // assume the length of barcode or UMI is less than 999
+  AuxTagBuilder tags;
   
   atomic<unsigned long long> cnt{0};
   atomic<bool> running{true};
@@ -1033,19 +2600,7 @@ void Mapping::sc_atac_parse_align(string bam_fn, string fn_out, string cellular_
       report_message = false;
     }
     
-    if (bc_len > 0)
-    {
-      memcpy(buf, bam_get_qname(b), bc_len * sizeof(char));
-      buf[bc_len] = '\0';
-      bam_aux_append(b, c_ptr, 'Z', bc_len+1, (uint8_t*)buf);
-    }
-    
-    if (UMI_len > 0)
-    {
-      memcpy(buf, bam_get_qname(b)+bc_len+1, UMI_len * sizeof(char)); // `+1` to add separator
-      buf[UMI_len] = '\0';
-      bam_aux_append(b, m_ptr, 'Z', UMI_len+1, (uint8_t*)buf);
-    }
+    append_atac_tags(b, bc_len, UMI_len, c_ptr, m_ptr, tags);
     
     int re = sam_write1(of, header, b);
     if (re < 0)
@@ -1067,7 +2622,6 @@ void Mapping::sc_atac_parse_align(string bam_fn, string fn_out, string cellular_
   
   Rcout << "number of read processed: " << cnt << "\n";
   
-  sam_close(of);
-  bgzf_close(fp);
-  if (p.pool) hts_tpool_destroy(p.pool);
+  pool.close(of);
+  pool.close(fp);
 }
\ No newline at end of file
@@ -3,9 +3,16 @@
 
 #include <algorithm>
 #include <atomic>
+#include <cstdint>
+#include <cstdio>
 #include <cstring>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
 #include <Rcpp.h>
 #include <regex>
 #include <string>
@@ -15,9 +22,12 @@
 #include <utility>
 #include <vector>
 #include "config_hts.h"
+#include "bamtags.h"
+#include "htspool.h"
 #include "utils.h"
 #include "Gene.h"
 #include "Interval.h"
+#include "StrView.h"
 #include "Timer.h"
 
 #ifndef TRANSCRIPTMAPPING_H
@@ -97,6 +107,30 @@ private:
     const unsigned int bin_size = 64;
 };
 
+// run-length encoded feature lookup of one chromosome. all positions between two
+// breakpoints (gene or exon boundaries) overlap the same set of genes and exons,
+// so a block is classified by a binary search and a scan over the few runs it covers
+class FeatureRuns {
+public:
+    // build from the genes of a chromosome, features refer to genes by their index
+    void build(const std::vector<Gene> &genes);
+
+    // set `hits` to (gene index, overlaps an exon) of every gene overlapping `it`,
+    // sorted by gene index. strand is not considered
+    void query(const Interval &it, std::vector<std::pair<unsigned int, bool>> &hits) const;
+
+    size_t n_runs() const { return run_st.size(); }
+    size_t n_features() const { return feature_offset.empty() ? 0 : feature_offset.size() - 1; }
+    // approximate memory used by the tables in bytes
+    size_t memory_usage() const;
+
+private:
+    std::vector<int> run_st; // first position of each run
+    std::vector<unsigned int> run_feature; // feature set of each run, 0 is intergenic
+    std::vector<unsigned int> feature_offset; // feature set i is entries[feature_offset[i], feature_offset[i+1])
+    std::vector<unsigned int> entries; // gene index << 1 | overlaps exon
+};
+
 // parse gff3 genome annotation
 class GeneAnnotation
 {
@@ -106,6 +140,18 @@ public:
 
     std::unordered_map<std::string, std::vector<Gene>> gene_dict;
     std::unordered_map<std::string, GeneBins> bins_dict;
+    // optional feature lookup tables, see `build_feature_runs`
+    std::unordered_map<std::string, FeatureRuns> runs_dict;
+
+    // if not empty, only contigs in this set (named as in the bam file) are loaded
+    std::unordered_set<std::string> contig_filter;
+
+    // check if a contig passes `contig_filter`
+    bool keep_contig(const StrView &chr, bool fix_chrname) const;
+
+    // build feature lookup tables for the given chromosomes, all if empty.
+    // they must be rebuilt after more annotation is added
+    void build_feature_runs(const std::vector<std::string> &chrs);
 
     //get number of genes
     int ngenes();
@@ -113,7 +159,10 @@ public:
     //return all gene id as a std::vector
     std::vector<std::string> get_genelist();
 
-    void parse_gff3_annotation(std::string gff3_fn, bool fix_chrname);
+    // annotation files can be plain text or gzip compressed, they are split into
+    // line aligned chunks which are tokenised on `nthreads` threads
+    void parse_gff3_annotation(std::string gff3_fn, bool fix_chrname, int nthreads = 1);
+    void parse_gtf_annotation(std::string gtf_fn, bool fix_chrname, int nthreads = 1);
     void parse_saf_dataframe(Rcpp::DataFrame anno_df, bool fix_chrname);
 
     // https://genome.ucsc.edu/FAQ/FAQformat.html#format1
@@ -130,7 +179,7 @@ public:
     // 10. blockCount - The number of blocks (exons) in the BED line.
     // 11. blockSizes - A comma-separated list of the block sizes. The number of items in this list should correspond to blockCount.
     // 12. blockStarts - A comma-separated list of block starts. All of the blockStart positions should be calculated relative to chromStart. The number of items in this list should correspond to blockCount.
-    void parse_bed_annotation(std::string bed_fn, bool fix_chrname);
+    void parse_bed_annotation(std::string bed_fn, bool fix_chrname, int nthreads = 1);
 
     friend std::ostream& operator<< (std::ostream& out, const GeneAnnotation& obj);
 
@@ -146,57 +195,221 @@ private:
     const int PHASE      = 7;
     const int ATTRIBUTES = 8;
 
+    enum AnnoFormat { GFF3, GTF, BED };
+
+    // exon entry of an annotation file, views point into the file content
+    struct ExonRecord
+    {
+        StrView chr;
+        StrView target; // gene id, or parent transcript id for ENSEMBL gff3
+        StrView line;
+        Interval it;
+    };
+
+    // entries collected from one chunk of an annotation file
+    struct AnnoChunk
+    {
+        std::vector<StrView> genes;
+        std::vector<std::pair<StrView, StrView>> transcripts; // (ID, Parent)
+        std::vector<ExonRecord> exons;
+    };
+
     // get attribute from gff3 standard columns
-    std::string get_attribute(const std::vector<std::string> &all_attributes, const std::string &target_attribute);
+    StrView get_attribute(const std::vector<StrView> &all_attributes, const char *target_attribute) const;
+    // get attribute from gtf `key "value";` columns
+    StrView get_gtf_attribute(const std::vector<StrView> &all_attributes, const char *target_attribute) const;
     // convert strand from +- symbols to -1 or 1
-    int get_strand(char st);
+    int get_strand(char st) const;
 
-    const std::string get_parent(const std::vector<std::string> &attributes);
-    std::string get_ID(const std::vector<std::string> &attributes);
+    StrView get_parent(const std::vector<StrView> &attributes) const;
+    StrView get_ID(const std::vector<StrView> &attributes) const;
 
     // add chr to molecule names if requested
-    std::string fix_name(std::string chr_name);
+    std::string fix_name(std::string chr_name) const;
 
-    // parse entry of gff3 annotation and add its information to this object
-    void parse_anno_entry(
-        const bool &fix_chrname,
-        const std::string &line,
-        std::unordered_map<std::string, std::unordered_map<std::string, Gene>> &chr_to_genes_dict,
-        std::unordered_map<std::string, std::string> &transcript_to_gene_dict
-    );
+    // read the header and the contigs in `contig_filter` through a tabix index.
+    // return false if the file is not indexed or no filter is set
+    bool read_indexed_contigs(const std::string &fn, bool fix_chrname, std::string &content) const;
+
+    // tokenise one chunk of an annotation file, safe to run concurrently
+    void parse_anno_chunk(const StrView &chunk, AnnoFormat format, bool fix_chrname, AnnoChunk &records) const;
+    // parse all chunks of the file content and merge them into this object
+    void parse_chunks(const StrView &content, AnnoFormat format, bool fix_chrname, int nthreads);
+    // flatten, sort and bin genes, then add them to `gene_dict` and `bins_dict`
+    void add_genes(std::unordered_map<std::string, std::unordered_map<std::string, Gene>> &chr_to_genes_dict);
 
     // generic gene_id getter for gff3 entries
-    std::string get_gene_id(const std::vector<std::string> &attributes);
+    StrView get_gene_id(const std::vector<StrView> &attributes) const;
 
     // specific gene_id getter for gff3 entries
-    std::string get_gencode_gene_id(const std::vector<std::string> &attributes);
-    std::string get_refseq_gene_id(const std::vector<std::string> &attributes);
+    StrView get_gencode_gene_id(const std::vector<StrView> &attributes) const;
+    StrView get_refseq_gene_id(const std::vector<StrView> &attributes) const;
 
     // guess the source of annotation
-    std::string guess_anno_source(std::string gff3_fn);
+    std::string guess_anno_source(const StrView &content);
+
+    bool is_gene(const std::vector<StrView> &fields, const std::vector<StrView> &attributes) const;
+};
+
+
+// streaming gene lookup for reads in coordinate order. the genes that may overlap
+// the current read are kept in a window that only moves forward: genes enter when
+// a block reaches their start and leave once a read starts after their end.
+// reads out of order are refused so the caller can use the indexed lookup instead.
+// one cursor per thread, the annotation must not change while it is in use
+class AnnoCursor
+{
+public:
+    // number of reads refused because they were out of order
+    unsigned long long fallbacks = 0;
+
+    explicit AnnoCursor(const GeneAnnotation &anno);
 
-    const bool parent_is_gene(const std::string &parent);
-    const bool parent_is_known_transcript(const std::unordered_map<std::string, std::string> &transcript_to_gene_dict, const std::string &parent);
-    const bool is_gene(const std::vector<std::string> &fields, const std::vector<std::string> &attributes);
-    const bool is_exon(const std::vector<std::string> &fields, const std::vector<std::string> &attributes);
-    const bool is_transcript(const std::vector<std::string> &fields, const std::vector<std::string> &attributes);
+    // move to a read starting at `pos` on chromosome `tid`, return false if the read
+    // is before the current position or on an already visited chromosome
+    bool seek(const bam_hdr_t *header, int tid, int pos);
+
+    // append the genes overlapping `it`, a block of the read given to the last `seek`
+    void overlapping(const Interval &it, std::vector<const Gene*> &matched_genes);
+
+private:
+    const GeneAnnotation &anno;
+    const std::vector<Gene> *genes = NULL; // genes of the current chromosome, sorted by start
+    size_t next_gene = 0; // first gene not yet in the window
+    std::vector<const Gene*> active;
+    int cur_tid = -1;
+    int cur_pos = -1;
+    std::vector<bool> visited;
 };
 
+// bounded direct-mapped cache of `map_exon` results keyed by the alignment footprint
+// (chromosome, position, strand and CIGAR), duplicated reads then skip the gene lookup.
+// each slot is two relaxed atomic words, the key stored xor-ed with the value, so a
+// slot torn by a concurrent writer fails the key check and counts as a miss
+class AlignmentCache
+{
+public:
+    AlignmentCache() {}
+    // the entries are only a speed-up, so a moved-to cache starts empty
+    AlignmentCache(AlignmentCache &&) {}
+
+    // drop all entries and statistics, and allocate `n_slots` (rounded up to a
+    // power of two) if the size changed. 0 disables the cache
+    void reset(size_t n_slots);
+    bool enabled() const { return n_slots > 0; }
+
+    // hash of the fields `map_exon` depends on, never 0
+    static uint64_t footprint(const bam1_t *b, bool m_strand);
+
+    bool get(uint64_t key, int &ret, int &gene_idx) const;
+    void put(uint64_t key, int ret, int gene_idx);
+
+    // count a lookup in the counters of the calling thread
+    void count(bool hit);
+    unsigned long long hits() const;
+    unsigned long long misses() const;
+
+    // every 64th lookup of a thread is timed to estimate the time saved by the hits
+    bool sample_lookup();
+    void add_sample(bool hit, unsigned long long ns);
+    // estimated mapping time saved by the cache in seconds
+    double seconds_saved() const;
+
+private:
+    struct Slot
+    {
+        std::atomic<uint64_t> check{0};
+        std::atomic<uint64_t> value{0};
+    };
+    std::unique_ptr<Slot[]> slots;
+    size_t n_slots = 0;
+    // lookups are counted per thread, padded so the threads do not share cache lines
+    static const size_t n_counters = 64;
+    struct Counter
+    {
+        std::atomic<unsigned long long> hits{0};
+        std::atomic<unsigned long long> misses{0};
+        char pad[48];
+    };
+    Counter counters[n_counters];
+    Counter &thread_counter();
+    std::atomic<unsigned long long> hit_ns{0};
+    std::atomic<unsigned long long> hit_samples{0};
+    std::atomic<unsigned long long> miss_ns{0};
+    std::atomic<unsigned long long> miss_samples{0};
+};
 
 class Mapping
 {
 public:
     GeneAnnotation Anno;
-    void add_annotation(std::string gff3_fn, bool fix_chrname);
+    // map coordinate-sorted, indexed bam files by genomic region on separate threads
+    // in `parse_align` when more than one thread is given
+    bool region_parallel = true;
+    // number of regions per thread, more regions balance uneven coverage better
+    int regions_per_thread = 4;
+    // keep the reads of multiple input bam files in the order the files are given when
+    // merging them, otherwise each file is written as soon as its reads are tagged
+    bool ordered_merge = true;
+    // number of `map_exon` results cached by alignment footprint, 0 to disable the cache
+    size_t cache_slots = 1 << 20;
+    // tag receiving the RNA velocity status of reads mapped to the exons or introns of
+    // a single gene, see `splice_status`, followed by the gene id as in "U:gene_id".
+    // the gene tag stays on exonic reads only. empty to skip
+    std::string velocity_tag;
+    // drop the sequence and base qualities from the reads written by `parse_align`,
+    // for output that is only read again by `barcode_demultiplex`
+    bool slim_bam = false;
+    // with `slim_bam`, also replace the read names by "*" when the UMI is moved to a tag
+    bool slim_qname = false;
+    // bgzf compression level (0-9) of the output bam, -1 for the htslib default
+    int compress_level = -1;
+    // annotation matched against every read in the same pass as `Anno`, e.g. spike-ins or
+    // repeats. the id of the feature a read uniquely maps to is written to `tag`
+    struct FeatureSet
+    {
+        std::string name;
+        std::string tag;
+        std::shared_ptr<Mapping> mapping;
+    };
+    std::vector<FeatureSet> feature_sets;
+    void add_annotation(std::string gff3_fn, bool fix_chrname, int nthreads = 1);
     void add_annotation(Rcpp::DataFrame anno, bool fix_chrname);
+    // only load annotation for the contigs listed in the headers of these bam files,
+    // must be called before `add_annotation`
+    void restrict_to_bam_contigs(const std::vector<std::string> &bam_fns);
+    // add a named feature set from a SAF data frame, its reads are tagged with `tag`
+    void add_feature_set(std::string name, std::string tag, Rcpp::DataFrame anno, bool fix_chrname);
     // return:
     //  <=0 - unique map to exon, number indicate the distance to transcript end pos
     //  1 - ambiguous map to multiple exon
     //  2 - map to intron
     //  3 - unmapped
     //  4 - unaligned
-    int map_exon(bam_hdr_t *header, bam1_t *b, std::string& gene_id, bool m_strand);
-
+    // the optional cursor speeds up the gene lookup for coordinate-sorted input
+    int map_exon(bam_hdr_t *header, bam1_t *b, std::string& gene_id, bool m_strand, AnnoCursor *cursor = NULL);
+    // build feature lookup tables for the given chromosomes (all if `chrs` is "*"),
+    // then report their build time, memory and lookup speed against the gene bins
+    void build_feature_lookup(const std::vector<std::string> &chrs);
+    // classify a read against the gene `gene_id`, or if empty against the only gene
+    // overlapping the read, whose id is then written to `gene_id`:
+    //  'S' - spliced, all aligned blocks lie inside exons
+    //  'U' - unspliced, some block reaches into an intron
+    //  'A' - ambiguous, intronic blocks in a read with a splice junction, or a block
+    //        reaching past either end of the gene
+    // return 0 if no single gene is found
+    char splice_status(bam_hdr_t *header, bam1_t *b, bool m_strand, std::string &gene_id);
+    // report bam chromosomes missing from the annotation, stop if none is annotated
+    void check_contigs(const bam_hdr_t *header);
+    // bam files can only be merged under one header, or share the `map_exon` cache
+    // keyed by tid, if their references are the same
+    static bool same_references(const bam_hdr_t *a, const bam_hdr_t *b);
+    // empty the `map_exon` cache before mapping, not safe while reads are mapped
+    void reset_map_cache();
+    // report the hit rate and estimated time saved by the `map_exon` cache
+    void report_map_cache();
+
+    // multiple bam files (e.g. one per cell) are tagged concurrently and merged into `fn_out`
     void parse_align_warpper(std::vector<std::string> fn_vec, std::vector<std::string> cell_id_vec, std::string fn_out, bool m_strand, std::string map_tag, std::string gene_tag, std::string cellular_tag, std::string molecular_tag, int bc_len, int UMI_len, int nthreads);
     // @param: m_strand, match based on strand or not
     // @param: fn_out, output bam file
@@ -207,7 +420,58 @@ public:
     void sc_atac_parse_align_warpper(std::vector<std::string> fn_vec, std::string fn_out,  std::string cellular_tag, std::string molecular_tag, int nthreads);
     void sc_atac_parse_align(std::string fn, std::string fn_out, std::string cellular_tag, std::string molecular_tag, int nthreads);
     
-    /* data */
+private:
+    AlignmentCache map_cache;
+
+    // `map_exon` without the cache, `hit_gene` is set to the gene of a unique exon match
+    int map_exon_blocks(bam_hdr_t *header, bam1_t *b, std::string& gene_id, bool m_strand, AnnoCursor *cursor, const Gene **hit_gene);
+
+    // bam tags and read name layout used by `parse_align`
+    struct TagOptions
+    {
+        std::string map_tag;
+        std::string gene_tag;
+        std::string cellular_tag;
+        std::string molecular_tag;
+        int bc_len;
+        int UMI_len;
+        std::string cell_id;
+        bool m_strand;
+    };
+
+    // genomic region [beg, end) of a chromosome, tid is HTS_IDX_NOCOOR for unplaced unmapped reads
+    struct AlignRegion
+    {
+        int tid;
+        int beg;
+        int end;
+    };
+
+    // map one read and append the gene, barcode, UMI and mapping status tags through
+    // `tags`, one builder per thread, then slim it down if `slim_bam` is set. safe to call concurrently, returns the `map_exon` code or 4 if unaligned.
+    // throws std::runtime_error if the tags cannot be added, so worker threads can report it
+    int tag_read(bam_hdr_t *header, bam1_t *b, const TagOptions &opt, AnnoCursor *cursor, AuxTagBuilder &tags);
+
+    // append the compression level to an htslib write mode
+    std::string out_mode(const std::string &mode) const;
+
+    // split the chromosomes into about `n_regions` regions with similar read counts
+    std::vector<AlignRegion> split_regions(const bam_hdr_t *header, const hts_idx_t *idx, int n_regions);
+
+    // `parse_align` on `nthreads` threads, each mapping whole regions into its own
+    // BGZF part file. the parts are concatenated in region order so the output stays
+    // sorted. return false without doing anything if the bam file has no index
+    bool parse_align_regions(std::string bam_fn, std::string fn_out, const TagOptions &opt, int nthreads);
+
+    // tag one read in place and return its `map_exon` code
+    typedef std::function<int(bam_hdr_t*, bam1_t*)> ReadTagger;
+
+    // tag the reads of several bam files sharing the same references on a pool of
+    // `nthreads` workers and one htslib thread pool, and merge them into `fn_out`
+    // under the header of the first file. `make_tagger` is called from the workers
+    // once per file. `counts` receives the exon, ambiguous, intron, not mapped and
+    // unaligned totals. return the number of reads processed
+    unsigned long long parse_align_files(const std::vector<std::string> &fn_vec, const std::string &fn_out, int nthreads, const std::function<ReadTagger(size_t)> &make_tagger, unsigned long long counts[5]);
 };
 
 #endif
@@ -1,5 +1,12 @@
 #include "utils.h"
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 using namespace Rcpp;
 
 using std::ifstream;
@@ -72,6 +79,63 @@ void check_file_exists(string fn)
     }   
 }
 
+string read_text_file(const string &fn)
+{
+    check_file_exists(fn);
+    gzFile fp = gzopen(fn.c_str(), "rb"); // gzread passes plain text through unchanged
+    if (!fp)
+    {
+        throw invalid_argument("cannot open file: " + fn + "\n");
+    }
+    gzbuffer(fp, 1 << 20);
+
+    string content;
+    const size_t buf_size = 1 << 22;
+    vector<char> buf(buf_size);
+    int n;
+    while ((n = gzread(fp, buf.data(), buf_size)) > 0)
+    {
+        content.append(buf.data(), n);
+    }
+    gzclose(fp);
+    if (n < 0)
+    {
+        throw invalid_argument("failed to read file: " + fn + "\n");
+    }
+    return content;
+}
+
+FileView::FileView(const string &fn, bool read_fallback)
+{
+#ifndef _WIN32
+    int fd = open(fn.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED)
+        {
+            mapped = (const char*)p;
+            len = st.st_size;
+        }
+    }
+    if (fd >= 0) close(fd);
+#endif
+    if (!mapped && read_fallback)
+    {
+        ifstream in(fn, std::ios::binary);
+        copy.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        len = copy.size();
+    }
+}
+
+FileView::~FileView()
+{
+#ifndef _WIN32
+    if (mapped) munmap((void*)mapped, len);
+#endif
+}
+
 // tally the element in vector
 map<umi_pos_pair, int> vector_counter(const vector<umi_pos_pair> &v)
 {
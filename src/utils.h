@@ -32,6 +32,31 @@ int edit_distance(const std::string& A, const std::string& B);
 // if file not exist throw an exception
 void check_file_exists (std::string name);
 
+// read a whole file into memory, gzip compressed files are
+// decompressed on the fly and plain text files are read as is
+std::string read_text_file(const std::string &fn);
+
+// a file memory mapped where supported. otherwise it is read into memory, or left
+// empty with `read_fallback` false for callers that read the file themselves
+class FileView
+{
+public:
+    explicit FileView(const std::string &fn, bool read_fallback = true);
+    ~FileView();
+
+    FileView(const FileView&) = delete;
+    FileView &operator=(const FileView&) = delete;
+
+    bool is_mapped() const { return mapped != NULL; }
+    const char *data() const { return mapped ? mapped : copy.data(); }
+    size_t size() const { return len; }
+
+private:
+    const char *mapped = NULL;
+    size_t len = 0;
+    std::string copy;
+};
+
 // count times of occurrence in a string vector
 std::map<umi_pos_pair, int> vector_counter(const std::vector<umi_pos_pair> &v);
 